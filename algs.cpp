@@ -264,7 +264,7 @@ uint32 sort_and_release_dups(OBJ *objs, uint32 size) {
 
   uint32 idx = 0;
   if (inline_count > 0) {
-    std::sort(objs, objs+inline_count, obj_inline_less());
+    adaptive_sort(objs, objs+inline_count, obj_inline_less());
 
     OBJ last_obj = objs[0];
     for (uint32 i=1 ; i < inline_count ; i++) {
@@ -283,7 +283,7 @@ uint32 sort_and_release_dups(OBJ *objs, uint32 size) {
       return idx;
   }
 
-  std::sort(objs+inline_count, objs+size, obj_less());
+  adaptive_sort(objs+inline_count, objs+size, obj_less());
 
   if (idx != inline_count)
     objs[idx] = objs[inline_count];
@@ -380,7 +380,7 @@ uint32 sort_and_check_no_dups(OBJ *keys, OBJ *values, uint32 size) {
 
 
 void sort_obj_array(OBJ *objs, uint32 len) {
-  std::sort(objs, objs+len, obj_less());
+  adaptive_sort(objs, objs+len, obj_less());
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -81,19 +81,39 @@ bool has_key(OBJ rel, OBJ arg1) {
   return count > 0;
 }
 
-bool has_field(OBJ rec_or_tag_rec, uint16 field_symb_idx) {
-  OBJ rec = is_tag_obj(rec_or_tag_rec) ? get_inner_obj(rec_or_tag_rec) : rec_or_tag_rec;
+// Record keys are symbols sorted by their index, so a field can be located
+// with a binary search. Records with the same set of keys store a given field
+// in the same slot, so the slot found last time at a given call site (which
+// the generated code can cache) is tried first, at the cost of a single comparison
+static uint32 find_field_slot(OBJ rec, uint16 field_symb_idx, uint32 &slot_hint) {
+  if (is_empty_rel(rec))
+    return INVALID_INDEX;
+
+  BIN_REL_OBJ *ptr = get_bin_rel_ptr(rec);
+  uint32 size = ptr->size;
+  OBJ *keys = ptr->buffer;
 
-  if (!is_empty_rel(rec)) {
-    BIN_REL_OBJ *ptr = get_bin_rel_ptr(rec);
-    uint32 size = ptr->size;
-    OBJ *keys = ptr->buffer;
-    for (uint32 i=0 ; i < size ; i++)
-      if (is_symb(keys[i], field_symb_idx))
-        return true;
-  }
+  uint32 hint = slot_hint;
+  if (hint < size && is_symb(keys[hint], field_symb_idx))
+    return hint;
+
+  bool found;
+  uint32 idx = find_obj(keys, size, make_symb(field_symb_idx), found);
+  if (!found)
+    return INVALID_INDEX;
+
+  slot_hint = idx;
+  return idx;
+}
 
-  return false;
+bool has_field(OBJ rec_or_tag_rec, uint16 field_symb_idx) {
+  uint32 slot_hint = INVALID_INDEX;
+  return has_field(rec_or_tag_rec, field_symb_idx, slot_hint);
+}
+
+bool has_field(OBJ rec_or_tag_rec, uint16 field_symb_idx, uint32 &slot_hint) {
+  OBJ rec = is_tag_obj(rec_or_tag_rec) ? get_inner_obj(rec_or_tag_rec) : rec_or_tag_rec;
+  return find_field_slot(rec, field_symb_idx, slot_hint) != INVALID_INDEX;
 }
 
 bool has_triple(OBJ rel, OBJ arg1, OBJ arg2, OBJ arg3) {
@@ -282,17 +302,17 @@ OBJ lookup(OBJ rel, OBJ key) {
 }
 
 OBJ lookup_field(OBJ rec_or_tag_rec, uint16 field_symb_idx) {
+  uint32 slot_hint = INVALID_INDEX;
+  return lookup_field(rec_or_tag_rec, field_symb_idx, slot_hint);
+}
+
+OBJ lookup_field(OBJ rec_or_tag_rec, uint16 field_symb_idx, uint32 &slot_hint) {
   OBJ rec = is_tag_obj(rec_or_tag_rec) ? get_inner_obj(rec_or_tag_rec) : rec_or_tag_rec;
 
-  if (!is_empty_rel(rec)) {
-    BIN_REL_OBJ *ptr = get_bin_rel_ptr(rec);
-    uint32 size = ptr->size;
-    OBJ *keys = ptr->buffer;
-    OBJ *values = keys + size;
-    for (uint32 i=0 ; i < size ; i++)
-      if (is_symb(keys[i], field_symb_idx))
-        return values[i];
-  }
+  uint32 idx = find_field_slot(rec, field_symb_idx, slot_hint);
+  if (idx == INVALID_INDEX)
+    internal_fail();
 
-  internal_fail();
+  BIN_REL_OBJ *ptr = get_bin_rel_ptr(rec);
+  return get_right_col_array_ptr(ptr)[idx];
 }
@@ -1,13 +1,625 @@
 #include "lib.h"
+#include "btree.h"
+#include "hash-index.h"
+#include "degree-counts.h"
 #include "table-utils.h"
 
 
-void binary_table_init(BINARY_TABLE *table) {
+// The delta and tombstone buffers are merged into the main array once their
+// combined size exceeds MIN_BUFFERED_PAIRS + BUFFERED_PAIRS_FACTOR * sqrt(N),
+// where N is the size of the main array. Updating the buffers is linear in their
+// size, and merging them is linear in N, so keeping them around sqrt(N) balances
+// the cost of small updates against the amortized cost of the merges
+const uint32 MIN_BUFFERED_PAIRS    = 1024;
+const uint32 BUFFERED_PAIRS_FACTOR = 8;
+
+static void set_array(uint64 *&array, uint32 &count, const std::vector<uint64> &pairs) {
+  free(array);
+  count = pairs.size();
+  array = NULL;
+  if (count > 0) {
+    array = (uint64 *) malloc(count * sizeof(uint64));
+    memcpy(array, pairs.data(), count * sizeof(uint64));
+  }
+}
+
+static bool array_contains(const uint64 *array, uint32 count, uint64 pair) {
+  return std::binary_search(array, array + count, pair);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void sorted_pairs_init(SORTED_PAIRS *pairs) {
+  memset(pairs, 0, sizeof(SORTED_PAIRS));
+}
+
+static void sorted_pairs_cleanup(SORTED_PAIRS *pairs) {
+  free(pairs->main);
+  free(pairs->delta);
+  free(pairs->tombstones);
+}
+
+static bool sorted_pairs_contains(SORTED_PAIRS *pairs, uint64 pair) {
+  if (array_contains(pairs->delta, pairs->delta_count, pair))
+    return true;
+  return array_contains(pairs->main, pairs->main_count, pair) &&
+         !array_contains(pairs->tombstones, pairs->tombstones_count, pair);
+}
+
+static void sorted_pairs_merge(SORTED_PAIRS *pairs) {
+  uint64 *main = pairs->main;
+  uint64 *delta = pairs->delta;
+  uint64 *tombstones = pairs->tombstones;
+  uint32 main_count = pairs->main_count;
+  uint32 delta_count = pairs->delta_count;
+  uint32 tombstones_count = pairs->tombstones_count;
+
+  if (delta_count == 0 & tombstones_count == 0)
+    return;
+
+  uint32 count = main_count - tombstones_count + delta_count;
+  uint64 *merged = count > 0 ? (uint64 *) malloc(count * sizeof(uint64)) : NULL;
+
+  uint32 j = 0, k = 0, t = 0;
+  for (uint32 i=0 ; i < main_count ; i++) {
+    uint64 pair = main[i];
+    if (t < tombstones_count && tombstones[t] == pair) {
+      t++;
+      continue;
+    }
+    while (j < delta_count && delta[j] < pair)
+      merged[k++] = delta[j++];
+    merged[k++] = pair;
+  }
+  while (j < delta_count)
+    merged[k++] = delta[j++];
+  assert(k == count & t == tombstones_count);
+
+  sorted_pairs_cleanup(pairs);
+  pairs->main = merged;
+  pairs->main_count = count;
+  pairs->delta = NULL;
+  pairs->delta_count = 0;
+  pairs->tombstones = NULL;
+  pairs->tombstones_count = 0;
+}
+
+// Both deletes and inserts have to be sorted and free of duplicates.
+// All pairs in deletes must be in the table, and no pair in inserts
+// can be in it once the deletes have been applied
+static void sorted_pairs_update(SORTED_PAIRS *pairs, const std::vector<uint64> &deletes, const std::vector<uint64> &inserts) {
+  if (deletes.empty() & inserts.empty())
+    return;
+
+  uint64 *delta = pairs->delta;
+  uint64 *delta_end = delta + pairs->delta_count;
+  uint64 *tombstones = pairs->tombstones;
+  uint64 *tombstones_end = tombstones + pairs->tombstones_count;
+
+  // Deleted pairs are dropped from the delta buffer if they are there,
+  // otherwise they are in the main array and they get a tombstone
+  std::vector<uint64> deleted_from_delta, deleted_from_main;
+  for (uint32 i=0 ; i < deletes.size() ; i++) {
+    uint64 pair = deletes[i];
+    if (std::binary_search(delta, delta_end, pair))
+      deleted_from_delta.push_back(pair);
+    else
+      deleted_from_main.push_back(pair);
+  }
+
+  std::vector<uint64> new_delta;
+  std::set_difference(delta, delta_end, deleted_from_delta.begin(), deleted_from_delta.end(), std::back_inserter(new_delta));
+
+  std::vector<uint64> new_tombstones;
+  std::merge(tombstones, tombstones_end, deleted_from_main.begin(), deleted_from_main.end(), std::back_inserter(new_tombstones));
+
+  // Inserted pairs that have a tombstone are still in the main array,
+  // so removing the tombstone is enough. All others go in the delta buffer
+  std::vector<uint64> revived, inserted;
+  for (uint32 i=0 ; i < inserts.size() ; i++) {
+    uint64 pair = inserts[i];
+    if (std::binary_search(new_tombstones.begin(), new_tombstones.end(), pair))
+      revived.push_back(pair);
+    else
+      inserted.push_back(pair);
+  }
+
+  if (!revived.empty()) {
+    std::vector<uint64> tombstones_left;
+    std::set_difference(new_tombstones.begin(), new_tombstones.end(), revived.begin(), revived.end(), std::back_inserter(tombstones_left));
+    new_tombstones.swap(tombstones_left);
+  }
+
+  if (!inserted.empty()) {
+    std::vector<uint64> merged_delta;
+    std::merge(new_delta.begin(), new_delta.end(), inserted.begin(), inserted.end(), std::back_inserter(merged_delta));
+    new_delta.swap(merged_delta);
+  }
+
+  set_array(pairs->delta, pairs->delta_count, new_delta);
+  set_array(pairs->tombstones, pairs->tombstones_count, new_tombstones);
+
+  uint32 buffered = pairs->delta_count + pairs->tombstones_count;
+  if (buffered > MIN_BUFFERED_PAIRS + BUFFERED_PAIRS_FACTOR * sqrt((double) pairs->main_count))
+    sorted_pairs_merge(pairs);
+}
+
+// Remapping preserves the order of the pairs, so it can be done in place.
+// Pairs with a tombstone may refer to values that are no longer in the
+// value store, so the buffers are merged into the main array first
+static void sorted_pairs_remap(SORTED_PAIRS *pairs, const uint32 *major_map, const uint32 *minor_map) {
+  sorted_pairs_merge(pairs);
+
+  uint64 *main = pairs->main;
+  uint32 count = pairs->main_count;
+  for (uint32 i=0 ; i < count ; i++) {
+    uint32 major = left(main[i]);
+    uint32 minor = right(main[i]);
+    if (major_map != NULL)
+      major = major_map[major];
+    if (minor_map != NULL)
+      minor = minor_map[minor];
+    assert(major != INVALID_INDEX & minor != INVALID_INDEX);
+    main[i] = pack(major, minor);
+  }
+  assert(std::is_sorted(main, main + count));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Advances the main cursor past all the pairs that have a tombstone. Since the
+// tombstones are a subset of the main array and both cursors move forward
+// together, the tombstone cursor never points to a pair lower than *main
+static void skip_tombstones(BINARY_TABLE_ITER *iter) {
+  uint64 *main = iter->main;
+  uint64 *main_end = iter->main_end;
+  uint64 *tombstones = iter->tombstones;
+  uint64 *tombstones_end = iter->tombstones_end;
+  while (main != main_end && tombstones != tombstones_end && *main == *tombstones) {
+    main++;
+    tombstones++;
+  }
+  iter->main = main;
+  iter->tombstones = tombstones;
+}
+
+static void sorted_pairs_get_iter(SORTED_PAIRS *pairs, BINARY_TABLE_ITER *iter, uint64 lower_bound, uint32 value, bool reversed) {
+  iter->main_end = pairs->main + pairs->main_count;
+  iter->main = std::lower_bound(pairs->main, iter->main_end, lower_bound);
+  iter->delta_end = pairs->delta + pairs->delta_count;
+  iter->delta = std::lower_bound(pairs->delta, iter->delta_end, lower_bound);
+  iter->tombstones_end = pairs->tombstones + pairs->tombstones_count;
+  iter->tombstones = std::lower_bound(pairs->tombstones, iter->tombstones_end, lower_bound);
+  iter->leaf = NULL;
+  iter->column = NULL;
+  iter->column_idx = iter->column_end = 0;
+  iter->value = value;
+  iter->reversed = reversed;
+  skip_tombstones(iter);
+}
+
+static void tree_get_iter(BTREE *tree, BINARY_TABLE_ITER *iter, uint64 lower_bound, uint32 value, bool reversed) {
+  btree_seek(tree, lower_bound, iter->main, iter->main_end, iter->leaf);
+  iter->delta = iter->delta_end = NULL;
+  iter->tombstones = iter->tombstones_end = NULL;
+  iter->column = NULL;
+  iter->column_idx = iter->column_end = 0;
+  iter->value = value;
+  iter->reversed = reversed;
+}
+
+static uint64 iter_curr_pair(BINARY_TABLE_ITER *iter) {
+  if (iter->column != NULL) {
+    uint64 pair = pack(iter->column_idx, iter->column[iter->column_idx]);
+    return iter->reversed ? swap(pair) : pair;
+  }
+  if (iter->main == iter->main_end)
+    return *iter->delta;
+  if (iter->delta == iter->delta_end)
+    return *iter->main;
+  uint64 main_pair = *iter->main;
+  uint64 delta_pair = *iter->delta;
+  return main_pair < delta_pair ? main_pair : delta_pair;
+}
+
+bool sorted_pairs_has_left(SORTED_PAIRS *pairs, uint32 value) {
+  BINARY_TABLE_ITER iter;
+  sorted_pairs_get_iter(pairs, &iter, pack(value, 0), value, false);
+  return !binary_table_iter_is_out_of_range(&iter);
+}
+
+// Same as calling sorted_pairs_has_left() for each of the given values, which
+// must be sorted, but in a single pass over the pairs in the range they span
+bool sorted_pairs_has_any_left(SORTED_PAIRS *pairs, const uint32 *values, uint32 count) {
+  if (count == 0)
+    return false;
+
+  BINARY_TABLE_ITER iter;
+  sorted_pairs_get_iter(pairs, &iter, pack(values[0], 0), 0xFFFFFFFFU, false);
+
+  uint32 idx = 0;
+  while (idx < count && !binary_table_iter_is_out_of_range(&iter)) {
+    uint32 value = left(iter_curr_pair(&iter));
+    if (value == values[idx])
+      return true;
+    if (value < values[idx])
+      binary_table_iter_next(&iter);
+    else
+      idx++;
+  }
+  return false;
+}
+
+// Rebuilds the tree from scratch, since the separator keys
+// in the inner nodes may belong to pairs that have been deleted
+static void tree_remap(BTREE *tree, const uint32 *major_map, const uint32 *minor_map) {
+  std::vector<uint64> pairs;
+  btree_copy_keys(tree, pairs);
+  for (uint32 i=0 ; i < pairs.size() ; i++) {
+    uint32 major = left(pairs[i]);
+    uint32 minor = right(pairs[i]);
+    if (major_map != NULL)
+      major = major_map[major];
+    if (minor_map != NULL)
+      minor = minor_map[minor];
+    assert(major != INVALID_INDEX & minor != INVALID_INDEX);
+    pairs[i] = pack(major, minor);
+  }
+  assert(std::is_sorted(pairs.begin(), pairs.end()));
+  btree_cleanup<uint64>(tree);
+  btree_build(tree, pairs.data(), pairs.size());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+const uint32 DENSE_EMPTY = 0xFFFFFFFF;
+
+static bool is_dense(BINARY_TABLE *table) {
+  return table->backend == TABLE_BACKEND_DENSE | table->backend == TABLE_BACKEND_DENSE_INDEXED;
+}
+
+static void dense_cleanup(DENSE_COLUMN *column) {
+  free(column->values);
+  column->values = NULL;
+  column->capacity = 0;
+}
+
+static void dense_reserve(DENSE_COLUMN *column, uint32 min_capacity) {
+  uint32 capacity = column->capacity;
+  if (min_capacity <= capacity)
+    return;
+
+  uint64 new_capacity = capacity > 0 ? capacity : 64;
+  while (new_capacity < min_capacity)
+    new_capacity *= 2;
+  if (new_capacity > 0xFFFFFFFFULL)
+    new_capacity = 0xFFFFFFFFULL;
+
+  column->values = (uint32 *) realloc(column->values, new_capacity * sizeof(uint32));
+  memset(column->values + capacity, 0xFF, (new_capacity - capacity) * sizeof(uint32));
+  column->capacity = new_capacity;
+}
+
+static bool dense_contains(DENSE_COLUMN *column, uint64 pair) {
+  uint32 left_val = left(pair);
+  return left_val < column->capacity && column->values[left_val] == right(pair);
+}
+
+// Moves column_idx to the first left value in range that has a matching right value
+static void dense_settle(BINARY_TABLE_ITER *iter) {
+  uint32 *column = iter->column;
+  uint32 idx = iter->column_idx;
+  uint32 end = iter->column_end;
+  uint32 match = iter->column_match;
+  while (idx < end) {
+    uint32 right_val = column[idx];
+    if (right_val != DENSE_EMPTY && (match == DENSE_EMPTY || right_val == match))
+      break;
+    idx++;
+  }
+  iter->column_idx = idx;
+}
+
+static void dense_get_iter(DENSE_COLUMN *column, BINARY_TABLE_ITER *iter, uint32 first, uint64 end, uint32 match, uint32 value, bool reversed) {
+  iter->main = iter->main_end = NULL;
+  iter->leaf = NULL;
+  iter->delta = iter->delta_end = NULL;
+  iter->tombstones = iter->tombstones_end = NULL;
+  iter->column = column->values;
+  iter->column_end = end < column->capacity ? end : column->capacity;
+  iter->column_idx = first < iter->column_end ? first : iter->column_end;
+  iter->column_match = match;
+  iter->value = value;
+  iter->reversed = reversed;
+  if (iter->column != NULL)
+    dense_settle(iter);
+}
+
+// Surrogate maps can move the left values anywhere, so the column is rebuilt
+static void dense_remap(DENSE_COLUMN *column, const uint32 *left_map, const uint32 *right_map) {
+  uint32 *values = column->values;
+  uint32 capacity = column->capacity;
+
+  uint32 new_capacity = 0;
+  for (uint32 i=0 ; i < capacity ; i++)
+    if (values[i] != DENSE_EMPTY) {
+      uint32 left_val = left_map != NULL ? left_map[i] : i;
+      assert(left_val != INVALID_INDEX);
+      if (left_val >= new_capacity)
+        new_capacity = left_val + 1;
+    }
+
+  DENSE_COLUMN remapped;
+  remapped.values = NULL;
+  remapped.capacity = 0;
+  dense_reserve(&remapped, new_capacity);
+
+  for (uint32 i=0 ; i < capacity ; i++) {
+    uint32 right_val = values[i];
+    if (right_val != DENSE_EMPTY) {
+      uint32 left_val = left_map != NULL ? left_map[i] : i;
+      if (right_map != NULL)
+        right_val = right_map[right_val];
+      assert(right_val != INVALID_INDEX);
+      remapped.values[left_val] = right_val;
+    }
+  }
+
+  dense_cleanup(column);
+  *column = remapped;
+}
+
+// The left column of the table has to be a key, which should have been
+// checked with binary_table_updates_check_0() before applying the updates
+static void dense_updates_apply(BINARY_TABLE *table, BINARY_TABLE_UPDATES *updates) {
+  DENSE_COLUMN *column = &table->dense;
+  HASH_INDEX *hash_index = table->hash_index.slots != NULL ? &table->hash_index : NULL;
+  bool indexed = table->backend == TABLE_BACKEND_DENSE_INDEXED;
+
+  // Swapped pairs, for the right-to-left index
+  std::vector<uint64> deleted, inserted;
+
+  if (!updates->deletes.empty()) {
+    uint32 count = updates->deletes.size();
+    uint64 *deletes = &updates->deletes.front();
+    for (uint32 i=0 ; i < count ; i++) {
+      uint64 pair = deletes[i];
+      if (dense_contains(column, pair)) {
+        column->values[left(pair)] = DENSE_EMPTY;
+        if (hash_index != NULL)
+          hash_index_erase(hash_index, pair);
+        if (indexed)
+          deleted.push_back(swap(pair));
+        table->count--;
+      }
+      else
+        deletes[i] = 0xFFFFFFFFFFFFFFFFULL;
+    }
+  }
+
+  if (!updates->inserts.empty()) {
+    uint32 count = updates->inserts.size();
+    uint64 *inserts = &updates->inserts.front();
+    for (uint32 i=0 ; i < count ; i++) {
+      uint64 pair = inserts[i];
+      uint32 left_val = left(pair);
+      uint32 right_val = right(pair);
+      dense_reserve(column, left_val + 1);
+      uint32 curr_right_val = column->values[left_val];
+      if (curr_right_val == right_val) {
+        inserts[i] = 0xFFFFFFFFFFFFFFFFULL;
+        continue;
+      }
+      if (curr_right_val != DENSE_EMPTY)
+        internal_fail();
+      column->values[left_val] = right_val;
+      if (hash_index != NULL)
+        hash_index_insert(hash_index, pair);
+      if (indexed)
+        inserted.push_back(swap(pair));
+      table->count++;
+    }
+  }
+
+  if (indexed) {
+    std::sort(deleted.begin(), deleted.end());
+    std::sort(inserted.begin(), inserted.end());
+    sorted_pairs_update(&table->right_to_left, deleted, inserted);
+  }
+}
+
+// Without the right-to-left index, the right values
+// have to be gathered and sorted before checking them
+static bool dense_check_col_1(BINARY_TABLE *table, BINARY_TABLE_UPDATES *updates) {
+  std::vector<uint64> swapped_pairs;
+  swapped_pairs.reserve(table->count);
+  DENSE_COLUMN *column = &table->dense;
+  for (uint32 i=0 ; i < column->capacity ; i++)
+    if (column->values[i] != DENSE_EMPTY)
+      swapped_pairs.push_back(pack(column->values[i], i));
+  std::sort(swapped_pairs.begin(), swapped_pairs.end());
+
+  SORTED_PAIRS pairs;
+  sorted_pairs_init(&pairs);
+  pairs.main = swapped_pairs.data();
+  pairs.main_count = swapped_pairs.size();
+  return table_updates_check_key<col_1>(updates->inserts, updates->deletes, pairs);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static bool contains_pair(BINARY_TABLE *table, uint64 pair) {
+  if (table->hash_index.slots != NULL)
+    return hash_index_contains(&table->hash_index, pair);
+  if (is_dense(table))
+    return dense_contains(&table->dense, pair);
+  if (table->backend == TABLE_BACKEND_BTREE)
+    return btree_contains(&table->left_to_right_tree, pair);
+  return sorted_pairs_contains(&table->left_to_right, pair);
+}
+
+static void tree_updates_apply(BINARY_TABLE *table, BINARY_TABLE_UPDATES *updates) {
+  BTREE *left_to_right = &table->left_to_right_tree;
+  BTREE *right_to_left = &table->right_to_left_tree;
+  HASH_INDEX *hash_index = table->hash_index.slots != NULL ? &table->hash_index : NULL;
+
+  if (!updates->deletes.empty()) {
+    uint32 count = updates->deletes.size();
+    uint64 *deletes = &updates->deletes.front();
+    for (uint32 i=0 ; i < count ; i++) {
+      uint64 pair = deletes[i];
+      if (btree_erase(left_to_right, pair)) {
+        btree_erase(right_to_left, swap(pair));
+        if (hash_index != NULL)
+          hash_index_erase(hash_index, pair);
+      }
+      else
+        deletes[i] = 0xFFFFFFFFFFFFFFFFULL;
+    }
+  }
+
+  if (!updates->inserts.empty()) {
+    uint32 count = updates->inserts.size();
+    uint64 *inserts = &updates->inserts.front();
+    for (uint32 i=0 ; i < count ; i++) {
+      uint64 pair = inserts[i];
+      if (btree_insert(left_to_right, pair)) {
+        btree_insert(right_to_left, swap(pair));
+        if (hash_index != NULL)
+          hash_index_insert(hash_index, pair);
+      }
+      else
+        inserts[i] = 0xFFFFFFFFFFFFFFFFULL;
+    }
+  }
+
+  table->count = left_to_right->count;
+}
 
+static void rebuild_hash_index(BINARY_TABLE *table) {
+  HASH_INDEX *hash_index = &table->hash_index;
+  hash_index_reset<uint64>(hash_index, table->count);
+  BINARY_TABLE_ITER iter;
+  for (binary_table_get_iter(table, &iter) ; !binary_table_iter_is_out_of_range(&iter) ; binary_table_iter_next(&iter))
+    hash_index_insert(hash_index, iter_curr_pair(&iter));
+}
+
+static void cleanup_storage(BINARY_TABLE *table) {
+  sorted_pairs_cleanup(&table->left_to_right);
+  sorted_pairs_cleanup(&table->right_to_left);
+  btree_cleanup<uint64>(&table->left_to_right_tree);
+  btree_cleanup<uint64>(&table->right_to_left_tree);
+  dense_cleanup(&table->dense);
+  sorted_pairs_init(&table->left_to_right);
+  sorted_pairs_init(&table->right_to_left);
+}
+
+static void get_swapped_pairs(const std::vector<uint64> &pairs, std::vector<uint64> &swapped_pairs) {
+  swapped_pairs.resize(pairs.size());
+  for (uint32 i=0 ; i < pairs.size() ; i++)
+    swapped_pairs[i] = swap(pairs[i]);
+  parallel_sort(swapped_pairs.data(), swapped_pairs.data() + swapped_pairs.size(), std::less<uint64>());
+}
+
+// Builds the storage of an empty table from a sorted array of unique
+// pairs and the sorted array of the same pairs with their fields swapped
+static void build_storage(BINARY_TABLE *table, std::vector<uint64> &pairs, std::vector<uint64> &swapped_pairs) {
+  TABLE_BACKEND backend = table->backend;
+
+  if (backend == TABLE_BACKEND_BTREE) {
+    btree_build(&table->left_to_right_tree, pairs.data(), pairs.size());
+    btree_build(&table->right_to_left_tree, swapped_pairs.data(), swapped_pairs.size());
+  }
+  else if (is_dense(table)) {
+    DENSE_COLUMN *column = &table->dense;
+    if (!pairs.empty())
+      dense_reserve(column, left(pairs.back()) + 1);
+    for (uint32 i=0 ; i < pairs.size() ; i++) {
+      uint32 left_val = left(pairs[i]);
+      if (column->values[left_val] != DENSE_EMPTY)
+        internal_fail();
+      column->values[left_val] = right(pairs[i]);
+    }
+    if (backend == TABLE_BACKEND_DENSE_INDEXED)
+      set_array(table->right_to_left.main, table->right_to_left.main_count, swapped_pairs);
+  }
+  else {
+    set_array(table->left_to_right.main, table->left_to_right.main_count, pairs);
+    set_array(table->right_to_left.main, table->right_to_left.main_count, swapped_pairs);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void binary_table_init(BINARY_TABLE *table) {
+  sorted_pairs_init(&table->left_to_right);
+  sorted_pairs_init(&table->right_to_left);
+  btree_init(&table->left_to_right_tree);
+  btree_init(&table->right_to_left_tree);
+  memset(&table->dense, 0, sizeof(DENSE_COLUMN));
+  memset(&table->hash_index, 0, sizeof(HASH_INDEX));
+  memset(table->degrees, 0, sizeof(table->degrees));
+  table->count = 0;
+  table->backend = TABLE_BACKEND_SORTED_ARRAYS;
 }
 
 void binary_table_cleanup(BINARY_TABLE *table) {
+  cleanup_storage(table);
+  hash_index_cleanup<uint64>(&table->hash_index);
+  degree_counts_cleanup(table->degrees);
+  degree_counts_cleanup(table->degrees + 1);
+}
 
+// The hash index trades 8 to 16 bytes per pair for constant-time
+// membership tests in binary_table_contains() and binary_table_delete()
+void binary_table_set_hash_index(BINARY_TABLE *table, bool enabled) {
+  if (enabled && table->hash_index.slots == NULL)
+    rebuild_hash_index(table);
+  else if (!enabled)
+    hash_index_cleanup<uint64>(&table->hash_index);
+}
+
+static void rebuild_degree_counts(BINARY_TABLE *table) {
+  for (uint32 i=0 ; i < 2 ; i++) {
+    degree_counts_cleanup(table->degrees + i);
+    table->degrees[i].enabled = true;
+  }
+  BINARY_TABLE_ITER iter;
+  for (binary_table_get_iter(table, &iter) ; !binary_table_iter_is_out_of_range(&iter) ; binary_table_iter_next(&iter)) {
+    degree_counts_increment(table->degrees, binary_table_iter_get_left_field(&iter));
+    degree_counts_increment(table->degrees + 1, binary_table_iter_get_right_field(&iter));
+  }
+}
+
+// Degree counts take 4 bytes for each value in the range of the surrogates of
+// each column, and make the cardinality queries below take constant time
+void binary_table_set_degree_counts(BINARY_TABLE *table, bool enabled) {
+  if (enabled && !table->degrees[0].enabled)
+    rebuild_degree_counts(table);
+  else if (!enabled)
+    for (uint32 i=0 ; i < 2 ; i++)
+      degree_counts_cleanup(table->degrees + i);
+}
+
+// Moves the content of the table to the given backend. It must not be called
+// while there are pending updates. The dense backends can only be used if the
+// left column of the table is a key
+void binary_table_set_backend(BINARY_TABLE *table, TABLE_BACKEND backend) {
+  if (table->backend == backend)
+    return;
+
+  std::vector<uint64> pairs;
+  pairs.reserve(table->count);
+  BINARY_TABLE_ITER iter;
+  for (binary_table_get_iter(table, &iter) ; !binary_table_iter_is_out_of_range(&iter) ; binary_table_iter_next(&iter))
+    pairs.push_back(iter_curr_pair(&iter));
+
+  std::vector<uint64> swapped_pairs;
+  get_swapped_pairs(pairs, swapped_pairs);
+
+  cleanup_storage(table);
+  table->backend = backend;
+  build_storage(table, pairs, swapped_pairs);
 }
 
 void binary_table_updates_init(BINARY_TABLE_UPDATES *updates) {
@@ -20,10 +632,58 @@ void binary_table_updates_cleanup(BINARY_TABLE_UPDATES *updates) {
 
 ////////////////////////////////////////////////////////////////////////////////
 
+uint32 binary_table_size(BINARY_TABLE *table) {
+  return table->count;
+}
+
 bool binary_table_contains(BINARY_TABLE *table, uint32 left_val, uint32 right_val) {
-  std::set<uint64> &left_to_right = table->left_to_right;
-  std::set<uint64>::iterator it = left_to_right.find(pack(left_val, right_val));
-  return it != left_to_right.end();
+  return contains_pair(table, pack(left_val, right_val));
+}
+
+uint32 binary_table_degree(BINARY_TABLE *table, uint32 column, uint32 value) {
+  assert(column < 2);
+  if (table->degrees[column].enabled)
+    return degree_counts_get(table->degrees + column, value);
+
+  uint32 count = 0;
+  BINARY_TABLE_ITER iter;
+  if (column == 0)
+    binary_table_get_iter_by_col_0(table, &iter, value);
+  else
+    binary_table_get_iter_by_col_1(table, &iter, value);
+  for ( ; !binary_table_iter_is_out_of_range(&iter) ; binary_table_iter_next(&iter))
+    count++;
+  return count;
+}
+
+// Sorted values of one of the columns, with duplicates
+static void get_column(BINARY_TABLE *table, uint32 column, std::vector<uint32> &values) {
+  values.reserve(table->count);
+  BINARY_TABLE_ITER iter;
+  for (binary_table_get_iter(table, &iter) ; !binary_table_iter_is_out_of_range(&iter) ; binary_table_iter_next(&iter))
+    values.push_back(column == 0 ? binary_table_iter_get_left_field(&iter) : binary_table_iter_get_right_field(&iter));
+  if (column != 0)
+    std::sort(values.begin(), values.end());
+}
+
+uint32 binary_table_distinct_count(BINARY_TABLE *table, uint32 column) {
+  assert(column < 2);
+  if (table->degrees[column].enabled)
+    return table->degrees[column].distinct_count;
+
+  std::vector<uint32> values;
+  get_column(table, column, values);
+  return std::unique(values.begin(), values.end()) - values.begin();
+}
+
+bool binary_table_col_is_key(BINARY_TABLE *table, uint32 column) {
+  assert(column < 2);
+  if (table->degrees[column].enabled)
+    return table->degrees[column].repeated_count == 0;
+
+  std::vector<uint32> values;
+  get_column(table, column, values);
+  return std::adjacent_find(values.begin(), values.end()) == values.end();
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -32,7 +692,7 @@ void binary_table_delete_range_(BINARY_TABLE_ITER *iter, BINARY_TABLE_UPDATES *u
   bool reversed = iter->reversed;
   std::vector<uint64> &deletes = updates->deletes;
   while (!binary_table_iter_is_out_of_range(iter)) {
-    uint64 pair = *iter->iter;
+    uint64 pair = iter_curr_pair(iter);
     deletes.push_back(reversed ? swap(pair) : pair);
     binary_table_iter_next(iter);
   }
@@ -65,111 +725,269 @@ void binary_table_insert(BINARY_TABLE_UPDATES *updates, uint32 left_val, uint32
   updates->inserts.push_back(pack(left_val, right_val));
 }
 
-void binary_table_updates_apply(BINARY_TABLE *table, BINARY_TABLE_UPDATES *updates, VALUE_STORE *vs0, VALUE_STORE *vs1) {
-  std::set<uint64> &left_to_right = table->left_to_right;
-  std::set<uint64> &right_to_left = table->right_to_left;
+// Inserts that are already in the table are replaced with 0xFFFFFFFFFFFFFFFF,
+// and so are deletes that are not, so that the remaining ones are exactly
+// the tuples that were added to and removed from the table
+static void apply_tuples(BINARY_TABLE *table, BINARY_TABLE_UPDATES *updates) {
+  if (table->backend == TABLE_BACKEND_BTREE) {
+    tree_updates_apply(table, updates);
+    return;
+  }
+
+  if (is_dense(table)) {
+    dense_updates_apply(table, updates);
+    return;
+  }
+
+  SORTED_PAIRS *left_to_right = &table->left_to_right;
 
+  std::vector<uint64> deleted;
   if (!updates->deletes.empty()) {
     uint32 count = updates->deletes.size();
     uint64 *deletes = &updates->deletes.front();
+    // Sorting brings duplicates together. The order of the
+    // deletes doesn't matter to binary_table_updates_finish()
+    adaptive_sort(deletes, deletes + count, std::less<uint64>());
+    uint64 last_pair = 0xFFFFFFFFFFFFFFFFULL;
     for (uint32 i=0 ; i < count ; i++) {
       uint64 pair = deletes[i];
-      if (left_to_right.erase(pair) > 0)
-        right_to_left.erase(swap(pair));
+      if (pair != last_pair && contains_pair(table, pair))
+        deleted.push_back(pair);
       else
         deletes[i] = 0xFFFFFFFFFFFFFFFFULL;
+      last_pair = pair;
     }
   }
 
+  std::vector<uint64> inserted;
   if (!updates->inserts.empty()) {
-    uint32 count = updates->inserts.size();
-    uint64 *inserts = &updates->inserts.front();
+    std::vector<uint64> &inserts = updates->inserts;
+    adaptive_sort(inserts.data(), inserts.data() + inserts.size(), std::less<uint64>());
+    inserts.erase(std::unique(inserts.begin(), inserts.end()), inserts.end());
+    uint32 count = inserts.size();
     for (uint32 i=0 ; i < count ; i++) {
       uint64 pair = inserts[i];
-      if (left_to_right.insert(pair).second) {
-        right_to_left.insert(swap(pair));
-        value_store_add_ref(vs0, left(pair));
-        value_store_add_ref(vs1, right(pair));
-      }
+      bool is_deleted = std::binary_search(deleted.begin(), deleted.end(), pair);
+      if (is_deleted || !contains_pair(table, pair))
+        inserted.push_back(pair);
+      else
+        inserts[i] = 0xFFFFFFFFFFFFFFFFULL;
     }
   }
+
+  if (deleted.empty() & inserted.empty())
+    return;
+
+  sorted_pairs_update(left_to_right, deleted, inserted);
+
+  HASH_INDEX *hash_index = &table->hash_index;
+  if (hash_index->slots != NULL) {
+    for (uint32 i=0 ; i < deleted.size() ; i++)
+      hash_index_erase(hash_index, deleted[i]);
+    for (uint32 i=0 ; i < inserted.size() ; i++)
+      hash_index_insert(hash_index, inserted[i]);
+  }
+
+  for (uint32 i=0 ; i < deleted.size() ; i++)
+    deleted[i] = swap(deleted[i]);
+  adaptive_sort(deleted.data(), deleted.data() + deleted.size(), std::less<uint64>());
+
+  for (uint32 i=0 ; i < inserted.size() ; i++)
+    inserted[i] = swap(inserted[i]);
+  adaptive_sort(inserted.data(), inserted.data() + inserted.size(), std::less<uint64>());
+
+  sorted_pairs_update(&table->right_to_left, deleted, inserted);
+
+  table->count += inserted.size() - deleted.size();
 }
 
-void binary_table_updates_finish(BINARY_TABLE_UPDATES *updates, VALUE_STORE *vs0, VALUE_STORE *vs1) {
-  if (!updates->deletes.empty()) {
-    uint32 count = updates->deletes.size();
-    uint64 *deletes = &updates->deletes.front();
-    for (uint32 i=0 ; i < count ; i++) {
-      uint64 pair = deletes[i];
-      if (pair != 0xFFFFFFFFFFFFFFFFULL) {
-        value_store_release(vs0, left(pair));
-        value_store_release(vs1, right(pair));
-      }
+static void update_degree_counts(BINARY_TABLE *table, BINARY_TABLE_UPDATES *updates) {
+  for (uint32 i=0 ; i < 2 ; i++) {
+    DEGREE_COUNTS *degrees = table->degrees + i;
+    uint32 shift = i == 0 ? 32 : 0;
+    for (uint32 j=0 ; j < updates->deletes.size() ; j++) {
+      uint64 pair = updates->deletes[j];
+      if (pair != 0xFFFFFFFFFFFFFFFFULL)
+        degree_counts_decrement(degrees, pair >> shift);
+    }
+    for (uint32 j=0 ; j < updates->inserts.size() ; j++) {
+      uint64 pair = updates->inserts[j];
+      if (pair != 0xFFFFFFFFFFFFFFFFULL)
+        degree_counts_increment(degrees, pair >> shift);
     }
   }
 }
 
+void binary_table_updates_apply_tuples(BINARY_TABLE *table, BINARY_TABLE_UPDATES *updates) {
+  apply_tuples(table, updates);
+  if (table->degrees[0].enabled)
+    update_degree_counts(table, updates);
+}
+
+static void collect_column(const std::vector<uint64> &pairs, uint32 column, std::vector<uint32> &surrs) {
+  assert(column < 2);
+  uint32 count = pairs.size();
+  for (uint32 i=0 ; i < count ; i++) {
+    uint64 pair = pairs[i];
+    if (pair != 0xFFFFFFFFFFFFFFFFULL)
+      surrs.push_back(column == 0 ? left(pair) : right(pair));
+  }
+}
+
+void binary_table_updates_collect_inserted(BINARY_TABLE_UPDATES *updates, uint32 column, std::vector<uint32> &surrs) {
+  collect_column(updates->inserts, column, surrs);
+}
+
+void binary_table_updates_collect_deleted(BINARY_TABLE_UPDATES *updates, uint32 column, std::vector<uint32> &surrs) {
+  collect_column(updates->deletes, column, surrs);
+}
+
+void binary_table_updates_apply(BINARY_TABLE *table, BINARY_TABLE_UPDATES *updates, VALUE_STORE *vs0, VALUE_STORE *vs1) {
+  binary_table_updates_apply_tuples(table, updates);
+  VALUE_STORE *stores[2] = {vs0, vs1};
+  std::vector<uint32> surrs[2];
+  for (uint32 i=0 ; i < 2 ; i++)
+    binary_table_updates_collect_inserted(updates, i, surrs[i]);
+  apply_column_ref_batches(stores, surrs, 2, false);
+}
+
+void binary_table_updates_finish(BINARY_TABLE_UPDATES *updates, VALUE_STORE *vs0, VALUE_STORE *vs1) {
+  VALUE_STORE *stores[2] = {vs0, vs1};
+  std::vector<uint32> surrs[2];
+  for (uint32 i=0 ; i < 2 ; i++)
+    binary_table_updates_collect_deleted(updates, i, surrs[i]);
+  apply_column_ref_batches(stores, surrs, 2, true);
+}
+
+// Adds a reference to the value in the major field of each of the given
+// pairs, which are sorted, with a single update for each run of equal values
+static void add_major_refs(VALUE_STORE *store, const std::vector<uint64> &pairs) {
+  uint32 count = pairs.size();
+  uint32 run_start = 0;
+  for (uint32 i=1 ; i <= count ; i++)
+    if (i == count || left(pairs[i]) != left(pairs[run_start])) {
+      value_store_add_refs(store, left(pairs[run_start]), i - run_start);
+      run_start = i;
+    }
+}
+
+void binary_table_bulk_load(BINARY_TABLE *table, BINARY_TABLE_UPDATES *updates, VALUE_STORE *vs0, VALUE_STORE *vs1) {
+  assert(table->count == 0 && updates->deletes.empty());
+
+  std::vector<uint64> &pairs = updates->inserts;
+  parallel_sort(pairs.data(), pairs.data() + pairs.size(), std::less<uint64>());
+  pairs.erase(std::unique(pairs.begin(), pairs.end()), pairs.end());
+
+  std::vector<uint64> swapped_pairs;
+  get_swapped_pairs(pairs, swapped_pairs);
+
+  cleanup_storage(table);
+  build_storage(table, pairs, swapped_pairs);
+  table->count = pairs.size();
+
+  if (vs0 != NULL)
+    add_major_refs(vs0, pairs);
+  if (vs1 != NULL)
+    add_major_refs(vs1, swapped_pairs);
+
+  if (table->hash_index.slots != NULL)
+    rebuild_hash_index(table);
+  if (table->degrees[0].enabled)
+    rebuild_degree_counts(table);
+
+  pairs.clear();
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 void binary_table_get_iter_by_col_0(BINARY_TABLE *table, BINARY_TABLE_ITER *iter, uint32 value) {
-  std::set<uint64> &left_to_right = table->left_to_right;
-  iter->iter = left_to_right.lower_bound(pack(value, 0));
-  iter->end = left_to_right.end();
-  iter->value = value;
-  iter->reversed = false;
+  if (is_dense(table))
+    dense_get_iter(&table->dense, iter, value, value + 1ULL, DENSE_EMPTY, value, false);
+  else if (table->backend == TABLE_BACKEND_BTREE)
+    tree_get_iter(&table->left_to_right_tree, iter, pack(value, 0), value, false);
+  else
+    sorted_pairs_get_iter(&table->left_to_right, iter, pack(value, 0), value, false);
 }
 
 void binary_table_get_iter_by_col_1(BINARY_TABLE *table, BINARY_TABLE_ITER *iter, uint32 value) {
-  std::set<uint64> &right_to_left = table->right_to_left;
-  iter->iter = right_to_left.lower_bound(pack(value, 0));
-  iter->end = right_to_left.end();
-  iter->value = value;
-  iter->reversed = true;
+  if (table->backend == TABLE_BACKEND_DENSE)
+    dense_get_iter(&table->dense, iter, 0, table->dense.capacity, value, value, true);
+  else if (table->backend == TABLE_BACKEND_BTREE)
+    tree_get_iter(&table->right_to_left_tree, iter, pack(value, 0), value, true);
+  else
+    sorted_pairs_get_iter(&table->right_to_left, iter, pack(value, 0), value, true);
 }
 
 void binary_table_get_iter(BINARY_TABLE *table, BINARY_TABLE_ITER *iter) {
-  std::set<uint64> &left_to_right = table->left_to_right;
-  iter->iter = left_to_right.begin();
-  iter->end = left_to_right.end();
-  iter->value = 0xFFFFFFFFU;
-  iter->reversed = false;
+  if (is_dense(table))
+    dense_get_iter(&table->dense, iter, 0, table->dense.capacity, DENSE_EMPTY, 0xFFFFFFFFU, false);
+  else if (table->backend == TABLE_BACKEND_BTREE)
+    tree_get_iter(&table->left_to_right_tree, iter, 0, 0xFFFFFFFFU, false);
+  else
+    sorted_pairs_get_iter(&table->left_to_right, iter, 0, 0xFFFFFFFFU, false);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
 bool binary_table_iter_is_out_of_range(BINARY_TABLE_ITER *iter) {
-  std::set<uint64>::iterator it = iter->iter;
-  return it == iter->end || (*it >> 32) > iter->value;
+  if (iter->column != NULL)
+    return iter->column_idx == iter->column_end;
+  if (iter->main == iter->main_end & iter->delta == iter->delta_end)
+    return true;
+  return (iter_curr_pair(iter) >> 32) > iter->value;
 }
 
 uint32 binary_table_iter_get_left_field(BINARY_TABLE_ITER *iter) {
-  return *iter->iter >> (iter->reversed ? 0 : 32);
+  return iter_curr_pair(iter) >> (iter->reversed ? 0 : 32);
 }
 
 uint32 binary_table_iter_get_right_field(BINARY_TABLE_ITER *iter) {
-  return *iter->iter >> (iter->reversed ? 32 : 0);
+  return iter_curr_pair(iter) >> (iter->reversed ? 32 : 0);
 }
 
+// The main array and the delta buffer never share a pair
 void binary_table_iter_next(BINARY_TABLE_ITER *iter) {
   assert(!binary_table_iter_is_out_of_range(iter));
-  iter->iter++;
+  if (iter->column != NULL) {
+    iter->column_idx++;
+    dense_settle(iter);
+    return;
+  }
+  if (iter->main != iter->main_end && (iter->delta == iter->delta_end || *iter->main < *iter->delta)) {
+    iter->main++;
+    btree_cursor_settle(iter->main, iter->main_end, iter->leaf);
+    skip_tombstones(iter);
+  }
+  else
+    iter->delta++;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
+static bool check_col_1(BINARY_TABLE *table, BINARY_TABLE_UPDATES *updates) {
+  if (table->backend == TABLE_BACKEND_DENSE)
+    return dense_check_col_1(table, updates);
+  if (table->backend == TABLE_BACKEND_BTREE)
+    return table_updates_check_key<col_1>(updates->inserts, updates->deletes, table->right_to_left_tree);
+  return table_updates_check_key<col_1>(updates->inserts, updates->deletes, table->right_to_left);
+}
+
 bool binary_table_updates_check_0(BINARY_TABLE *table, BINARY_TABLE_UPDATES *updates) {
   sort_unique(updates->inserts);
+  if (is_dense(table))
+    return table_updates_check_key<col_0>(updates->inserts, updates->deletes, table->dense);
+  if (table->backend == TABLE_BACKEND_BTREE)
+    return table_updates_check_key<col_0>(updates->inserts, updates->deletes, table->left_to_right_tree);
   return table_updates_check_key<col_0>(updates->inserts, updates->deletes, table->left_to_right);
 }
 
 bool binary_table_updates_check_1(BINARY_TABLE *table, BINARY_TABLE_UPDATES *updates) {
   sort_unique(updates->inserts);
-  return table_updates_check_key<col_1>(updates->inserts, updates->deletes, table->right_to_left);
+  return check_col_1(table, updates);
 }
 
 bool binary_table_updates_check_0_1(BINARY_TABLE *table, BINARY_TABLE_UPDATES *updates) {
-  return binary_table_updates_check_0(table, updates) &&
-    table_updates_check_key<col_1>(updates->inserts, updates->deletes, table->right_to_left);
+  return binary_table_updates_check_0(table, updates) && check_col_1(table, updates);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -178,8 +996,7 @@ OBJ copy_binary_table(BINARY_TABLE *table, VALUE_STORE *vs1, VALUE_STORE *vs2, b
   OBJ *slots1 = value_store_slot_array(vs1);
   OBJ *slots2 = value_store_slot_array(vs2);
 
-  std::set<uint64> &rows = table->left_to_right;
-  uint32 size = rows.size();
+  uint32 size = binary_table_size(table);
 
   if (size == 0)
     return make_empty_rel();
@@ -188,10 +1005,10 @@ OBJ copy_binary_table(BINARY_TABLE *table, VALUE_STORE *vs1, VALUE_STORE *vs2, b
   OBJ *col2 = col1 + size;
 
   uint32 idx = 0;
-  for (std::set<uint64>::iterator it=rows.begin(); it != rows.end() ; it++) {
-    uint64 row = *it;
-    col1[idx] = slots1[left(row)];
-    col2[idx++] = slots2[right(row)];
+  BINARY_TABLE_ITER iter;
+  for (binary_table_get_iter(table, &iter) ; !binary_table_iter_is_out_of_range(&iter) ; binary_table_iter_next(&iter)) {
+    col1[idx] = slots1[binary_table_iter_get_left_field(&iter)];
+    col2[idx++] = slots2[binary_table_iter_get_right_field(&iter)];
   }
   assert(idx == size);
 
@@ -219,21 +1036,41 @@ void set_binary_table(BINARY_TABLE *table, BINARY_TABLE_UPDATES *updates, VALUE_
   OBJ *col1 = flip_cols ? get_right_col_array_ptr(ptr) : get_left_col_array_ptr(ptr);
   OBJ *col2 = flip_cols ? get_left_col_array_ptr(ptr) : get_right_col_array_ptr(ptr);
 
-  for (uint32 i=0 ; i < size ; i++) {
-    OBJ obj = col1[i];
-    uint32 ref1 = lookup_value_ex(vs1, vsu1, obj);
-    if (ref1 == -1) {
-      add_ref(obj);
-      ref1 = value_store_insert(vs1, vsu1, obj);
-    }
+  uint32 refs1[LOAD_CHUNK_SIZE];
+  uint32 refs2[LOAD_CHUNK_SIZE];
 
-    obj = col2[i];
-    uint32 ref2 = lookup_value_ex(vs2, vsu2, obj);
-    if (ref2 == -1) {
-      add_ref(obj);
-      ref2 = value_store_insert(vs2, vsu2, obj);
-    }
+  for (uint32 i=0 ; i < size ; i += LOAD_CHUNK_SIZE) {
+    uint32 count = size - i < LOAD_CHUNK_SIZE ? size - i : LOAD_CHUNK_SIZE;
+    lookup_or_insert_values(vs1, vsu1, col1 + i, count, refs1);
+    lookup_or_insert_values(vs2, vsu2, col2 + i, count, refs2);
+    for (uint32 j=0 ; j < count ; j++)
+      binary_table_insert(updates, refs1[j], refs2[j]);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
 
-    binary_table_insert(updates, ref1, ref2);
+// Surrogate maps produced by value_store_compact() preserve
+// the relative order of the values, so both orders stay sorted
+void binary_table_remap(BINARY_TABLE *table, const uint32 *surr_map_0, const uint32 *surr_map_1) {
+  if (is_dense(table)) {
+    dense_remap(&table->dense, surr_map_0, surr_map_1);
+    sorted_pairs_remap(&table->right_to_left, surr_map_1, surr_map_0);
   }
+  else if (table->backend == TABLE_BACKEND_BTREE) {
+    tree_remap(&table->left_to_right_tree, surr_map_0, surr_map_1);
+    tree_remap(&table->right_to_left_tree, surr_map_1, surr_map_0);
+  }
+  else {
+    sorted_pairs_remap(&table->left_to_right, surr_map_0, surr_map_1);
+    sorted_pairs_remap(&table->right_to_left, surr_map_1, surr_map_0);
+  }
+
+  if (table->hash_index.slots != NULL)
+    rebuild_hash_index(table);
+
+  const uint32 *surr_maps[2] = {surr_map_0, surr_map_1};
+  for (uint32 i=0 ; i < 2 ; i++)
+    if (table->degrees[i].enabled && surr_maps[i] != NULL)
+      degree_counts_remap(table->degrees + i, surr_maps[i]);
 }
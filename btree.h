@@ -0,0 +1,533 @@
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+  #define BTREE_USE_SSE2
+  #include <emmintrin.h>
+#endif
+
+// B+tree used to store the tuples of binary (T = uint64, packed pairs) and
+// ternary (T = tuple3) tables. Nodes are BTREE_NODE_SIZE bytes wide, so that
+// a lookup touches a handful of cache lines per level, and leaves are chained
+// so that a range scan is a sequence of reads from consecutive array slots.
+// The separator keys in the inner nodes need not be in the tree: all keys in
+// children[i] are lower than keys[i], and all those in children[i+1] are
+// greater than or equal to it
+
+const uint32 BTREE_NODE_SIZE = 512;
+
+template <typename T> struct BTREE_LEAF {
+  static const uint32 CAPACITY = (BTREE_NODE_SIZE - 2 * sizeof(void *)) / sizeof(T);
+  static const uint32 MIN_COUNT = CAPACITY / 3;
+
+  BTREE_LEAF *next;
+  uint32 count;
+  T keys[CAPACITY];
+};
+
+template <typename T> struct BTREE_INNER {
+  static const uint32 CAPACITY = (BTREE_NODE_SIZE - 2 * sizeof(void *)) / (sizeof(T) + sizeof(void *));
+  static const uint32 MIN_COUNT = CAPACITY / 3;
+
+  uint32 count; // Number of keys, the node has count + 1 children
+  T keys[CAPACITY];
+  void *children[CAPACITY + 1];
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+// In-node search. The whole node is scanned without branching, which for
+// nodes this size is faster than a binary search. SSE2 has no 64-bit
+// comparison, so it's built out of the 32-bit ones on the two halves
+
+#ifdef BTREE_USE_SSE2
+
+// Returns a 2-bit mask of the 64-bit lanes where a < b. Both arguments
+// have to be biased by flipping the top bit of each 32-bit half
+static inline uint32 btree_less_mask(__m128i a, __m128i b) {
+  __m128i gt = _mm_cmpgt_epi32(b, a);
+  __m128i eq = _mm_cmpeq_epi32(a, b);
+  __m128i gt_hi = _mm_shuffle_epi32(gt, _MM_SHUFFLE(3, 3, 1, 1));
+  __m128i eq_hi = _mm_shuffle_epi32(eq, _MM_SHUFFLE(3, 3, 1, 1));
+  __m128i gt_lo = _mm_shuffle_epi32(gt, _MM_SHUFFLE(2, 2, 0, 0));
+  __m128i lt = _mm_or_si128(gt_hi, _mm_and_si128(eq_hi, gt_lo));
+  return _mm_movemask_pd(_mm_castsi128_pd(lt));
+}
+
+static inline __m128i btree_biased_key(uint64 key) {
+  __m128i bias = _mm_set1_epi32(0x80000000);
+  return _mm_xor_si128(_mm_set_epi32(key >> 32, key, key >> 32, key), bias);
+}
+
+static inline __m128i btree_biased_load(const uint64 *keys) {
+  __m128i bias = _mm_set1_epi32(0x80000000);
+  return _mm_xor_si128(_mm_loadu_si128((const __m128i *) keys), bias);
+}
+
+#endif
+
+static inline uint32 btree_count_less(const uint64 *keys, uint32 count, uint64 key) {
+  uint32 result = 0;
+  uint32 i = 0;
+#ifdef BTREE_USE_SSE2
+  __m128i biased_key = btree_biased_key(key);
+  for ( ; i + 2 <= count ; i += 2) {
+    uint32 mask = btree_less_mask(btree_biased_load(keys + i), biased_key);
+    result += (mask & 1) + (mask >> 1);
+  }
+#endif
+  for ( ; i < count ; i++)
+    result += keys[i] < key;
+  return result;
+}
+
+static inline uint32 btree_count_less_or_equal(const uint64 *keys, uint32 count, uint64 key) {
+  uint32 result = count;
+  uint32 i = 0;
+#ifdef BTREE_USE_SSE2
+  __m128i biased_key = btree_biased_key(key);
+  for ( ; i + 2 <= count ; i += 2) {
+    uint32 mask = btree_less_mask(biased_key, btree_biased_load(keys + i));
+    result -= (mask & 1) + (mask >> 1);
+  }
+#endif
+  for ( ; i < count ; i++)
+    result -= key < keys[i];
+  return result;
+}
+
+template <typename T> uint32 btree_count_less(const T *keys, uint32 count, const T &key) {
+  uint32 result = 0;
+  for (uint32 i=0 ; i < count ; i++)
+    result += keys[i] < key;
+  return result;
+}
+
+template <typename T> uint32 btree_count_less_or_equal(const T *keys, uint32 count, const T &key) {
+  uint32 result = count;
+  for (uint32 i=0 ; i < count ; i++)
+    result -= key < keys[i];
+  return result;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+template <typename T> BTREE_LEAF<T> *btree_new_leaf() {
+  BTREE_LEAF<T> *leaf = (BTREE_LEAF<T> *) malloc(sizeof(BTREE_LEAF<T>));
+  leaf->next = NULL;
+  leaf->count = 0;
+  return leaf;
+}
+
+template <typename T> BTREE_INNER<T> *btree_new_inner() {
+  BTREE_INNER<T> *inner = (BTREE_INNER<T> *) malloc(sizeof(BTREE_INNER<T>));
+  inner->count = 0;
+  return inner;
+}
+
+template <typename T> uint32 btree_node_count(void *node, uint32 height) {
+  return height == 0 ? ((BTREE_LEAF<T> *) node)->count : ((BTREE_INNER<T> *) node)->count;
+}
+
+template <typename T> void btree_free_node(void *node, uint32 height) {
+  if (height > 0) {
+    BTREE_INNER<T> *inner = (BTREE_INNER<T> *) node;
+    for (uint32 i=0 ; i <= inner->count ; i++)
+      btree_free_node<T>(inner->children[i], height - 1);
+  }
+  free(node);
+}
+
+inline void btree_init(BTREE *tree) {
+  tree->root = NULL;
+  tree->height = 0;
+  tree->count = 0;
+}
+
+template <typename T> void btree_cleanup(BTREE *tree) {
+  if (tree->root != NULL)
+    btree_free_node<T>(tree->root, tree->height);
+  btree_init(tree);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Cursors are made of a pointer to the current key, a pointer to the end of
+// the keys in the current leaf, and the leaf itself. They are settled on a
+// key as soon as they're moved, so curr == end only when the scan is over
+
+template <typename T> void btree_cursor_settle(T *&curr, T *&end, void *&leaf) {
+  while (curr == end && leaf != NULL) {
+    BTREE_LEAF<T> *next = ((BTREE_LEAF<T> *) leaf)->next;
+    leaf = next;
+    if (next != NULL) {
+      curr = next->keys;
+      end = next->keys + next->count;
+    }
+  }
+}
+
+template <typename T> void btree_cursor_next(T *&curr, T *&end, void *&leaf) {
+  assert(curr != end);
+  curr++;
+  btree_cursor_settle(curr, end, leaf);
+}
+
+// Positions the cursor on the first key that is greater than or equal to the given one
+template <typename T> void btree_seek(BTREE *tree, const T &key, T *&curr, T *&end, void *&leaf) {
+  void *node = tree->root;
+  if (node == NULL) {
+    curr = end = NULL;
+    leaf = NULL;
+    return;
+  }
+
+  for (uint32 h=tree->height ; h > 0 ; h--) {
+    BTREE_INNER<T> *inner = (BTREE_INNER<T> *) node;
+    node = inner->children[btree_count_less_or_equal(inner->keys, inner->count, key)];
+  }
+
+  BTREE_LEAF<T> *target = (BTREE_LEAF<T> *) node;
+  curr = target->keys + btree_count_less(target->keys, target->count, key);
+  end = target->keys + target->count;
+  leaf = target;
+  btree_cursor_settle(curr, end, leaf);
+}
+
+template <typename T> void btree_seek_first(BTREE *tree, T *&curr, T *&end, void *&leaf) {
+  void *node = tree->root;
+  if (node == NULL) {
+    curr = end = NULL;
+    leaf = NULL;
+    return;
+  }
+
+  for (uint32 h=tree->height ; h > 0 ; h--)
+    node = ((BTREE_INNER<T> *) node)->children[0];
+
+  BTREE_LEAF<T> *target = (BTREE_LEAF<T> *) node;
+  curr = target->keys;
+  end = target->keys + target->count;
+  leaf = target;
+}
+
+template <typename T> bool btree_contains(BTREE *tree, const T &key) {
+  T *curr, *end;
+  void *leaf;
+  btree_seek(tree, key, curr, end, leaf);
+  return curr != end && *curr == key;
+}
+
+template <typename T> void btree_copy_keys(BTREE *tree, std::vector<T> &keys) {
+  keys.clear();
+  keys.reserve(tree->count);
+  T *curr, *end;
+  void *leaf;
+  for (btree_seek_first(tree, curr, end, leaf) ; curr != end ; btree_cursor_next(curr, end, leaf))
+    keys.push_back(*curr);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Returns false if the key was already there. If the node had to be split,
+// the new right sibling and its lowest key are stored in split_node and split_key
+template <typename T> bool btree_insert_(void *node, uint32 height, const T &key, T &split_key, void *&split_node) {
+  if (height == 0) {
+    BTREE_LEAF<T> *leaf = (BTREE_LEAF<T> *) node;
+    uint32 count = leaf->count;
+    uint32 pos = btree_count_less(leaf->keys, count, key);
+    if (pos < count && leaf->keys[pos] == key)
+      return false;
+
+    BTREE_LEAF<T> *target = leaf;
+    if (count == BTREE_LEAF<T>::CAPACITY) {
+      uint32 half = count / 2;
+      BTREE_LEAF<T> *right = btree_new_leaf<T>();
+      memcpy(right->keys, leaf->keys + half, (count - half) * sizeof(T));
+      right->count = count - half;
+      right->next = leaf->next;
+      leaf->next = right;
+      leaf->count = half;
+      if (pos > half) {
+        target = right;
+        pos -= half;
+      }
+      split_node = right;
+    }
+
+    memmove(target->keys + pos + 1, target->keys + pos, (target->count - pos) * sizeof(T));
+    target->keys[pos] = key;
+    target->count++;
+
+    if (split_node != NULL)
+      split_key = ((BTREE_LEAF<T> *) split_node)->keys[0];
+    return true;
+  }
+
+  BTREE_INNER<T> *inner = (BTREE_INNER<T> *) node;
+  uint32 count = inner->count;
+  uint32 idx = btree_count_less_or_equal(inner->keys, count, key);
+
+  T child_split_key;
+  void *child_split_node = NULL;
+  if (!btree_insert_(inner->children[idx], height - 1, key, child_split_key, child_split_node))
+    return false;
+
+  if (child_split_node == NULL)
+    return true;
+
+  if (count < BTREE_INNER<T>::CAPACITY) {
+    memmove(inner->keys + idx + 1, inner->keys + idx, (count - idx) * sizeof(T));
+    memmove(inner->children + idx + 2, inner->children + idx + 1, (count - idx) * sizeof(void *));
+    inner->keys[idx] = child_split_key;
+    inner->children[idx + 1] = child_split_node;
+    inner->count++;
+    return true;
+  }
+
+  // The node is full: the keys and children are merged in a temporary
+  // buffer, and the middle key is moved up to the parent
+  T keys[BTREE_INNER<T>::CAPACITY + 1];
+  void *children[BTREE_INNER<T>::CAPACITY + 2];
+
+  memcpy(keys, inner->keys, idx * sizeof(T));
+  keys[idx] = child_split_key;
+  memcpy(keys + idx + 1, inner->keys + idx, (count - idx) * sizeof(T));
+
+  memcpy(children, inner->children, (idx + 1) * sizeof(void *));
+  children[idx + 1] = child_split_node;
+  memcpy(children + idx + 2, inner->children + idx + 1, (count - idx) * sizeof(void *));
+
+  uint32 total = count + 1;
+  uint32 mid = total / 2;
+
+  BTREE_INNER<T> *right = btree_new_inner<T>();
+  right->count = total - mid - 1;
+  memcpy(right->keys, keys + mid + 1, right->count * sizeof(T));
+  memcpy(right->children, children + mid + 1, (right->count + 1) * sizeof(void *));
+
+  inner->count = mid;
+  memcpy(inner->keys, keys, mid * sizeof(T));
+  memcpy(inner->children, children, (mid + 1) * sizeof(void *));
+
+  split_key = keys[mid];
+  split_node = right;
+  return true;
+}
+
+template <typename T> bool btree_insert(BTREE *tree, const T &key) {
+  if (tree->root == NULL) {
+    BTREE_LEAF<T> *leaf = btree_new_leaf<T>();
+    leaf->keys[0] = key;
+    leaf->count = 1;
+    tree->root = leaf;
+    tree->height = 0;
+    tree->count = 1;
+    return true;
+  }
+
+  T split_key;
+  void *split_node = NULL;
+  if (!btree_insert_(tree->root, tree->height, key, split_key, split_node))
+    return false;
+
+  if (split_node != NULL) {
+    BTREE_INNER<T> *root = btree_new_inner<T>();
+    root->count = 1;
+    root->keys[0] = split_key;
+    root->children[0] = tree->root;
+    root->children[1] = split_node;
+    tree->root = root;
+    tree->height++;
+  }
+
+  tree->count++;
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+template <typename T> void btree_remove_child(BTREE_INNER<T> *inner, uint32 key_idx) {
+  uint32 count = inner->count;
+  memmove(inner->keys + key_idx, inner->keys + key_idx + 1, (count - key_idx - 1) * sizeof(T));
+  memmove(inner->children + key_idx + 1, inner->children + key_idx + 2, (count - key_idx - 1) * sizeof(void *));
+  inner->count--;
+}
+
+// Either merges the underfull child at position idx with one of its
+// siblings, or evens out the number of keys between the two of them
+template <typename T> void btree_rebalance(BTREE_INNER<T> *inner, uint32 idx, uint32 child_height) {
+  uint32 key_idx = idx > 0 ? idx - 1 : idx;
+  void *left_node = inner->children[key_idx];
+  void *right_node = inner->children[key_idx + 1];
+
+  if (child_height == 0) {
+    BTREE_LEAF<T> *left = (BTREE_LEAF<T> *) left_node;
+    BTREE_LEAF<T> *right = (BTREE_LEAF<T> *) right_node;
+    uint32 total = left->count + right->count;
+
+    if (total <= BTREE_LEAF<T>::CAPACITY) {
+      memcpy(left->keys + left->count, right->keys, right->count * sizeof(T));
+      left->count = total;
+      left->next = right->next;
+      free(right);
+      btree_remove_child(inner, key_idx);
+      return;
+    }
+
+    uint32 left_count = total / 2;
+    if (left->count > left_count) {
+      uint32 moved = left->count - left_count;
+      memmove(right->keys + moved, right->keys, right->count * sizeof(T));
+      memcpy(right->keys, left->keys + left_count, moved * sizeof(T));
+    }
+    else {
+      uint32 moved = left_count - left->count;
+      memcpy(left->keys + left->count, right->keys, moved * sizeof(T));
+      memmove(right->keys, right->keys + moved, (right->count - moved) * sizeof(T));
+    }
+    left->count = left_count;
+    right->count = total - left_count;
+    inner->keys[key_idx] = right->keys[0];
+    return;
+  }
+
+  BTREE_INNER<T> *left = (BTREE_INNER<T> *) left_node;
+  BTREE_INNER<T> *right = (BTREE_INNER<T> *) right_node;
+  uint32 total = left->count + 1 + right->count;
+
+  if (total <= BTREE_INNER<T>::CAPACITY) {
+    left->keys[left->count] = inner->keys[key_idx];
+    memcpy(left->keys + left->count + 1, right->keys, right->count * sizeof(T));
+    memcpy(left->children + left->count + 1, right->children, (right->count + 1) * sizeof(void *));
+    left->count = total;
+    free(right);
+    btree_remove_child(inner, key_idx);
+    return;
+  }
+
+  // The separator goes down, and the key in the middle goes up to replace it
+  T keys[2 * BTREE_INNER<T>::CAPACITY + 1];
+  void *children[2 * BTREE_INNER<T>::CAPACITY + 2];
+
+  memcpy(keys, left->keys, left->count * sizeof(T));
+  keys[left->count] = inner->keys[key_idx];
+  memcpy(keys + left->count + 1, right->keys, right->count * sizeof(T));
+  memcpy(children, left->children, (left->count + 1) * sizeof(void *));
+  memcpy(children + left->count + 1, right->children, (right->count + 1) * sizeof(void *));
+
+  uint32 left_count = total / 2;
+  left->count = left_count;
+  memcpy(left->keys, keys, left_count * sizeof(T));
+  memcpy(left->children, children, (left_count + 1) * sizeof(void *));
+
+  inner->keys[key_idx] = keys[left_count];
+
+  right->count = total - left_count - 1;
+  memcpy(right->keys, keys + left_count + 1, right->count * sizeof(T));
+  memcpy(right->children, children + left_count + 1, (right->count + 1) * sizeof(void *));
+}
+
+template <typename T> bool btree_erase_(void *node, uint32 height, const T &key) {
+  if (height == 0) {
+    BTREE_LEAF<T> *leaf = (BTREE_LEAF<T> *) node;
+    uint32 count = leaf->count;
+    uint32 pos = btree_count_less(leaf->keys, count, key);
+    if (pos == count || !(leaf->keys[pos] == key))
+      return false;
+    memmove(leaf->keys + pos, leaf->keys + pos + 1, (count - pos - 1) * sizeof(T));
+    leaf->count--;
+    return true;
+  }
+
+  BTREE_INNER<T> *inner = (BTREE_INNER<T> *) node;
+  uint32 idx = btree_count_less_or_equal(inner->keys, inner->count, key);
+  void *child = inner->children[idx];
+  if (!btree_erase_(child, height - 1, key))
+    return false;
+
+  uint32 min_count = height == 1 ? BTREE_LEAF<T>::MIN_COUNT : BTREE_INNER<T>::MIN_COUNT;
+  if (btree_node_count<T>(child, height - 1) < min_count)
+    btree_rebalance(inner, idx, height - 1);
+
+  return true;
+}
+
+template <typename T> bool btree_erase(BTREE *tree, const T &key) {
+  if (tree->root == NULL || !btree_erase_(tree->root, tree->height, key))
+    return false;
+
+  tree->count--;
+
+  if (tree->height > 0) {
+    BTREE_INNER<T> *root = (BTREE_INNER<T> *) tree->root;
+    if (root->count == 0) {
+      tree->root = root->children[0];
+      tree->height--;
+      free(root);
+    }
+  }
+  else if (tree->count == 0) {
+    free(tree->root);
+    tree->root = NULL;
+  }
+
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Builds the tree bottom-up from a sorted array of distinct keys. Nodes are
+// left partially empty, so that the first few inserts don't split them
+template <typename T> void btree_build(BTREE *tree, const T *keys, uint32 count) {
+  assert(tree->root == NULL);
+
+  if (count == 0)
+    return;
+
+  const uint32 leaf_fill = BTREE_LEAF<T>::CAPACITY - BTREE_LEAF<T>::CAPACITY / 8;
+  const uint32 inner_fill = BTREE_INNER<T>::CAPACITY - BTREE_INNER<T>::CAPACITY / 8 + 1;
+
+  std::vector<void *> nodes;
+  std::vector<T> lowest_keys;
+
+  uint32 leaves_count = (count + leaf_fill - 1) / leaf_fill;
+  BTREE_LEAF<T> *prev_leaf = NULL;
+  for (uint32 i=0, offset=0 ; i < leaves_count ; i++) {
+    uint32 size = count / leaves_count + (i < count % leaves_count ? 1 : 0);
+    BTREE_LEAF<T> *leaf = btree_new_leaf<T>();
+    memcpy(leaf->keys, keys + offset, size * sizeof(T));
+    leaf->count = size;
+    if (prev_leaf != NULL)
+      prev_leaf->next = leaf;
+    prev_leaf = leaf;
+    nodes.push_back(leaf);
+    lowest_keys.push_back(keys[offset]);
+    offset += size;
+  }
+
+  uint32 height = 0;
+  while (nodes.size() > 1) {
+    uint32 nodes_count = nodes.size();
+    uint32 parents_count = (nodes_count + inner_fill - 1) / inner_fill;
+    std::vector<void *> parents;
+    std::vector<T> parents_lowest_keys;
+    for (uint32 i=0, offset=0 ; i < parents_count ; i++) {
+      uint32 size = nodes_count / parents_count + (i < nodes_count % parents_count ? 1 : 0);
+      BTREE_INNER<T> *inner = btree_new_inner<T>();
+      inner->count = size - 1;
+      for (uint32 j=0 ; j < size ; j++) {
+        inner->children[j] = nodes[offset + j];
+        if (j > 0)
+          inner->keys[j - 1] = lowest_keys[offset + j];
+      }
+      parents.push_back(inner);
+      parents_lowest_keys.push_back(lowest_keys[offset]);
+      offset += size;
+    }
+    nodes.swap(parents);
+    lowest_keys.swap(parents_lowest_keys);
+    height++;
+  }
+
+  tree->root = nodes[0];
+  tree->height = height;
+  tree->count = count;
+}
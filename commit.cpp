@@ -0,0 +1,171 @@
+#include "lib.h"
+
+
+// The updates of distinct tables are independent of each other, except for the
+// reference counts of the value stores they share. So the tuples of all tables
+// are updated concurrently first, without touching the stores, and then the
+// reference counts are updated, with a single task for each value store that
+// collects the values inserted in all the columns that refer to it and adds
+// their references in one batch. Releasing values is left to commit_tables_finish(),
+// which runs on the calling thread, since it can free memory, and the memory
+// allocator is not thread-safe
+
+struct TASKS {
+  void (*run)(TASKS *tasks, uint32 idx);
+  uint32 count;
+  std::atomic<uint32> next;
+  TABLE_COMMIT *tables;
+  std::vector<VALUE_STORE *> stores;
+  std::vector< std::vector<uint32> > store_columns; // Table index * 3 + column index
+};
+
+static void run_worker(TASKS *tasks) {
+  for ( ; ; ) {
+    uint32 idx = tasks->next++;
+    if (idx >= tasks->count)
+      return;
+    tasks->run(tasks, idx);
+  }
+}
+
+// Below this total number of updates, starting the worker threads
+// would take longer than applying the updates on the calling thread
+const uint64 MIN_CONCURRENT_UPDATES = 16 * 1024;
+
+// Runs the tasks on up to one worker thread for each hardware thread, the
+// calling one included. The other workers are started on each call, and
+// joined before returning. Each worker picks the next task in line as soon
+// as it's done with the current one, so that a single large table doesn't
+// hold up the others. If concurrent is false all tasks run on the calling thread
+static void run_tasks(TASKS *tasks, void (*run)(TASKS *, uint32), uint32 count, bool concurrent) {
+  tasks->run = run;
+  tasks->count = count;
+  tasks->next = 0;
+
+  uint32 workers_count = concurrent ? std::thread::hardware_concurrency() : 1;
+  if (workers_count > count)
+    workers_count = count;
+
+  std::vector<std::thread> workers;
+  for (uint32 i=1 ; i < workers_count ; i++)
+    workers.push_back(std::thread(run_worker, tasks));
+  run_worker(tasks);
+  for (uint32 i=0 ; i < workers.size() ; i++)
+    workers[i].join();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void apply_tuples(TASKS *tasks, uint32 idx) {
+  TABLE_COMMIT *table = tasks->tables + idx;
+  switch (table->arity) {
+    case 1:
+      unary_table_updates_apply_tuples((UNARY_TABLE *) table->table, (UNARY_TABLE_UPDATES *) table->updates);
+      break;
+
+    case 2:
+      binary_table_updates_apply_tuples((BINARY_TABLE *) table->table, (BINARY_TABLE_UPDATES *) table->updates);
+      break;
+
+    case 3:
+      ternary_table_updates_apply_tuples((TERNARY_TABLE *) table->table, (TERNARY_TABLE_UPDATES *) table->updates);
+      break;
+
+    default:
+      internal_fail();
+  }
+}
+
+// Collects the values that were inserted in (or deleted from)
+// all the columns that refer to the value store of the given task
+static void collect_surrs(TASKS *tasks, uint32 idx, bool deleted, std::vector<uint32> &surrs) {
+  std::vector<uint32> &columns = tasks->store_columns[idx];
+  for (uint32 i=0 ; i < columns.size() ; i++) {
+    TABLE_COMMIT *table = tasks->tables + columns[i] / 3;
+    uint32 column = columns[i] % 3;
+    if (table->arity == 1) {
+      UNARY_TABLE_UPDATES *updates = (UNARY_TABLE_UPDATES *) table->updates;
+      if (deleted)
+        unary_table_updates_collect_deleted(updates, surrs);
+      else
+        unary_table_updates_collect_inserted(updates, surrs);
+    }
+    else if (table->arity == 2) {
+      BINARY_TABLE_UPDATES *updates = (BINARY_TABLE_UPDATES *) table->updates;
+      if (deleted)
+        binary_table_updates_collect_deleted(updates, column, surrs);
+      else
+        binary_table_updates_collect_inserted(updates, column, surrs);
+    }
+    else {
+      TERNARY_TABLE_UPDATES *updates = (TERNARY_TABLE_UPDATES *) table->updates;
+      if (deleted)
+        ternary_table_updates_collect_deleted(updates, column, surrs);
+      else
+        ternary_table_updates_collect_inserted(updates, column, surrs);
+    }
+  }
+}
+
+static uint64 updates_count(TABLE_COMMIT *table) {
+  if (table->arity == 1) {
+    UNARY_TABLE_UPDATES *updates = (UNARY_TABLE_UPDATES *) table->updates;
+    return updates->deletes_count + (uint64) updates->inserts_count;
+  }
+  else if (table->arity == 2) {
+    BINARY_TABLE_UPDATES *updates = (BINARY_TABLE_UPDATES *) table->updates;
+    return updates->deletes.size() + updates->inserts.size();
+  }
+  else {
+    TERNARY_TABLE_UPDATES *updates = (TERNARY_TABLE_UPDATES *) table->updates;
+    return updates->deletes.size() + updates->inserts.size();
+  }
+}
+
+static void add_refs(TASKS *tasks, uint32 idx) {
+  std::vector<uint32> surrs;
+  collect_surrs(tasks, idx, false, surrs);
+  value_store_add_ref_batch(tasks->stores[idx], surrs);
+}
+
+static void group_columns_by_store(TASKS *tasks, TABLE_COMMIT *tables, uint32 count) {
+  tasks->tables = tables;
+  for (uint32 i=0 ; i < count ; i++)
+    for (uint32 j=0 ; j < tables[i].arity ; j++) {
+      VALUE_STORE *store = tables[i].value_stores[j];
+      uint32 idx = std::find(tasks->stores.begin(), tasks->stores.end(), store) - tasks->stores.begin();
+      if (idx == tasks->stores.size()) {
+        tasks->stores.push_back(store);
+        tasks->store_columns.push_back(std::vector<uint32>());
+      }
+      tasks->store_columns[idx].push_back(3 * i + j);
+    }
+}
+
+void commit_tables_apply(TABLE_COMMIT *tables, uint32 count) {
+  TASKS tasks;
+  group_columns_by_store(&tasks, tables, count);
+
+  uint64 total_updates = 0;
+  for (uint32 i=0 ; i < count ; i++)
+    total_updates += updates_count(tables + i);
+  bool concurrent = total_updates >= MIN_CONCURRENT_UPDATES;
+
+  run_tasks(&tasks, apply_tuples, count, concurrent);
+  run_tasks(&tasks, add_refs, tasks.stores.size(), concurrent);
+}
+
+void commit_tables_finish(TABLE_COMMIT *tables, uint32 count) {
+  TASKS tasks;
+  group_columns_by_store(&tasks, tables, count);
+
+  for (uint32 i=0 ; i < tasks.stores.size() ; i++) {
+    std::vector<uint32> surrs;
+    collect_surrs(&tasks, i, true, surrs);
+    value_store_release_batch(tasks.stores[i], surrs);
+  }
+
+  for (uint32 i=0 ; i < count ; i++)
+    if (tables[i].arity == 1)
+      unary_table_updates_cleanup((UNARY_TABLE_UPDATES *) tables[i].updates);
+}
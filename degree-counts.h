@@ -0,0 +1,54 @@
+// Number of tuples of a table for each of the values in one of its columns,
+// in an array indexed by surrogate that grows as needed. The number of values
+// whose count is greater than one tells whether the column is a key
+
+inline void degree_counts_cleanup(DEGREE_COUNTS *degrees) {
+  free(degrees->counts);
+  memset(degrees, 0, sizeof(DEGREE_COUNTS));
+}
+
+inline void degree_counts_increment(DEGREE_COUNTS *degrees, uint32 value) {
+  uint32 capacity = degrees->capacity;
+  if (value >= capacity) {
+    uint32 new_capacity = capacity > 0 ? capacity : 256;
+    while (value >= new_capacity)
+      new_capacity *= 2;
+    degrees->counts = (uint32 *) realloc(degrees->counts, new_capacity * sizeof(uint32));
+    memset(degrees->counts + capacity, 0, (new_capacity - capacity) * sizeof(uint32));
+    degrees->capacity = new_capacity;
+  }
+
+  uint32 count = ++degrees->counts[value];
+  if (count == 1)
+    degrees->distinct_count++;
+  else if (count == 2)
+    degrees->repeated_count++;
+}
+
+inline void degree_counts_decrement(DEGREE_COUNTS *degrees, uint32 value) {
+  assert(value < degrees->capacity && degrees->counts[value] > 0);
+  uint32 count = --degrees->counts[value];
+  if (count == 0)
+    degrees->distinct_count--;
+  else if (count == 1)
+    degrees->repeated_count--;
+}
+
+inline uint32 degree_counts_get(DEGREE_COUNTS *degrees, uint32 value) {
+  return value < degrees->capacity ? degrees->counts[value] : 0;
+}
+
+// Surrogate maps produced by value_store_compact() never map two
+// values to the same surrogate, and never increase a surrogate
+inline void degree_counts_remap(DEGREE_COUNTS *degrees, const uint32 *surr_map) {
+  uint32 *counts = degrees->counts;
+  for (uint32 i=0 ; i < degrees->capacity ; i++) {
+    uint32 count = counts[i];
+    if (count != 0) {
+      uint32 new_surr = surr_map[i];
+      assert(new_surr != INVALID_INDEX && new_surr <= i);
+      counts[i] = 0;
+      counts[new_surr] = count;
+    }
+  }
+}
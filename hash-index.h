@@ -0,0 +1,120 @@
+// Open addressing hash set of packed pairs (uint64) or tuple3 triples, used
+// to answer exact membership queries on binary and ternary tables in constant
+// time. It uses linear probing and backward shift deletion, so it needs no
+// tombstones. Empty slots have all their bits set, which is not a valid tuple
+
+const uint32 HASH_INDEX_MIN_CAPACITY = 16;
+
+inline bool hash_index_is_empty(uint64 key) {
+  return key == 0xFFFFFFFFFFFFFFFFULL;
+}
+
+inline bool hash_index_is_empty(const tuple3 &key) {
+  return key.fields01 == 0xFFFFFFFFFFFFFFFFULL;
+}
+
+inline uint64 hash_index_mix(uint64 x) {
+  x ^= x >> 33;
+  x *= 0xFF51AFD7ED558CCDULL;
+  x ^= x >> 33;
+  x *= 0xC4CEB9FE1A85EC53ULL;
+  x ^= x >> 33;
+  return x;
+}
+
+inline uint64 hash_index_hash(uint64 key) {
+  return hash_index_mix(key);
+}
+
+inline uint64 hash_index_hash(const tuple3 &key) {
+  return hash_index_mix(key.fields01 ^ hash_index_mix(key.field2));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+template <typename T> T *hash_index_alloc_slots(uint32 capacity) {
+  T *slots = (T *) malloc(capacity * sizeof(T));
+  memset(slots, 0xFF, capacity * sizeof(T));
+  return slots;
+}
+
+template <typename T> void hash_index_cleanup(HASH_INDEX *index) {
+  free(index->slots);
+  index->slots = NULL;
+  index->capacity = 0;
+  index->count = 0;
+}
+
+template <typename T> bool hash_index_contains(HASH_INDEX *index, const T &key) {
+  T *slots = (T *) index->slots;
+  uint32 mask = index->capacity - 1;
+  for (uint32 i = hash_index_hash(key) & mask ; ; i = (i + 1) & mask) {
+    const T &slot = slots[i];
+    if (hash_index_is_empty(slot))
+      return false;
+    if (slot == key)
+      return true;
+  }
+}
+
+// Does not check whether the key is already in the set
+template <typename T> void hash_index_insert_new(T *slots, uint32 capacity, const T &key) {
+  uint32 mask = capacity - 1;
+  uint32 i = hash_index_hash(key) & mask;
+  while (!hash_index_is_empty(slots[i]))
+    i = (i + 1) & mask;
+  slots[i] = key;
+}
+
+template <typename T> void hash_index_resize(HASH_INDEX *index, uint32 capacity) {
+  T *slots = (T *) index->slots;
+  T *new_slots = hash_index_alloc_slots<T>(capacity);
+  for (uint32 i=0 ; i < index->capacity ; i++)
+    if (!hash_index_is_empty(slots[i]))
+      hash_index_insert_new(new_slots, capacity, slots[i]);
+  free(slots);
+  index->slots = new_slots;
+  index->capacity = capacity;
+}
+
+// The load factor is kept below 3/4
+template <typename T> void hash_index_insert(HASH_INDEX *index, const T &key) {
+  if (4 * (uint64) (index->count + 1) > 3 * (uint64) index->capacity)
+    hash_index_resize<T>(index, 2 * index->capacity);
+  hash_index_insert_new((T *) index->slots, index->capacity, key);
+  index->count++;
+}
+
+template <typename T> void hash_index_erase(HASH_INDEX *index, const T &key) {
+  T *slots = (T *) index->slots;
+  uint32 mask = index->capacity - 1;
+
+  uint32 i = hash_index_hash(key) & mask;
+  while (!(slots[i] == key)) {
+    assert(!hash_index_is_empty(slots[i]));
+    i = (i + 1) & mask;
+  }
+
+  // Moving back the following entries of the cluster that would
+  // no longer be reachable from their home slot once i is emptied
+  for (uint32 j = (i + 1) & mask ; !hash_index_is_empty(slots[j]) ; j = (j + 1) & mask) {
+    uint32 home = hash_index_hash(slots[j]) & mask;
+    if (((j - home) & mask) >= ((j - i) & mask)) {
+      slots[i] = slots[j];
+      i = j;
+    }
+  }
+  memset(slots + i, 0xFF, sizeof(T));
+  index->count--;
+}
+
+// Allocates room for the given number of keys, which are then added with hash_index_insert()
+template <typename T> void hash_index_reset(HASH_INDEX *index, uint32 expected_count) {
+  uint32 capacity = HASH_INDEX_MIN_CAPACITY;
+  while (4 * (uint64) expected_count > 3 * (uint64) capacity)
+    capacity *= 2;
+  free(index->slots);
+  index->slots = hash_index_alloc_slots<T>(capacity);
+  index->capacity = capacity;
+  index->count = 0;
+}
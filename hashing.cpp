@@ -1,77 +1,133 @@
 #include "lib.h"
 
 
-const uint32 BASE_VALUE   = 17;
-const uint32 MULTIPLIER   = 37;
-
-const uint32 MULT_BASE_VALUE = BASE_VALUE * MULTIPLIER;
+// 64-bit mixing in the style of xxHash64. Only plain 64-bit multiplications
+// and rotations are used, so the code is portable to all supported compilers.
+// Equal values must have equal hash codes, so inline objects (which are equal
+// only if they are bitwise identical) are hashed by their two words, while
+// references are hashed at the logical level, so that for example a slice and
+// a sequence with the same elements, or the two representations of a tagged
+// sequence, end up with the same hash code
+
+const uint64 PRIME_1 = 0x9E3779B185EBCA87ULL;
+const uint64 PRIME_2 = 0xC2B2AE3D27D4EB4FULL;
+const uint64 PRIME_3 = 0x165667B19E3779F9ULL;
+const uint64 PRIME_4 = 0x85EBCA77C2B2AE63ULL;
+const uint64 PRIME_5 = 0x27D4EB2F165667C5ULL;
 
 ////////////////////////////////////////////////////////////////////////////////
 
-uint32 combined_hash_code(uint32 start_value, OBJ *array, uint32 count) {
-  uint32 hash_code = start_value;
-  for (uint32 i=0 ; i < count ; i++)
-    hash_code = MULTIPLIER * hash_code + compute_hash_code(array[i]);
-  return hash_code;
+static inline uint64 rotl(uint64 word, int count) {
+  return (word << count) | (word >> (64 - count));
 }
 
-uint32 compute_hash_code(OBJ obj) {
-  if (is_tag_obj(obj))
-    return MULTIPLIER * (MULT_BASE_VALUE + get_tag_idx(obj)) + compute_hash_code(get_inner_obj(obj));
+static inline uint64 mix_round(uint64 acc, uint64 input) {
+  acc += input * PRIME_2;
+  acc = rotl(acc, 31);
+  return acc * PRIME_1;
+}
 
-  switch (get_physical_type(obj)) {
-    case TYPE_BLANK_OBJ:
-    case TYPE_NULL_OBJ:
-      fail();
+static inline uint64 merge_round(uint64 acc, uint64 input) {
+  acc ^= mix_round(0, input);
+  return acc * PRIME_1 + PRIME_4;
+}
 
-    case TYPE_SYMBOL:
-      return MULT_BASE_VALUE + get_symb_idx(obj);
+static inline uint64 avalanche(uint64 hash) {
+  hash ^= hash >> 33;
+  hash *= PRIME_2;
+  hash ^= hash >> 29;
+  hash *= PRIME_3;
+  hash ^= hash >> 32;
+  return hash;
+}
 
-    case TYPE_INTEGER:
-    case TYPE_FLOAT: {
-      uint64 core_data = obj.core_data.int_;
-      return MULT_BASE_VALUE + (uint32) (core_data ^ (core_data >> 32));
-    }
+static inline uint64 mix_obj(uint64 acc, OBJ obj) {
+  if (is_inline_obj(obj))
+    return mix_round(mix_round(acc, obj.core_data.int_), obj.extra_data);
+  else
+    return mix_round(acc, compute_hash_code_64(obj));
+}
 
-    case TYPE_SEQUENCE: {
-      uint32 size = get_seq_length(obj);
-      return combined_hash_code(MULT_BASE_VALUE + size, size > 0 ? get_seq_buffer_ptr(obj) : NULL, size);
+////////////////////////////////////////////////////////////////////////////////
+
+// Arrays of four or more elements are processed in four independent lanes,
+// which breaks the dependency chain between consecutive multiplications. For
+// arrays that only contain inline objects (the common case for the columns of
+// sets and relations) the loop body is branch-free in practice
+static uint64 hash_array(uint64 seed, OBJ *array, uint32 count) {
+  uint64 hash;
+  uint32 i = 0;
+
+  if (count >= 4) {
+    uint64 acc_1 = seed + PRIME_1 + PRIME_2;
+    uint64 acc_2 = seed + PRIME_2;
+    uint64 acc_3 = seed;
+    uint64 acc_4 = seed - PRIME_1;
+
+    for ( ; i + 4 <= count ; i += 4) {
+      acc_1 = mix_obj(acc_1, array[i]);
+      acc_2 = mix_obj(acc_2, array[i+1]);
+      acc_3 = mix_obj(acc_3, array[i+2]);
+      acc_4 = mix_obj(acc_4, array[i+3]);
     }
 
+    hash = rotl(acc_1, 1) + rotl(acc_2, 7) + rotl(acc_3, 12) + rotl(acc_4, 18);
+    hash = merge_round(hash, acc_1);
+    hash = merge_round(hash, acc_2);
+    hash = merge_round(hash, acc_3);
+    hash = merge_round(hash, acc_4);
+  }
+  else
+    hash = seed + PRIME_5;
+
+  hash += count;
+
+  for ( ; i < count ; i++)
+    hash = rotl(hash ^ mix_obj(0, array[i]), 27) * PRIME_1 + PRIME_4;
+
+  return avalanche(hash);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+uint64 compute_hash_code_64(OBJ obj) {
+  if (is_inline_obj(obj))
+    return avalanche(mix_round(mix_round(PRIME_5, obj.core_data.int_), obj.extra_data));
+
+  if (is_tag_obj(obj)) {
+    uint64 hash = merge_round(PRIME_5 + TYPE_TAG_OBJ, get_tag_idx(obj));
+    return avalanche(merge_round(hash, compute_hash_code_64(get_inner_obj(obj))));
+  }
+
+  switch (get_physical_type(obj)) {
+    case TYPE_SEQUENCE:
+    case TYPE_SLICE:
+      return hash_array(PRIME_3 * TYPE_SEQUENCE, get_seq_buffer_ptr(obj), get_seq_length(obj));
+
     case TYPE_SET: {
-      if (is_empty_rel(obj))
-        return MULT_BASE_VALUE;
       SET_OBJ *ptr = get_set_ptr(obj);
-      uint32 size = ptr->size;
-      return combined_hash_code(MULT_BASE_VALUE + size, ptr->buffer, size);
+      return hash_array(PRIME_3 * TYPE_SET, ptr->buffer, ptr->size);
     }
 
-    case TYPE_BIN_REL: {
+    case TYPE_BIN_REL:
+    case TYPE_MAP:
+    case TYPE_LOG_MAP: {
       BIN_REL_OBJ *ptr = get_bin_rel_ptr(obj);
-      uint32 size = ptr->size;
-      return combined_hash_code(MULT_BASE_VALUE + size, ptr->buffer, 2 * size);
+      return hash_array(PRIME_3 * TYPE_BIN_REL, ptr->buffer, 2 * ptr->size);
     }
 
     case TYPE_TERN_REL: {
       TERN_REL_OBJ *ptr = get_tern_rel_ptr(obj);
-      uint32 size = ptr->size;
-      return combined_hash_code(MULT_BASE_VALUE + size, ptr->buffer, 3 * size);
+      return hash_array(PRIME_3 * TYPE_TERN_REL, ptr->buffer, 3 * ptr->size);
     }
 
-    case TYPE_TAG_OBJ:
+    default:
       fail();
-
-    case TYPE_SLICE: {
-      uint32 size = get_seq_length(obj);
-      return combined_hash_code(MULT_BASE_VALUE + size, get_seq_buffer_ptr(obj), size);
-    }
-
-    case TYPE_MAP:
-    case TYPE_LOG_MAP: {
-      BIN_REL_OBJ *ptr = get_bin_rel_ptr(obj);
-      uint32 size = ptr->size;
-      return combined_hash_code(MULT_BASE_VALUE + size, ptr->buffer, 2 * size);
-    }
   }
   fail();
 }
+
+uint32 compute_hash_code(OBJ obj) {
+  uint64 hash = compute_hash_code_64(obj);
+  return (uint32) (hash ^ (hash >> 32));
+}
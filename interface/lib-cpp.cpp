@@ -37,3 +37,58 @@ bool table_contains(TERNARY_TABLE &table, VALUE_STORE &store0, VALUE_STORE &stor
   release(obj2);
   return surr2 != -1 && ternary_table_contains(&table, surr0, surr1, surr2);
 }
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Batch versions of the above. The objects are looked up in each
+// value store with a single call to lookup_values(), and then released
+
+static void lookup_and_release(VALUE_STORE &store, std::vector<OBJ> &objs, std::vector<int64> &surrs) {
+  uint32 count = objs.size();
+  surrs.resize(count);
+  if (count > 0)
+    lookup_values(&store, objs.data(), count, surrs.data());
+  for (uint32 i=0 ; i < count ; i++)
+    release(objs[i]);
+}
+
+std::vector<bool> table_contains(UNARY_TABLE &table, VALUE_STORE &store, std::vector<OBJ> &objs) {
+  std::vector<int64> surrs;
+  lookup_and_release(store, objs, surrs);
+
+  uint32 count = surrs.size();
+  std::vector<bool> result(count);
+  for (uint32 i=0 ; i < count ; i++)
+    result[i] = surrs[i] != -1 && unary_table_contains(&table, surrs[i]);
+  return result;
+}
+
+std::vector<bool> table_contains(BINARY_TABLE &table, VALUE_STORE &store0, VALUE_STORE &store1, std::vector<OBJ> &objs0, std::vector<OBJ> &objs1) {
+  assert(objs0.size() == objs1.size());
+
+  std::vector<int64> surrs0, surrs1;
+  lookup_and_release(store0, objs0, surrs0);
+  lookup_and_release(store1, objs1, surrs1);
+
+  uint32 count = surrs0.size();
+  std::vector<bool> result(count);
+  for (uint32 i=0 ; i < count ; i++)
+    result[i] = surrs0[i] != -1 && surrs1[i] != -1 && binary_table_contains(&table, surrs0[i], surrs1[i]);
+  return result;
+}
+
+std::vector<bool> table_contains(TERNARY_TABLE &table, VALUE_STORE &store0, VALUE_STORE &store1, VALUE_STORE &store2, std::vector<OBJ> &objs0, std::vector<OBJ> &objs1, std::vector<OBJ> &objs2) {
+  assert(objs0.size() == objs1.size() && objs0.size() == objs2.size());
+
+  std::vector<int64> surrs0, surrs1, surrs2;
+  lookup_and_release(store0, objs0, surrs0);
+  lookup_and_release(store1, objs1, surrs1);
+  lookup_and_release(store2, objs2, surrs2);
+
+  uint32 count = surrs0.size();
+  std::vector<bool> result(count);
+  for (uint32 i=0 ; i < count ; i++)
+    result[i] = surrs0[i] != -1 && surrs1[i] != -1 && surrs2[i] != -1 &&
+                ternary_table_contains(&table, surrs0[i], surrs1[i], surrs2[i]);
+  return result;
+}
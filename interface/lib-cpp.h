@@ -27,6 +27,10 @@ bool table_contains(UNARY_TABLE &, VALUE_STORE &, OBJ);
 bool table_contains(BINARY_TABLE &, VALUE_STORE &, VALUE_STORE &, OBJ, OBJ);
 bool table_contains(TERNARY_TABLE &, VALUE_STORE &, VALUE_STORE &, VALUE_STORE &, OBJ, OBJ, OBJ);
 
+vector<bool> table_contains(UNARY_TABLE &, VALUE_STORE &, vector<OBJ> &);
+vector<bool> table_contains(BINARY_TABLE &, VALUE_STORE &, VALUE_STORE &, vector<OBJ> &, vector<OBJ> &);
+vector<bool> table_contains(TERNARY_TABLE &, VALUE_STORE &, VALUE_STORE &, VALUE_STORE &, vector<OBJ> &, vector<OBJ> &, vector<OBJ> &);
+
 ////////////////////////////////////////////////////////////////////////////////
 
 template <typename T> vector<typename T::type> export_as_vector(OBJ obj) {
@@ -202,7 +206,7 @@ template <typename T> vector<typename T::type> get_unary_rel(UNARY_TABLE &table,
 
 template <typename T0, typename T1> vector<tuple<typename T0::type, typename T1::type> >
 get_binary_rel(BINARY_TABLE &table, VALUE_STORE &store0, VALUE_STORE &store1, bool flipped) {
-  uint32 size = table.left_to_right.size();
+  uint32 size = binary_table_size(&table);
   vector<tuple<typename T0::type, typename T1::type> > result(size);
   BINARY_TABLE_ITER iter;
   binary_table_get_iter(&table, &iter);
@@ -222,7 +226,7 @@ get_binary_rel(BINARY_TABLE &table, VALUE_STORE &store0, VALUE_STORE &store1, bo
 template <typename T0, typename T1, typename T2> vector<tuple<typename T0::type, typename T1::type, typename T2::type> >
 get_ternary_rel(TERNARY_TABLE &table, VALUE_STORE &store0, VALUE_STORE &store1, VALUE_STORE &store2,
     int idx0, int idx1, int idx2) {
-  uint32 size = table.unshifted.size();
+  uint32 size = ternary_table_size(&table);
   vector<tuple<typename T0::type, typename T1::type, typename T2::type> > result(size);
   TERNARY_TABLE_ITER iter;
   ternary_table_get_iter(&table, &iter);
@@ -170,11 +170,29 @@ struct STREAM {
 
 ////////////////////////////////////////////////////////////////////////////////
 
+struct DIRECT_INDEX {
+  uint32 *surrs;
+  uint32 size;
+};
+
+
 struct VALUE_STORE {
   void *ptr;
   uint32 capacity;
   uint32 usage;
   uint32 first_free;
+  void *index;
+  uint32 tombstones;
+  // The following fields are only used while the index is being resized
+  void *old_index;
+  uint32 old_buckets;
+  uint32 migrated;
+  // Symbols and small integers
+  DIRECT_INDEX symbols;
+  DIRECT_INDEX ints;
+  // One bit for each chunk of SNAPSHOT_CHUNK_SIZE slots, set when any of
+  // them is modified and cleared when a snapshot of the store is taken
+  uint64 *dirty_chunks;
 };
 
 
@@ -183,13 +201,65 @@ struct VALUE_STORE_UPDATES {
   uint32 capacity;
   uint32 count;
   uint32 first_free;
+  void *index;
+  DIRECT_INDEX symbols;
+  DIRECT_INDEX ints;
+};
+
+
+struct UNARY_CONTAINER {
+  void   *data;
+  uint32  key;      // Upper 16 bits of all the values in the container
+  uint32  count;    // Number of values in the container
+  uint32  length;   // Number of values (arrays) or runs (run containers) stored in data
+  uint32  capacity; // Number of values or runs there's room for in data
+  uint8   type;
+  bool    dirty;
 };
 
 
 struct UNARY_TABLE {
-  uint64 *bitmap;
-  uint32 size;
+  uint64 *bitmap;   // NULL if the table is compressed
+  uint32 size;      // Number of bits in the bitmap
   uint32 count;
+  UNARY_CONTAINER *containers; // Sorted by key, only used if the table is compressed
+  uint32 containers_count;
+  uint32 containers_capacity;
+};
+
+
+// A set expression over unary tables that share the same value store
+struct UNARY_TABLE_EXPR {
+  UNARY_TABLE **all;  // The values must be in all these tables,
+  uint32 all_count;
+  UNARY_TABLE **any;  // in at least one of these (ignored if any_count is zero),
+  uint32 any_count;
+  UNARY_TABLE **none; // and in none of these
+  uint32 none_count;
+};
+
+
+struct UNARY_BITMAP {
+  uint64 *words;
+  uint64 size;  // Number of bits, which can be 2^32
+  uint64 count; // Number of bits set
+};
+
+
+// Number of words in a chunk of 65536 values of a unary table
+const uint32 UNARY_CHUNK_WORDS = 1024;
+
+// Holds three chunk-sized buffers, that is, 24 KB: when allocated on
+// the stack, it should not be in deeply recursive or small-stack code
+struct UNARY_EXPR_ITER {
+  UNARY_TABLE_EXPR *expr; // NULL if the iterator is out of range
+  uint32 chunk;           // Chunk of 65536 values currently loaded in words
+  uint32 chunks_count;
+  uint32 word_idx;
+  uint64 word;            // Bits of words[word_idx] that have not been visited yet
+  uint64 words[UNARY_CHUNK_WORDS];
+  uint64 scratch[UNARY_CHUNK_WORDS];
+  uint64 any_words[UNARY_CHUNK_WORDS];
 };
 
 
@@ -198,19 +268,85 @@ struct UNARY_TABLE_UPDATES {
   uint32 deletes_count;
   uint32 inserts_count;
   uint32 *buffer; // Deletes are stored at the front, inserts at the back
+  bool cleared;   // Set by unary_table_clear()
 };
 
 
 struct UNARY_TABLE_ITER {
-  uint64 *bitmap;
-  uint32 size;
+  UNARY_TABLE *table;   // NULL if the iterator is out of range
+  uint32 container_idx; // Container of the current value, for compressed tables
   uint32 curr_value;
 };
 
 
+// One sort order of a binary table. The pairs are kept in a large sorted
+// array plus two small sorted buffers, which hold respectively the pairs
+// inserted and deleted since the last time they were merged into it
+struct SORTED_PAIRS {
+  uint64 *main;
+  uint64 *delta;      // Pairs that are not in the main array
+  uint64 *tombstones; // Pairs of the main array that have been deleted
+  uint32 main_count;
+  uint32 delta_count;
+  uint32 tombstones_count;
+};
+
+
+// B+tree of packed pairs or tuple3 triples. The layout of the nodes is defined in btree.h
+struct BTREE {
+  void *root;    // NULL if the tree is empty
+  uint32 height; // Number of levels of inner nodes
+  uint32 count;
+};
+
+
+// Optional hash set of all the tuples of a table, for exact membership queries.
+// Its layout is defined in hash-index.h. slots is NULL when the index is disabled
+struct HASH_INDEX {
+  void *slots;
+  uint32 capacity;
+  uint32 count;
+};
+
+
+// Optional per-value tuple counts for one of the columns of a table. The
+// helper functions are in degree-counts.h. counts is NULL until the first
+// tuple is inserted, so use enabled, not counts, to tell whether the counts
+// are maintained
+struct DEGREE_COUNTS {
+  uint32 *counts;         // Indexed by surrogate
+  uint32 capacity;
+  uint32 distinct_count;  // Number of values with a nonzero count
+  uint32 repeated_count;  // Number of values with a count greater than one
+  bool enabled;
+};
+
+
+enum TABLE_BACKEND {
+  TABLE_BACKEND_SORTED_ARRAYS, // Cheapest to scan, and the default
+  TABLE_BACKEND_BTREE,         // For tables that are updated often
+  TABLE_BACKEND_DENSE,         // Only for tables whose left column is a key
+  TABLE_BACKEND_DENSE_INDEXED  // Same as above, plus a right-to-left index
+};
+
+
+// Right values of a binary table whose left column is a key, indexed by left value
+struct DENSE_COLUMN {
+  uint32 *values; // 0xFFFFFFFF for left values that are not in the table
+  uint32 capacity;
+};
+
+
 struct BINARY_TABLE {
-  std::set<uint64> left_to_right;
-  std::set<uint64> right_to_left;
+  SORTED_PAIRS left_to_right;
+  SORTED_PAIRS right_to_left; // Same pairs, with the two fields swapped
+  BTREE left_to_right_tree;   // Used instead of the sorted arrays with TABLE_BACKEND_BTREE
+  BTREE right_to_left_tree;
+  DENSE_COLUMN dense;         // Used with the dense backends, which also use right_to_left
+  HASH_INDEX hash_index;
+  DEGREE_COUNTS degrees[2];
+  uint32 count;
+  TABLE_BACKEND backend;
 };
 
 
@@ -220,9 +356,23 @@ struct BINARY_TABLE_UPDATES {
 };
 
 
+// Merges the main array of a SORTED_PAIRS with its delta buffer on the fly,
+// skipping the pairs that have a tombstone. main always points to a live pair.
+// With TABLE_BACKEND_BTREE main and main_end span the keys of the current leaf,
+// and the delta and tombstone ranges are empty. Scans of a DENSE_COLUMN use the
+// column fields instead, and column_idx is always the left value of a live pair
 struct BINARY_TABLE_ITER {
-  std::set<uint64>::iterator iter;
-  std::set<uint64>::iterator end;
+  uint64 *main;
+  uint64 *main_end;
+  void *leaf; // NULL for sorted arrays, or once past the last leaf
+  uint64 *delta;
+  uint64 *delta_end;
+  uint64 *tombstones;
+  uint64 *tombstones_end;
+  uint32 *column;       // NULL unless scanning a DENSE_COLUMN
+  uint32 column_idx;
+  uint32 column_end;
+  uint32 column_match;  // Right value to look for, or 0xFFFFFFFF to match them all
   uint32 value;
   bool reversed;
 };
@@ -246,10 +396,43 @@ struct tuple3 {
 // }
 
 
+// Rows of a ternary table sorted by their fields, starting from a given column
+// and wrapping around. The rows added since the last compaction are kept in a
+// small separate array, and are merged into the main one when it's compacted
+struct TERNARY_TABLE_INDEX {
+  uint32 *main;
+  uint32 *delta;
+  uint32 main_count;
+  uint32 delta_count;
+  bool built;
+};
+
+
+// Each triple is stored only once, as a row of the three column arrays. Rows
+// that are deleted are only flagged as such until the next compaction, which
+// renumbers the remaining ones. indexes[i] sorts the rows by columns i, i+1
+// and i+2 (mod 3). indexes[0] is always built, the other two only when needed.
+// With TABLE_BACKEND_BTREE the triples are instead stored in three B+trees,
+// and trees[i] holds them with their fields rotated to start from column i
 struct TERNARY_TABLE {
-  std::set<tuple3> unshifted;
-  std::set<tuple3> shifted_once;
-  std::set<tuple3> shifted_twice;
+  uint32 *columns[3];
+  uint64 *deleted_rows; // Bitmap
+  uint32 rows_count;
+  uint32 capacity;
+  uint32 deleted_count;
+  uint32 count;         // Number of rows (or triples in the trees) that have not been deleted
+  TERNARY_TABLE_INDEX indexes[3];
+  BTREE trees[3];
+  HASH_INDEX hash_index;
+  DEGREE_COUNTS degrees[3];
+  TABLE_BACKEND backend; // Either TABLE_BACKEND_SORTED_ARRAYS or TABLE_BACKEND_BTREE
+};
+
+
+// One of the sort orders of a ternary table, as a target for table_updates_check_key()
+struct TERNARY_TABLE_ORDER {
+  TERNARY_TABLE *table;
+  uint32 shift;
 };
 
 
@@ -259,13 +442,140 @@ struct TERNARY_TABLE_UPDATES {
 };
 
 
+// Merges the main and delta arrays of one of the indexes, skipping deleted rows.
+// With TABLE_BACKEND_BTREE it walks the leaves of trees[shift] instead: curr and
+// end span the keys of the current leaf, and the index fields are not used
 struct TERNARY_TABLE_ITER {
-  std::set<tuple3>::iterator iter;
-  std::set<tuple3>::iterator end;
+  TERNARY_TABLE *table;
+  uint32 *main;
+  uint32 *main_end;
+  uint32 *delta;
+  uint32 *delta_end;
+  uint32 row;           // Current row, or INVALID_INDEX once the rows are exhausted
+  tuple3 *curr;
+  tuple3 *end;
+  void *leaf;           // NULL once past the last leaf
+  uint64 excl_upper_bound;
+  uint8 shift;
+};
+
+
+const uint32 SNAPSHOT_CHUNK_SIZE = 1024;
+
+// Immutable block of consecutive entries of a snapshot of a value store or a
+// table, followed by the entries themselves. Chunks are shared by consecutive
+// snapshots when the range they cover is not affected by an update
+struct SNAPSHOT_CHUNK {
+  uint32 ref_count; // Number of snapshots that use it, only accessed by the writer
+  uint32 count;
+};
+
+
+struct VALUE_STORE_SNAPSHOT {
+  SNAPSHOT_CHUNK **chunks; // All but the last one have SNAPSHOT_CHUNK_SIZE slots
+  uint32 chunks_count;
+  uint32 capacity;
+};
+
+
+// The tuples of table snapshots are sorted, and so are their chunks. Binary
+// and ternary ones are stored once for each column they can be searched by,
+// with the fields rotated so that that column comes first, like the trees
+// of a TERNARY_TABLE: chunks[1] of a binary table has the columns swapped,
+// and chunks[i] of a ternary table has the triples starting from column i
+
+struct UNARY_TABLE_SNAPSHOT {
+  SNAPSHOT_CHUNK **chunks; // Of uint32
+  uint32 chunks_count;
+  uint32 count;
+};
+
+
+struct BINARY_TABLE_SNAPSHOT {
+  SNAPSHOT_CHUNK **chunks[2]; // Of uint64
+  uint32 chunks_count[2];
+  uint32 count;
+};
+
+
+struct TERNARY_TABLE_SNAPSHOT {
+  SNAPSHOT_CHUNK **chunks[3]; // Of tuple3
+  uint32 chunks_count[3];
+  uint32 count;
+};
+
+
+struct SNAPSHOT {
+  std::atomic<uint32> ref_count;
+  SNAPSHOT *next_retired;
+  uint32 value_stores_count;
+  uint32 unary_tables_count;
+  uint32 binary_tables_count;
+  uint32 ternary_tables_count;
+  VALUE_STORE_SNAPSHOT   *value_stores;
+  UNARY_TABLE_SNAPSHOT   *unary_tables;
+  BINARY_TABLE_SNAPSHOT  *binary_tables;
+  TERNARY_TABLE_SNAPSHOT *ternary_tables;
+};
+
+
+// Iterators over a table snapshot, which must not be used after the snapshot
+// has been released. chunk and chunks_end span the chunks that are left, and
+// idx is the position in the current one. chunk is set to chunks_end as soon
+// as the current tuple (or its fields01) is not below excl_upper_bound, and
+// shift is the column the tuples of the chunks being scanned start from
+
+struct UNARY_TABLE_SNAPSHOT_ITER {
+  SNAPSHOT_CHUNK **chunk;
+  SNAPSHOT_CHUNK **chunks_end;
+  uint32 idx;
+};
+
+
+struct BINARY_TABLE_SNAPSHOT_ITER {
+  SNAPSHOT_CHUNK **chunk;
+  SNAPSHOT_CHUNK **chunks_end;
+  uint32 idx;
+  uint64 excl_upper_bound;
+  uint8 shift;
+};
+
+
+struct TERNARY_TABLE_SNAPSHOT_ITER {
+  SNAPSHOT_CHUNK **chunk;
+  SNAPSHOT_CHUNK **chunks_end;
+  uint32 idx;
   uint64 excl_upper_bound;
   uint8 shift;
 };
 
+
+struct SNAPSHOT_PUBLISHER {
+  std::atomic<SNAPSHOT *> current;
+  std::atomic<uint32> acquiring;
+  SNAPSHOT *retired; // Only accessed by the writer
+};
+
+
+// One of the tables updated by a transaction. Depending on its arity (1, 2
+// or 3) table and updates point to a UNARY_TABLE and a UNARY_TABLE_UPDATES,
+// a BINARY_TABLE and a BINARY_TABLE_UPDATES, or a TERNARY_TABLE and a
+// TERNARY_TABLE_UPDATES. value_stores[i] is the store of column i
+struct TABLE_COMMIT {
+  uint32 arity;
+  void *table;
+  void *updates;
+  VALUE_STORE *value_stores[3];
+};
+
+
+// A state file being written by the state_dump_*() functions,
+// or read by the state_load_*() ones. See state-dump.cpp
+struct STATE_FILE {
+  FILE *file;
+  bool failed; // Set by the first write or read that fails
+};
+
 ///////////////////////////////////////////////////////////////
 
 const uint64 MAX_SEQ_LEN = 0xFFFFFFFF;
@@ -457,6 +767,7 @@ bool is_out_of_range(TERN_REL_ITER &it);
 bool has_elem(OBJ set, OBJ elem);
 bool has_key(OBJ rel, OBJ arg1);
 bool has_field(OBJ rec, uint16 field_symb_idx);
+bool has_field(OBJ rec, uint16 field_symb_idx, uint32 &slot_hint); // slot_hint is a per-call-site cache
 bool has_pair(OBJ rel, OBJ arg1, OBJ arg2);
 bool has_triple(OBJ rel, OBJ arg1, OBJ arg2, OBJ arg3);
 
@@ -482,6 +793,7 @@ OBJ rand_set_elem(OBJ set);   // Non-deterministic
 
 OBJ lookup(OBJ rel, OBJ key);
 OBJ lookup_field(OBJ rec, uint16 field_symb_idx);
+OBJ lookup_field(OBJ rec, uint16 field_symb_idx, uint32 &slot_hint); // slot_hint is a per-call-site cache
 
 ////////////////////////////////// instrs.cpp //////////////////////////////////
 
@@ -541,6 +853,8 @@ void get_bin_rel_iter(BIN_REL_ITER &it, OBJ rel);
 void get_bin_rel_iter_0(BIN_REL_ITER &it, OBJ rel, OBJ arg1);
 void get_bin_rel_iter_1(BIN_REL_ITER &it, OBJ rel, OBJ arg2);
 
+void build_map_right_to_left_sorted_idx_array(OBJ map);
+
 /////////////////////////////// tern-rel-obj.cpp ///////////////////////////////
 
 OBJ build_tern_rel(OBJ *col1, OBJ *col2, OBJ *col3, uint32 size);
@@ -550,6 +864,24 @@ void get_tern_rel_iter(TERN_REL_ITER &it, OBJ rel);
 void get_tern_rel_iter_by(TERN_REL_ITER &it, OBJ rel, int col_idx, OBJ arg);
 void get_tern_rel_iter_by(TERN_REL_ITER &it, OBJ rel, int major_col_idx, OBJ major_arg, OBJ minor_arg);
 
+/////////////////////////////// set-algebra.cpp ////////////////////////////////
+
+// The arguments are borrowed, the result is a new reference
+OBJ set_union(OBJ set1, OBJ set2);
+OBJ set_intersection(OBJ set1, OBJ set2);
+OBJ set_difference(OBJ set1, OBJ set2);
+bool is_subset(OBJ set1, OBJ set2);
+
+OBJ bin_rel_union(OBJ rel1, OBJ rel2);
+OBJ bin_rel_intersection(OBJ rel1, OBJ rel2);
+OBJ bin_rel_difference(OBJ rel1, OBJ rel2);
+bool bin_rel_is_subset(OBJ rel1, OBJ rel2);
+
+OBJ tern_rel_union(OBJ rel1, OBJ rel2);
+OBJ tern_rel_intersection(OBJ rel1, OBJ rel2);
+OBJ tern_rel_difference(OBJ rel1, OBJ rel2);
+bool tern_rel_is_subset(OBJ rel1, OBJ rel2);
+
 /////////////////////////////////// debug.cpp //////////////////////////////////
 
 int get_call_stack_depth();
@@ -649,6 +981,7 @@ uint64 get_tick_count();   // Impure
 ////////////////////////////////// hashing.cpp /////////////////////////////////
 
 uint32 compute_hash_code(OBJ obj);
+uint64 compute_hash_code_64(OBJ obj);
 
 //////////////////////////////// value-store.cpp ///////////////////////////////
 
@@ -664,6 +997,13 @@ void value_store_copy(VALUE_STORE *store, VALUE_STORE_UPDATES *updates);
 void value_store_apply(VALUE_STORE *store, VALUE_STORE_UPDATES *updates);
 
 void value_store_add_ref(VALUE_STORE *store, uint32 surr);
+void value_store_add_refs(VALUE_STORE *store, uint32 surr, uint32 count);
+void value_store_release_refs(VALUE_STORE *store, uint32 surr, uint32 count);
+
+// Add or release one reference for each entry in surrs, which can contain
+// duplicates and is sorted in place, so that each value is updated only once
+void value_store_add_ref_batch(VALUE_STORE *store, std::vector<uint32> &surrs);
+void value_store_release_batch(VALUE_STORE *store, std::vector<uint32> &surrs);
 void value_store_release(VALUE_STORE *store, uint32 surr);
 
 OBJ lookup_surrogate(VALUE_STORE *store, int64 surr);
@@ -671,7 +1011,46 @@ int64 lookup_value(VALUE_STORE *store, OBJ value);
 
 int64 lookup_value_ex(VALUE_STORE *store, VALUE_STORE_UPDATES *updates, OBJ value); //## FIND BETTER NAME...
 
+// Batch versions of lookup_value() and lookup_value_ex(). On return surrs[i]
+// is the surrogate of values[i], or -1 if the value is not in the store.
+// Faster than looking the values up one by one, as cache misses overlap
+void lookup_values(VALUE_STORE *store, OBJ *values, uint32 count, int64 *surrs);
+void lookup_values_ex(VALUE_STORE *store, VALUE_STORE_UPDATES *updates, OBJ *values, uint32 count, int64 *surrs);
+
+// Same as lookup_values_ex(), but the values that are not found are inserted
+// (in order, and with an extra reference) into the updates
+void lookup_or_insert_values(VALUE_STORE *store, VALUE_STORE_UPDATES *updates, OBJ *values, uint32 count, uint32 *surrs);
+
 OBJ *value_store_slot_array(VALUE_STORE *store);
+uint32 *value_store_ref_count_array(VALUE_STORE *store);
+
+// Whether any slot in the given chunk of SNAPSHOT_CHUNK_SIZE slots has been
+// modified since the last call to value_store_clear_dirty_chunks(). All chunks
+// are dirty after the store has been initialized, resized, compacted or loaded
+bool value_store_chunk_is_dirty(VALUE_STORE *store, uint32 chunk_idx);
+void value_store_clear_dirty_chunks(VALUE_STORE *store);
+
+// Fills an empty store with the given values and reference counts, placing each
+// value in the slot whose index is its position in the array, so that surrogates
+// are preserved. Blank values leave their slot free. The store takes over the
+// references to the values
+void value_store_load(VALUE_STORE *store, OBJ *values, uint32 *ref_counts, uint32 count);
+
+// Renumbers the values in the store so that their surrogates are contiguous,
+// preserving their relative order, and shrinks the store accordingly. On
+// return surr_map[s] (which must have room for store->capacity entries) is
+// the new surrogate of the value whose surrogate was s, or INVALID_INDEX if
+// the slot was free. Every table that references the store must then be
+// remapped with the corresponding *_table_remap() function. Must not be
+// called while there are pending updates. In dry run mode surr_map is filled
+// in but nothing else is changed. Returns the number of bytes (to be) freed
+uint64 value_store_compact(VALUE_STORE *store, uint32 *surr_map, bool dry_run);
+
+// histogram[i] is set to the number of values that are found after probing
+// i groups of buckets, with the last entry counting all longer probes too.
+// Returns the length of the longest probe sequence
+uint32 value_store_probe_lengths(VALUE_STORE *store, uint32 *histogram, uint32 size);
+void value_store_print_probe_lengths(VALUE_STORE *store);
 
 //////////////////////////////// unary-table.cpp ///////////////////////////////
 
@@ -690,6 +1069,13 @@ void unary_table_clear(UNARY_TABLE *table, UNARY_TABLE_UPDATES *updates);
 
 bool unary_table_updates_check(UNARY_TABLE *table, UNARY_TABLE_UPDATES *updates);
 void unary_table_updates_apply(UNARY_TABLE *table, UNARY_TABLE_UPDATES *updates, VALUE_STORE *vs);
+// unary_table_updates_apply_tuples() is the part of unary_table_updates_apply() that
+// doesn't touch the value store. After it, the collect functions append to surrs
+// the values that were actually inserted or deleted, whose references are to be
+// added or released. That's what unary_table_updates_apply() and _finish() do
+void unary_table_updates_apply_tuples(UNARY_TABLE *table, UNARY_TABLE_UPDATES *updates);
+void unary_table_updates_collect_inserted(UNARY_TABLE_UPDATES *updates, std::vector<uint32> &surrs);
+void unary_table_updates_collect_deleted(UNARY_TABLE_UPDATES *updates, std::vector<uint32> &surrs);
 void unary_table_updates_finish(UNARY_TABLE_UPDATES *updates, VALUE_STORE *vs);
 
 void unary_table_get_iter(UNARY_TABLE *table, UNARY_TABLE_ITER *iter);
@@ -699,10 +1085,32 @@ bool unary_table_iter_is_out_of_range(UNARY_TABLE_ITER *iter);
 
 uint32 unary_table_iter_get_field(UNARY_TABLE_ITER *iter);
 
+// Copies to <buffer> the current value and the following ones, up to <size>
+// values, and moves the iterator past them. Returns the number of values copied
+uint32 unary_table_iter_fill(UNARY_TABLE_ITER *iter, uint32 *buffer, uint32 size);
+
 OBJ copy_unary_table(UNARY_TABLE *table, VALUE_STORE *vs);
 
 void set_unary_table(UNARY_TABLE *table, UNARY_TABLE_UPDATES *updates, VALUE_STORE *vs, VALUE_STORE_UPDATES *vsu, OBJ set);
 
+void unary_table_remap(UNARY_TABLE *table, const uint32 *surr_map);
+
+// An expression needs at least one table in either <all> or <any>. The
+// tables must not be modified while the expression is being evaluated
+uint64 unary_expr_count(UNARY_TABLE_EXPR *expr);
+
+// Evaluates the expression into a newly allocated bitmap,
+// which must be released with unary_bitmap_cleanup()
+void unary_expr_bitmap(UNARY_TABLE_EXPR *expr, UNARY_BITMAP *bitmap);
+void unary_bitmap_cleanup(UNARY_BITMAP *bitmap);
+
+// Iterates through the result of the expression, one chunk at a time
+void unary_expr_get_iter(UNARY_TABLE_EXPR *expr, UNARY_EXPR_ITER *iter);
+bool unary_expr_iter_is_out_of_range(UNARY_EXPR_ITER *iter);
+uint32 unary_expr_iter_get_field(UNARY_EXPR_ITER *iter);
+void unary_expr_iter_next(UNARY_EXPR_ITER *iter);
+uint32 unary_expr_iter_fill(UNARY_EXPR_ITER *iter, uint32 *buffer, uint32 size);
+
 /////////////////////////////// binary-table.cpp ///////////////////////////////
 
 void binary_table_init(BINARY_TABLE *table);
@@ -711,6 +1119,17 @@ void binary_table_cleanup(BINARY_TABLE *table);
 void binary_table_updates_init(BINARY_TABLE_UPDATES *updates);
 void binary_table_updates_cleanup(BINARY_TABLE_UPDATES *updates);
 
+void binary_table_set_backend(BINARY_TABLE *table, TABLE_BACKEND backend);
+void binary_table_set_hash_index(BINARY_TABLE *table, bool enabled);
+void binary_table_set_degree_counts(BINARY_TABLE *table, bool enabled);
+
+uint32 binary_table_size(BINARY_TABLE *table);
+// Number of tuples whose field in the given column is value, number of distinct
+// values in the column, and whether it's a key. They take constant time if the
+// table maintains degree counts, and require a scan of the table otherwise
+uint32 binary_table_degree(BINARY_TABLE *table, uint32 column, uint32 value);
+uint32 binary_table_distinct_count(BINARY_TABLE *table, uint32 column);
+bool binary_table_col_is_key(BINARY_TABLE *table, uint32 column);
 bool binary_table_contains(BINARY_TABLE *table, uint32 left_val, uint32 right_val);
 
 void binary_table_delete(BINARY_TABLE *table, BINARY_TABLE_UPDATES *updates, uint32 left_val, uint32 right_val);
@@ -725,8 +1144,18 @@ bool binary_table_updates_check_1(BINARY_TABLE *table, BINARY_TABLE_UPDATES *upd
 bool binary_table_updates_check_0_1(BINARY_TABLE *table, BINARY_TABLE_UPDATES *updates);
 
 void binary_table_updates_apply(BINARY_TABLE *table, BINARY_TABLE_UPDATES *updates, VALUE_STORE *vs0, VALUE_STORE *vs1);
+// See unary_table_updates_apply_tuples(). The values are collected one column at a time
+void binary_table_updates_apply_tuples(BINARY_TABLE *table, BINARY_TABLE_UPDATES *updates);
+void binary_table_updates_collect_inserted(BINARY_TABLE_UPDATES *updates, uint32 column, std::vector<uint32> &surrs);
+void binary_table_updates_collect_deleted(BINARY_TABLE_UPDATES *updates, uint32 column, std::vector<uint32> &surrs);
 void binary_table_updates_finish(BINARY_TABLE_UPDATES *updates, VALUE_STORE *vs0, VALUE_STORE *vs1);
 
+// Loads the tuples buffered with binary_table_insert() into an empty table,
+// building its storage directly from them instead of applying them one by one.
+// The buffer is consumed, and there must be no pending deletions. No reference
+// is added to the values in the columns whose store is NULL
+void binary_table_bulk_load(BINARY_TABLE *table, BINARY_TABLE_UPDATES *updates, VALUE_STORE *vs0, VALUE_STORE *vs1);
+
 void binary_table_get_iter_by_col_0(BINARY_TABLE *table, BINARY_TABLE_ITER *iter, uint32 value);
 void binary_table_get_iter_by_col_1(BINARY_TABLE *table, BINARY_TABLE_ITER *iter, uint32 value);
 void binary_table_get_iter(BINARY_TABLE *table, BINARY_TABLE_ITER *iter);
@@ -743,6 +1172,12 @@ OBJ copy_binary_table(BINARY_TABLE *table, VALUE_STORE *vs1, VALUE_STORE *vs2, b
 void set_binary_table(BINARY_TABLE *table, BINARY_TABLE_UPDATES *updates, VALUE_STORE *vs1, VALUE_STORE *vs2,
   VALUE_STORE_UPDATES *vsu1, VALUE_STORE_UPDATES *vsu2, OBJ rel, bool flip_cols);
 
+// A null map means the values in that column are left unchanged
+void binary_table_remap(BINARY_TABLE *table, const uint32 *surr_map_0, const uint32 *surr_map_1);
+
+bool sorted_pairs_has_left(SORTED_PAIRS *pairs, uint32 value);
+bool sorted_pairs_has_any_left(SORTED_PAIRS *pairs, const uint32 *values, uint32 count);
+
 /////////////////////////////// ternary-table.cpp ///////////////////////////////
 
 void ternary_table_init(TERNARY_TABLE *table);
@@ -751,6 +1186,15 @@ void ternary_table_cleanup(TERNARY_TABLE *table);
 void ternary_table_updates_init(TERNARY_TABLE_UPDATES *updates);
 void ternary_table_updates_cleanup(TERNARY_TABLE_UPDATES *updates);
 
+void ternary_table_set_backend(TERNARY_TABLE *table, TABLE_BACKEND backend);
+void ternary_table_set_hash_index(TERNARY_TABLE *table, bool enabled);
+void ternary_table_set_degree_counts(TERNARY_TABLE *table, bool enabled);
+
+uint32 ternary_table_size(TERNARY_TABLE *table);
+// See binary_table_degree()
+uint32 ternary_table_degree(TERNARY_TABLE *table, uint32 column, uint32 value);
+uint32 ternary_table_distinct_count(TERNARY_TABLE *table, uint32 column);
+bool ternary_table_col_is_key(TERNARY_TABLE *table, uint32 column);
 bool ternary_table_contains(TERNARY_TABLE *table, uint32 left_val, uint32 middle_val, uint32 right_val);
 
 void ternary_table_delete(TERNARY_TABLE *table, TERNARY_TABLE_UPDATES *updates, uint32 left_val, uint32 middle_val, uint32 right_val);
@@ -770,8 +1214,15 @@ bool ternary_table_updates_check_01_12(TERNARY_TABLE *table, TERNARY_TABLE_UPDAT
 bool ternary_table_updates_check_01_12_20(TERNARY_TABLE *table, TERNARY_TABLE_UPDATES *updates);
 
 void ternary_table_updates_apply(TERNARY_TABLE *table, TERNARY_TABLE_UPDATES *updates, VALUE_STORE *vs0, VALUE_STORE *vs1, VALUE_STORE *vs2);
+// See unary_table_updates_apply_tuples()
+void ternary_table_updates_apply_tuples(TERNARY_TABLE *table, TERNARY_TABLE_UPDATES *updates);
+void ternary_table_updates_collect_inserted(TERNARY_TABLE_UPDATES *updates, uint32 column, std::vector<uint32> &surrs);
+void ternary_table_updates_collect_deleted(TERNARY_TABLE_UPDATES *updates, uint32 column, std::vector<uint32> &surrs);
 void ternary_table_updates_finish(TERNARY_TABLE_UPDATES *updates, VALUE_STORE *vs0, VALUE_STORE *vs1, VALUE_STORE *vs2);
 
+// See binary_table_bulk_load()
+void ternary_table_bulk_load(TERNARY_TABLE *table, TERNARY_TABLE_UPDATES *updates, VALUE_STORE *vs0, VALUE_STORE *vs1, VALUE_STORE *vs2);
+
 void ternary_table_get_iter_by_cols_01(TERNARY_TABLE *table, TERNARY_TABLE_ITER *iter, uint32 value0, uint32 value1);
 void ternary_table_get_iter_by_cols_02(TERNARY_TABLE *table, TERNARY_TABLE_ITER *iter, uint32 value0, uint32 value2);
 void ternary_table_get_iter_by_cols_12(TERNARY_TABLE *table, TERNARY_TABLE_ITER *iter, uint32 value1, uint32 value2);
@@ -796,3 +1247,112 @@ void set_ternary_table(
   VALUE_STORE_UPDATES *vsu1, VALUE_STORE_UPDATES *vsu2, VALUE_STORE_UPDATES *vsu3,
   OBJ rel, int idx1, int idx2, int idx3
 );
+
+// A null map means the values in that column are left unchanged
+void ternary_table_remap(TERNARY_TABLE *table, const uint32 *surr_map_0, const uint32 *surr_map_1, const uint32 *surr_map_2);
+
+bool ternary_table_order_lower_bound(TERNARY_TABLE_ORDER *order, tuple3 lower_bound, tuple3 *first);
+bool ternary_table_order_has_any_key(TERNARY_TABLE_ORDER *order, const uint32 *keys, uint32 count);
+bool ternary_table_order_has_any_key(TERNARY_TABLE_ORDER *order, const uint64 *keys, uint32 count);
+
+///////////////////////////////// snapshot.cpp /////////////////////////////////
+
+// Writer side. A new snapshot has a single reference, which is
+// transferred to the publisher when the snapshot is published
+SNAPSHOT *snapshot_new(uint32 value_stores_count, uint32 unary_tables_count, uint32 binary_tables_count, uint32 ternary_tables_count);
+void snapshot_set_value_store(SNAPSHOT *snapshot, uint32 idx, VALUE_STORE *store);
+void snapshot_set_unary_table(SNAPSHOT *snapshot, uint32 idx, UNARY_TABLE *table);
+void snapshot_set_binary_table(SNAPSHOT *snapshot, uint32 idx, BINARY_TABLE *table);
+void snapshot_set_ternary_table(SNAPSHOT *snapshot, uint32 idx, TERNARY_TABLE *table);
+
+// Same as the above, but the new snapshot shares with prev, which is normally the
+// one returned by snapshot_current(), all the chunks that have not changed since.
+// The table versions are derived from prev and the updates that were applied to
+// the tables after it was taken, and must be called after *_updates_apply() and
+// before *_updates_finish(). The value store ones after value_store_apply() and
+// the *_updates_finish() of all the tables that use the store, and prev must be
+// the last snapshot taken of the store, since the store only keeps track of the
+// chunks of slots that have been modified since then
+void snapshot_derive_value_store(SNAPSHOT *snapshot, uint32 idx, SNAPSHOT *prev, VALUE_STORE *store);
+void snapshot_derive_unary_table(SNAPSHOT *snapshot, uint32 idx, SNAPSHOT *prev, UNARY_TABLE_UPDATES *updates);
+void snapshot_derive_binary_table(SNAPSHOT *snapshot, uint32 idx, SNAPSHOT *prev, BINARY_TABLE_UPDATES *updates);
+void snapshot_derive_ternary_table(SNAPSHOT *snapshot, uint32 idx, SNAPSHOT *prev, TERNARY_TABLE_UPDATES *updates);
+
+void snapshot_publisher_init(SNAPSHOT_PUBLISHER *publisher);
+void snapshot_publisher_cleanup(SNAPSHOT_PUBLISHER *publisher);
+
+void snapshot_publish(SNAPSHOT_PUBLISHER *publisher, SNAPSHOT *snapshot);
+// The last published snapshot, which stays valid until the writer replaces it
+SNAPSHOT *snapshot_current(SNAPSHOT_PUBLISHER *publisher);
+// Frees the retired snapshots that have no readers left, and
+// returns the number of those that are still in use
+uint32 snapshot_reclaim(SNAPSHOT_PUBLISHER *publisher);
+
+// Reader side. snapshot_acquire() returns NULL if nothing has been published yet
+SNAPSHOT *snapshot_acquire(SNAPSHOT_PUBLISHER *publisher);
+void snapshot_release(SNAPSHOT *snapshot);
+
+// The returned object is owned by the snapshot, and its reference count must not be touched
+OBJ snapshot_lookup_surrogate(SNAPSHOT *snapshot, uint32 store_idx, uint32 surr);
+
+bool snapshot_unary_table_contains(SNAPSHOT *snapshot, uint32 table_idx, uint32 value);
+bool snapshot_binary_table_contains(SNAPSHOT *snapshot, uint32 table_idx, uint32 left_val, uint32 right_val);
+bool snapshot_ternary_table_contains(SNAPSHOT *snapshot, uint32 table_idx, uint32 left_val, uint32 middle_val, uint32 right_val);
+
+void snapshot_unary_table_get_iter(SNAPSHOT *snapshot, uint32 table_idx, UNARY_TABLE_SNAPSHOT_ITER *iter);
+bool snapshot_unary_table_iter_is_out_of_range(UNARY_TABLE_SNAPSHOT_ITER *iter);
+uint32 snapshot_unary_table_iter_get_field(UNARY_TABLE_SNAPSHOT_ITER *iter);
+void snapshot_unary_table_iter_next(UNARY_TABLE_SNAPSHOT_ITER *iter);
+
+void snapshot_binary_table_get_iter_by_col_0(SNAPSHOT *snapshot, uint32 table_idx, BINARY_TABLE_SNAPSHOT_ITER *iter, uint32 value);
+void snapshot_binary_table_get_iter_by_col_1(SNAPSHOT *snapshot, uint32 table_idx, BINARY_TABLE_SNAPSHOT_ITER *iter, uint32 value);
+void snapshot_binary_table_get_iter(SNAPSHOT *snapshot, uint32 table_idx, BINARY_TABLE_SNAPSHOT_ITER *iter);
+bool snapshot_binary_table_iter_is_out_of_range(BINARY_TABLE_SNAPSHOT_ITER *iter);
+uint32 snapshot_binary_table_iter_get_left_field(BINARY_TABLE_SNAPSHOT_ITER *iter);
+uint32 snapshot_binary_table_iter_get_right_field(BINARY_TABLE_SNAPSHOT_ITER *iter);
+void snapshot_binary_table_iter_next(BINARY_TABLE_SNAPSHOT_ITER *iter);
+
+void snapshot_ternary_table_get_iter_by_cols_01(SNAPSHOT *snapshot, uint32 table_idx, TERNARY_TABLE_SNAPSHOT_ITER *iter, uint32 value0, uint32 value1);
+void snapshot_ternary_table_get_iter_by_cols_02(SNAPSHOT *snapshot, uint32 table_idx, TERNARY_TABLE_SNAPSHOT_ITER *iter, uint32 value0, uint32 value2);
+void snapshot_ternary_table_get_iter_by_cols_12(SNAPSHOT *snapshot, uint32 table_idx, TERNARY_TABLE_SNAPSHOT_ITER *iter, uint32 value1, uint32 value2);
+void snapshot_ternary_table_get_iter_by_col_0(SNAPSHOT *snapshot, uint32 table_idx, TERNARY_TABLE_SNAPSHOT_ITER *iter, uint32 value);
+void snapshot_ternary_table_get_iter_by_col_1(SNAPSHOT *snapshot, uint32 table_idx, TERNARY_TABLE_SNAPSHOT_ITER *iter, uint32 value);
+void snapshot_ternary_table_get_iter_by_col_2(SNAPSHOT *snapshot, uint32 table_idx, TERNARY_TABLE_SNAPSHOT_ITER *iter, uint32 value);
+void snapshot_ternary_table_get_iter(SNAPSHOT *snapshot, uint32 table_idx, TERNARY_TABLE_SNAPSHOT_ITER *iter);
+bool snapshot_ternary_table_iter_is_out_of_range(TERNARY_TABLE_SNAPSHOT_ITER *iter);
+uint32 snapshot_ternary_table_iter_get_left_field(TERNARY_TABLE_SNAPSHOT_ITER *iter);
+uint32 snapshot_ternary_table_iter_get_middle_field(TERNARY_TABLE_SNAPSHOT_ITER *iter);
+uint32 snapshot_ternary_table_iter_get_right_field(TERNARY_TABLE_SNAPSHOT_ITER *iter);
+void snapshot_ternary_table_iter_next(TERNARY_TABLE_SNAPSHOT_ITER *iter);
+
+////////////////////////////////// commit.cpp //////////////////////////////////
+
+// Same as calling the *_table_updates_apply() function of each table, but the
+// tables are updated concurrently. Must be called after value_store_apply()
+void commit_tables_apply(TABLE_COMMIT *tables, uint32 count);
+// Same as calling the *_table_updates_finish() function of each table
+void commit_tables_finish(TABLE_COMMIT *tables, uint32 count);
+
+/////////////////////////////// state-dump.cpp /////////////////////////////////
+
+// The value stores and tables are written to the file one after the other,
+// and have to be loaded back in the same order. Stores must be dumped only
+// when none of their values has a pending release, and loaded into empty
+// ones, whose reference counts are restored as they were. Tables must be
+// empty as well, and are loaded without adding references to their values.
+// state_dump_close() returns false if any of the writes failed, and the
+// loading functions fail if the file is truncated or corrupted, or if the
+// next section is not of the expected kind
+bool state_dump_open(STATE_FILE *file, const char *path);
+void state_dump_value_store(STATE_FILE *file, VALUE_STORE *store);
+void state_dump_unary_table(STATE_FILE *file, UNARY_TABLE *table);
+void state_dump_binary_table(STATE_FILE *file, BINARY_TABLE *table);
+void state_dump_ternary_table(STATE_FILE *file, TERNARY_TABLE *table);
+bool state_dump_close(STATE_FILE *file);
+
+bool state_load_open(STATE_FILE *file, const char *path);
+bool state_load_value_store(STATE_FILE *file, VALUE_STORE *store);
+bool state_load_unary_table(STATE_FILE *file, UNARY_TABLE *table);
+bool state_load_binary_table(STATE_FILE *file, BINARY_TABLE *table);
+bool state_load_ternary_table(STATE_FILE *file, TERNARY_TABLE *table);
+void state_load_close(STATE_FILE *file);
@@ -0,0 +1,398 @@
+#include "lib.h"
+
+
+// Sets, binary relations and ternary relations are all stored as sorted,
+// duplicate-free arrays of tuples, so union, intersection and difference
+// can be computed with a linear merge, and the result can be built directly
+// in its final form, without going through a STREAM and re-sorting it.
+// The secondary (rotated) indexes of the result are obtained by merging
+// those of the operands, instead of being re-sorted too.
+
+struct REL_VIEW {
+  OBJ    *cols[3];
+  uint32 *idxs[3];  // Secondary indexes. idxs[0] is never used
+  uint32  arity;
+  uint32  size;
+};
+
+enum MERGE_OP {OP_UNION, OP_INTERSECTION, OP_DIFFERENCE};
+
+static const int bin_rel_orders[2][3]   = {{0, 1, -1}, {1, 0, -1}};
+static const int tern_rel_orders[3][3]  = {{0, 1, 2}, {1, 2, 0}, {2, 0, 1}};
+
+// Galloping is used when one side is at least this many times larger than the other
+const uint32 GALLOP_RATIO = 16;
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void set_view(REL_VIEW &view, OBJ set) {
+  SET_OBJ *ptr = get_set_ptr(set);
+  view.cols[0] = ptr->buffer;
+  view.arity = 1;
+  view.size = ptr->size;
+}
+
+static void bin_rel_view(REL_VIEW &view, OBJ rel) {
+  if (get_physical_type(rel) == TYPE_MAP)
+    build_map_right_to_left_sorted_idx_array(rel);
+
+  BIN_REL_OBJ *ptr = get_bin_rel_ptr(rel);
+  view.cols[0] = get_left_col_array_ptr(ptr);
+  view.cols[1] = get_right_col_array_ptr(ptr);
+  view.idxs[1] = get_right_to_left_indexes(ptr);
+  view.arity = 2;
+  view.size = ptr->size;
+}
+
+static void tern_rel_view(REL_VIEW &view, OBJ rel) {
+  TERN_REL_OBJ *ptr = get_tern_rel_ptr(rel);
+  for (int i=0 ; i < 3 ; i++)
+    view.cols[i] = get_col_array_ptr(ptr, i);
+  view.idxs[1] = get_rotated_index(ptr, 1);
+  view.idxs[2] = get_rotated_index(ptr, 2);
+  view.arity = 3;
+  view.size = ptr->size;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Same convention as comp_objs(): > 0 if the first row comes before the second one
+static int comp_rows(REL_VIEW &view1, uint32 row1, REL_VIEW &view2, uint32 row2, const int *order) {
+  uint32 arity = view1.arity;
+  for (uint32 i=0 ; i < arity ; i++) {
+    int col = order[i];
+    int cr = comp_objs(view1.cols[col][row1], view2.cols[col][row2]);
+    if (cr != 0)
+      return cr;
+  }
+  return 0;
+}
+
+// Returns the index of the first row of <view> in the range [from, view.size)
+// that does not come before row <target_row> of <target>
+static uint32 gallop(REL_VIEW &view, uint32 from, REL_VIEW &target, uint32 target_row, const int *order) {
+  uint32 size = view.size;
+  uint32 low = from;
+  uint32 step = 1;
+  while (low + step < size && comp_rows(view, low + step, target, target_row, order) > 0) {
+    low += step;
+    step *= 2;
+  }
+  if (low >= size || comp_rows(view, low, target, target_row, order) <= 0)
+    return low;
+  // Here row <low> comes before the target, and row <low+step> (if it exists) doesn't
+  uint32 high = low + step < size ? low + step : size;
+  low++;
+  while (low < high) {
+    uint32 mid = low + (high - low) / 2;
+    if (comp_rows(view, mid, target, target_row, order) > 0)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  return low;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Stores in a_dest (and b_dest, for unions) the index each row will have in
+// the result, or INVALID_INDEX if the row is not part of it. Rows of <b> that
+// also belong to <a> are always excluded. Returns the size of the result
+static uint32 merge_rows(REL_VIEW &a, REL_VIEW &b, MERGE_OP op, uint32 *a_dest, uint32 *b_dest) {
+  const int *order = tern_rel_orders[0];
+  uint32 a_size = a.size;
+  uint32 b_size = b.size;
+  bool use_gallop = op != OP_UNION && (a_size > GALLOP_RATIO * b_size || b_size > GALLOP_RATIO * a_size);
+
+  uint32 i = 0;
+  uint32 j = 0;
+  uint32 count = 0;
+
+  while (i < a_size & j < b_size) {
+    int cr = comp_rows(a, i, b, j, order);
+    if (cr == 0) {
+      a_dest[i++] = op == OP_DIFFERENCE ? INVALID_INDEX : count++;
+      if (op == OP_UNION)
+        b_dest[j] = INVALID_INDEX;
+      j++;
+    }
+    else if (cr > 0) {
+      uint32 next_i = use_gallop ? gallop(a, i+1, b, j, order) : i + 1;
+      for ( ; i < next_i ; i++)
+        a_dest[i] = op == OP_INTERSECTION ? INVALID_INDEX : count++;
+    }
+    else if (op == OP_UNION)
+      b_dest[j++] = count++;
+    else
+      j = use_gallop ? gallop(b, j+1, a, i, order) : j + 1;
+  }
+
+  for ( ; i < a_size ; i++)
+    a_dest[i] = op == OP_INTERSECTION ? INVALID_INDEX : count++;
+
+  if (op == OP_UNION)
+    for ( ; j < b_size ; j++)
+      b_dest[j] = count++;
+
+  return count;
+}
+
+// Merges the secondary indexes of the two operands, skipping the rows that
+// are not part of the result. Duplicates have already been excluded by merge_rows()
+static void merge_index(REL_VIEW &a, uint32 *a_dest, REL_VIEW &b, uint32 *b_dest, int idx_num, const int *order, uint32 *dest_idx) {
+  uint32 *a_idx = a.idxs[idx_num];
+  uint32 *b_idx = b_dest != NULL ? b.idxs[idx_num] : NULL;
+  uint32 a_size = a.size;
+  uint32 b_size = b_dest != NULL ? b.size : 0;
+
+  uint32 i = 0;
+  uint32 j = 0;
+  uint32 k = 0;
+  for ( ; ; ) {
+    while (i < a_size && a_dest[a_idx[i]] == INVALID_INDEX)
+      i++;
+    while (j < b_size && b_dest[b_idx[j]] == INVALID_INDEX)
+      j++;
+
+    if (i < a_size) {
+      if (j < b_size && comp_rows(a, a_idx[i], b, b_idx[j], order) < 0)
+        dest_idx[k++] = b_dest[b_idx[j++]];
+      else
+        dest_idx[k++] = a_dest[a_idx[i++]];
+    }
+    else if (j < b_size)
+      dest_idx[k++] = b_dest[b_idx[j++]];
+    else
+      break;
+  }
+}
+
+static void copy_rows(REL_VIEW &view, uint32 *dest, OBJ **dest_cols) {
+  uint32 arity = view.arity;
+  uint32 size = view.size;
+  for (uint32 i=0 ; i < size ; i++) {
+    uint32 dest_row = dest[i];
+    if (dest_row != INVALID_INDEX)
+      for (uint32 j=0 ; j < arity ; j++) {
+        OBJ obj = view.cols[j][i];
+        add_ref(obj);
+        dest_cols[j][dest_row] = obj;
+      }
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static OBJ build_merged(OBJ obj1, OBJ obj2, REL_VIEW &a, REL_VIEW &b, MERGE_OP op) {
+  uint32 a_size = a.size;
+  uint32 b_size = b.size;
+
+  uint32 *a_dest = new_uint32_array(a_size);
+  uint32 *b_dest = op == OP_UNION ? new_uint32_array(b_size) : NULL;
+
+  uint32 count = merge_rows(a, b, op, a_dest, b_dest);
+
+  OBJ res;
+
+  if (count == 0) {
+    res = make_empty_rel();
+  }
+  else if (count == a_size && op != OP_UNION) {
+    // The result is the first operand
+    add_ref(obj1);
+    res = obj1;
+  }
+  else if (op == OP_UNION && (count == a_size || count == b_size)) {
+    // One of the operands contains the other
+    res = count == a_size ? obj1 : obj2;
+    add_ref(res);
+  }
+  else {
+    OBJ *dest_cols[3];
+
+    if (a.arity == 1) {
+      SET_OBJ *set = new_set(count);
+      dest_cols[0] = set->buffer;
+      copy_rows(a, a_dest, dest_cols);
+      if (b_dest != NULL)
+        copy_rows(b, b_dest, dest_cols);
+      res = make_set(set);
+    }
+    else if (a.arity == 2) {
+      BIN_REL_OBJ *rel = new_bin_rel(count);
+      dest_cols[0] = get_left_col_array_ptr(rel);
+      dest_cols[1] = get_right_col_array_ptr(rel);
+      copy_rows(a, a_dest, dest_cols);
+      if (b_dest != NULL)
+        copy_rows(b, b_dest, dest_cols);
+      merge_index(a, a_dest, b, b_dest, 1, bin_rel_orders[1], get_right_to_left_indexes(rel));
+
+      OBJ *left_col = dest_cols[0];
+      bool left_col_is_unique = true;
+      for (uint32 i=1 ; i < count && left_col_is_unique ; i++)
+        left_col_is_unique = comp_objs(left_col[i-1], left_col[i]) != 0;
+      res = left_col_is_unique ? make_log_map(rel) : make_bin_rel(rel);
+    }
+    else {
+      TERN_REL_OBJ *rel = new_tern_rel(count);
+      for (int i=0 ; i < 3 ; i++)
+        dest_cols[i] = get_col_array_ptr(rel, i);
+      copy_rows(a, a_dest, dest_cols);
+      if (b_dest != NULL)
+        copy_rows(b, b_dest, dest_cols);
+      merge_index(a, a_dest, b, b_dest, 1, tern_rel_orders[1], get_rotated_index(rel, 1));
+      merge_index(a, a_dest, b, b_dest, 2, tern_rel_orders[2], get_rotated_index(rel, 2));
+      res = make_tern_rel(rel);
+    }
+  }
+
+  delete_uint32_array(a_dest, a_size);
+  if (b_dest != NULL)
+    delete_uint32_array(b_dest, b_size);
+
+  return res;
+}
+
+static bool rows_are_subset(REL_VIEW &a, REL_VIEW &b) {
+  const int *order = tern_rel_orders[0];
+  uint32 a_size = a.size;
+  uint32 b_size = b.size;
+
+  if (a_size > b_size)
+    return false;
+
+  bool use_gallop = b_size > GALLOP_RATIO * a_size;
+
+  uint32 j = 0;
+  for (uint32 i=0 ; i < a_size ; i++) {
+    if (use_gallop)
+      j = gallop(b, j, a, i, order);
+    else
+      while (j < b_size && comp_rows(b, j, a, i, order) > 0)
+        j++;
+    if (j == b_size || comp_rows(b, j, a, i, order) != 0)
+      return false;
+    j++;
+  }
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static OBJ merge_union(OBJ obj1, OBJ obj2, void (*make_view)(REL_VIEW &, OBJ)) {
+  if (is_empty_rel(obj1) | is_empty_rel(obj2)) {
+    OBJ res = is_empty_rel(obj1) ? obj2 : obj1;
+    add_ref(res);
+    return res;
+  }
+
+  REL_VIEW a, b;
+  make_view(a, obj1);
+  make_view(b, obj2);
+  return build_merged(obj1, obj2, a, b, OP_UNION);
+}
+
+static OBJ merge_intersection(OBJ obj1, OBJ obj2, void (*make_view)(REL_VIEW &, OBJ)) {
+  if (is_empty_rel(obj1) | is_empty_rel(obj2))
+    return make_empty_rel();
+
+  REL_VIEW a, b;
+  make_view(a, obj1);
+  make_view(b, obj2);
+  // The intersection is commutative, and the destination array
+  // is only needed for the first operand, so we pick the smaller one
+  if (a.size > b.size)
+    return build_merged(obj2, obj1, b, a, OP_INTERSECTION);
+  else
+    return build_merged(obj1, obj2, a, b, OP_INTERSECTION);
+}
+
+static OBJ merge_difference(OBJ obj1, OBJ obj2, void (*make_view)(REL_VIEW &, OBJ)) {
+  if (is_empty_rel(obj1) | is_empty_rel(obj2)) {
+    add_ref(obj1);
+    return obj1;
+  }
+
+  REL_VIEW a, b;
+  make_view(a, obj1);
+  make_view(b, obj2);
+  return build_merged(obj1, obj2, a, b, OP_DIFFERENCE);
+}
+
+static bool merge_is_subset(OBJ obj1, OBJ obj2, void (*make_view)(REL_VIEW &, OBJ)) {
+  if (is_empty_rel(obj1))
+    return true;
+  if (is_empty_rel(obj2))
+    return false;
+
+  REL_VIEW a, b;
+  make_view(a, obj1);
+  make_view(b, obj2);
+  return rows_are_subset(a, b);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+OBJ set_union(OBJ set1, OBJ set2) {
+  assert(is_set(set1) & is_set(set2));
+  return merge_union(set1, set2, set_view);
+}
+
+OBJ set_intersection(OBJ set1, OBJ set2) {
+  assert(is_set(set1) & is_set(set2));
+  return merge_intersection(set1, set2, set_view);
+}
+
+OBJ set_difference(OBJ set1, OBJ set2) {
+  assert(is_set(set1) & is_set(set2));
+  return merge_difference(set1, set2, set_view);
+}
+
+bool is_subset(OBJ set1, OBJ set2) {
+  assert(is_set(set1) & is_set(set2));
+  return merge_is_subset(set1, set2, set_view);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+OBJ bin_rel_union(OBJ rel1, OBJ rel2) {
+  assert(is_bin_rel(rel1) & is_bin_rel(rel2));
+  return merge_union(rel1, rel2, bin_rel_view);
+}
+
+OBJ bin_rel_intersection(OBJ rel1, OBJ rel2) {
+  assert(is_bin_rel(rel1) & is_bin_rel(rel2));
+  return merge_intersection(rel1, rel2, bin_rel_view);
+}
+
+OBJ bin_rel_difference(OBJ rel1, OBJ rel2) {
+  assert(is_bin_rel(rel1) & is_bin_rel(rel2));
+  return merge_difference(rel1, rel2, bin_rel_view);
+}
+
+bool bin_rel_is_subset(OBJ rel1, OBJ rel2) {
+  assert(is_bin_rel(rel1) & is_bin_rel(rel2));
+  return merge_is_subset(rel1, rel2, bin_rel_view);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+OBJ tern_rel_union(OBJ rel1, OBJ rel2) {
+  assert(is_tern_rel(rel1) & is_tern_rel(rel2));
+  return merge_union(rel1, rel2, tern_rel_view);
+}
+
+OBJ tern_rel_intersection(OBJ rel1, OBJ rel2) {
+  assert(is_tern_rel(rel1) & is_tern_rel(rel2));
+  return merge_intersection(rel1, rel2, tern_rel_view);
+}
+
+OBJ tern_rel_difference(OBJ rel1, OBJ rel2) {
+  assert(is_tern_rel(rel1) & is_tern_rel(rel2));
+  return merge_difference(rel1, rel2, tern_rel_view);
+}
+
+bool tern_rel_is_subset(OBJ rel1, OBJ rel2) {
+  assert(is_tern_rel(rel1) & is_tern_rel(rel2));
+  return merge_is_subset(rel1, rel2, tern_rel_view);
+}
@@ -0,0 +1,693 @@
+#include "lib.h"
+#include "table-utils.h"
+
+
+// A snapshot is an immutable copy of a group of value stores and tables,
+// built by the thread that owns them (the writer) and then published, so
+// that any number of reader threads can resolve surrogates and query the
+// tables without any locking, while the writer keeps updating the originals.
+//
+// Each snapshot is reference counted: the publisher holds a reference to
+// the current one, and each reader holds one between snapshot_acquire() and
+// snapshot_release(). Only the writer ever frees a snapshot, since that
+// involves releasing the objects it references, which is not thread-safe:
+// snapshots that have been replaced are moved to a list of retired ones,
+// and they are freed by the writer (in snapshot_publish() or explicitly
+// with snapshot_reclaim()) once their last reader has released them.
+//
+// A reader could load the pointer to the current snapshot just before the
+// writer replaces it, and only increment its reference count after the
+// writer has found it to be zero. To rule that out, readers also increment
+// a counter of acquisitions in progress, and the writer only frees retired
+// snapshots when that counter is zero. A snapshot cannot be acquired once
+// it has been retired, so that's enough to make the reference counts of
+// all retired snapshots final when they are observed by the writer.
+//
+// The contents of a snapshot are split into chunks of up to SNAPSHOT_CHUNK_SIZE
+// entries, which are reference counted themselves, so that a new snapshot can
+// be derived from the previous one by copying only the chunks that have been
+// affected by the latest updates and sharing all the others. That makes the
+// cost of a snapshot proportional to the size of the changes rather than of
+// the tables (but for the array of chunk pointers). Chunks are created and
+// freed only by the writer, so their reference counts need not be atomic.
+//
+// Binary and ternary tables are stored in every column order the live tables
+// can be searched by, so that readers can scan or seek them the same way, and
+// each order is derived from the previous version independently. That makes
+// their versions two and three times as expensive to build and keep around.
+//
+// Objects returned by snapshot_lookup_surrogate() are owned by the snapshot:
+// readers must neither add nor release references to them, and they must
+// not use them after the snapshot has been released.
+
+////////////////////////////////////////////////////////////////////////////////
+
+const uint32 SNAPSHOT_MIN_CHUNK_SIZE = 256;  // For chunks created by an update
+
+template <typename T> T *chunk_data(SNAPSHOT_CHUNK *chunk) {
+  return (T *) (chunk + 1);
+}
+
+template <typename T> SNAPSHOT_CHUNK *new_chunk(const T *data, uint32 count) {
+  SNAPSHOT_CHUNK *chunk = (SNAPSHOT_CHUNK *) new_obj(sizeof(SNAPSHOT_CHUNK) + count * sizeof(T));
+  chunk->ref_count = 1;
+  chunk->count = count;
+  memcpy(chunk_data<T>(chunk), data, count * sizeof(T));
+  return chunk;
+}
+
+template <typename T> void release_chunk(SNAPSHOT_CHUNK *chunk) {
+  assert(chunk->ref_count > 0);
+  if (--chunk->ref_count == 0)
+    free_obj(chunk, sizeof(SNAPSHOT_CHUNK) + chunk->count * sizeof(T));
+}
+
+static SNAPSHOT_CHUNK **new_chunk_array(const std::vector<SNAPSHOT_CHUNK *> &chunks, uint32 &count) {
+  count = chunks.size();
+  if (count == 0)
+    return NULL;
+  SNAPSHOT_CHUNK **array = new SNAPSHOT_CHUNK *[count];
+  memcpy(array, chunks.data(), count * sizeof(SNAPSHOT_CHUNK *));
+  return array;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Chunks of slots are shared with the previous snapshot unless the store has
+// marked them as dirty, which it does whenever a value is inserted or released.
+// That requires the previous snapshot to be the last one taken of the store
+
+static SNAPSHOT_CHUNK *new_slots_chunk(const OBJ *slots, uint32 count) {
+  for (uint32 i=0 ; i < count ; i++)
+    if (!is_blank_obj(slots[i]))
+      add_ref(slots[i]);
+  return new_chunk(slots, count);
+}
+
+static void release_slots_chunk(SNAPSHOT_CHUNK *chunk) {
+  if (chunk->ref_count == 1) {
+    OBJ *slots = chunk_data<OBJ>(chunk);
+    for (uint32 i=0 ; i < chunk->count ; i++)
+      if (!is_blank_obj(slots[i]))
+        release(slots[i]);
+  }
+  release_chunk<OBJ>(chunk);
+}
+
+static void copy_value_store(VALUE_STORE_SNAPSHOT *snapshot, VALUE_STORE *store, VALUE_STORE_SNAPSHOT *prev) {
+  uint32 capacity = store->capacity;
+  OBJ *slots = value_store_slot_array(store);
+
+  std::vector<SNAPSHOT_CHUNK *> chunks;
+  for (uint32 offset=0 ; offset < capacity ; offset += SNAPSHOT_CHUNK_SIZE) {
+    uint32 count = std::min(capacity - offset, SNAPSHOT_CHUNK_SIZE);
+    uint32 idx = chunks.size();
+    SNAPSHOT_CHUNK *chunk = prev != NULL && idx < prev->chunks_count ? prev->chunks[idx] : NULL;
+    if (chunk != NULL && chunk->count == count && !value_store_chunk_is_dirty(store, idx))
+      chunk->ref_count++;
+    else
+      chunk = new_slots_chunk(slots + offset, count);
+    chunks.push_back(chunk);
+  }
+
+  snapshot->chunks = new_chunk_array(chunks, snapshot->chunks_count);
+  snapshot->capacity = capacity;
+  value_store_clear_dirty_chunks(store);
+}
+
+static void free_value_store(VALUE_STORE_SNAPSHOT *snapshot) {
+  for (uint32 i=0 ; i < snapshot->chunks_count ; i++)
+    release_slots_chunk(snapshot->chunks[i]);
+  delete [] snapshot->chunks;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// The chunks of all table snapshots are sorted sequences of tuples, which
+// are built from the chunks of the previous version (if any) and the sorted
+// lists of the tuples that were deleted and inserted since. Every chunk of
+// the previous version covers the range that goes from its first tuple to
+// the first one of the next chunk, and it's shared if no update falls in it.
+// The others are merged with their updates, and consecutive modified chunks
+// are collected in a buffer which is then split into chunks of similar size.
+// Small leftovers are merged with the following chunk, even if it has not
+// changed, so that repeated updates don't fragment the table
+
+template <typename T> void flush_pending(std::vector<T> &pending, std::vector<SNAPSHOT_CHUNK *> &chunks) {
+  uint32 count = pending.size();
+  uint32 chunks_count = (count + SNAPSHOT_CHUNK_SIZE - 1) / SNAPSHOT_CHUNK_SIZE;
+  for (uint32 i=0 ; i < chunks_count ; i++) {
+    uint32 start = i * (uint64) count / chunks_count;
+    uint32 end = (i + 1) * (uint64) count / chunks_count;
+    chunks.push_back(new_chunk(pending.data() + start, end - start));
+  }
+  pending.clear();
+}
+
+template <typename T>
+void build_order(SNAPSHOT_CHUNK **prev_chunks, uint32 prev_chunks_count, const std::vector<T> &deletes, const std::vector<T> &inserts, SNAPSHOT_CHUNK **&new_chunks, uint32 &new_chunks_count) {
+  std::vector<SNAPSHOT_CHUNK *> chunks;
+  std::vector<T> pending, remaining;
+
+  typename std::vector<T>::const_iterator deletes_it = deletes.begin();
+  typename std::vector<T>::const_iterator inserts_it = inserts.begin();
+
+  for (uint32 i=0 ; i < prev_chunks_count ; i++) {
+    SNAPSHOT_CHUNK *chunk = prev_chunks[i];
+    T *data = chunk_data<T>(chunk);
+
+    typename std::vector<T>::const_iterator deletes_end = deletes.end();
+    typename std::vector<T>::const_iterator inserts_end = inserts.end();
+    if (i + 1 < prev_chunks_count) {
+      const T &next_first = chunk_data<T>(prev_chunks[i + 1])[0];
+      deletes_end = std::lower_bound(deletes_it, deletes.end(), next_first);
+      inserts_end = std::lower_bound(inserts_it, inserts.end(), next_first);
+    }
+
+    if (deletes_it == deletes_end && inserts_it == inserts_end && (pending.empty() || pending.size() >= SNAPSHOT_MIN_CHUNK_SIZE)) {
+      flush_pending(pending, chunks);
+      chunk->ref_count++;
+      chunks.push_back(chunk);
+    }
+    else {
+      remaining.clear();
+      std::set_difference(data, data + chunk->count, deletes_it, deletes_end, std::back_inserter(remaining));
+      std::set_union(remaining.begin(), remaining.end(), inserts_it, inserts_end, std::back_inserter(pending));
+    }
+
+    deletes_it = deletes_end;
+    inserts_it = inserts_end;
+  }
+
+  assert(deletes_it == deletes.end());
+  pending.insert(pending.end(), inserts_it, inserts.end());
+  flush_pending(pending, chunks);
+
+  new_chunks = new_chunk_array(chunks, new_chunks_count);
+}
+
+template <typename T> void free_order(SNAPSHOT_CHUNK **chunks, uint32 chunks_count) {
+  for (uint32 i=0 ; i < chunks_count ; i++)
+    release_chunk<T>(chunks[i]);
+  delete [] chunks;
+}
+
+// Finds the first tuple that is not lower than the given one. Chunks are never
+// empty, so if there's no such tuple chunk_idx is set to chunks_count
+template <typename T>
+void order_lower_bound(SNAPSHOT_CHUNK **chunks, uint32 chunks_count, const T &tuple, uint32 &chunk_idx, uint32 &idx) {
+  // Looking for the last chunk whose first tuple is not greater than the searched one
+  uint32 low = 0;
+  uint32 high = chunks_count;
+  while (low < high) {
+    uint32 mid = (low + high) / 2;
+    if (tuple < chunk_data<T>(chunks[mid])[0])
+      high = mid;
+    else
+      low = mid + 1;
+  }
+  chunk_idx = 0;
+  idx = 0;
+  if (low == 0)
+    return;
+  SNAPSHOT_CHUNK *chunk = chunks[low - 1];
+  T *data = chunk_data<T>(chunk);
+  idx = std::lower_bound(data, data + chunk->count, tuple) - data;
+  chunk_idx = low - 1;
+  if (idx == chunk->count) {
+    chunk_idx = low;
+    idx = 0;
+  }
+}
+
+template <typename T> bool order_contains(SNAPSHOT_CHUNK **chunks, uint32 chunks_count, const T &tuple) {
+  uint32 chunk_idx, idx;
+  order_lower_bound(chunks, chunks_count, tuple, chunk_idx, idx);
+  return chunk_idx < chunks_count && chunk_data<T>(chunks[chunk_idx])[idx] == tuple;
+}
+
+// Moves the tuples to the next column order, and sorts them again
+static void next_order(std::vector<uint64> &tuples) {
+  for (uint32 i=0 ; i < tuples.size() ; i++)
+    tuples[i] = swap(tuples[i]);
+  parallel_sort(tuples.data(), tuples.data() + tuples.size(), std::less<uint64>());
+}
+
+static void next_order(std::vector<tuple3> &tuples) {
+  for (uint32 i=0 ; i < tuples.size() ; i++)
+    shift(tuples[i]);
+  parallel_sort(tuples.data(), tuples.data() + tuples.size(), std::less<tuple3>());
+}
+
+static void build_version(UNARY_TABLE_SNAPSHOT *snapshot, UNARY_TABLE_SNAPSHOT *prev, const std::vector<uint32> &deletes, const std::vector<uint32> &inserts) {
+  SNAPSHOT_CHUNK **prev_chunks = prev != NULL ? prev->chunks : NULL;
+  uint32 prev_chunks_count = prev != NULL ? prev->chunks_count : 0;
+  build_order(prev_chunks, prev_chunks_count, deletes, inserts, snapshot->chunks, snapshot->chunks_count);
+  snapshot->count = (prev != NULL ? prev->count : 0) - deletes.size() + inserts.size();
+}
+
+// The updates of binary and ternary tables must be sorted in the order of
+// chunks[0], and they are moved to each of the other orders in turn
+static void build_version(BINARY_TABLE_SNAPSHOT *snapshot, BINARY_TABLE_SNAPSHOT *prev, std::vector<uint64> &deletes, std::vector<uint64> &inserts) {
+  for (uint32 i=0 ; i < 2 ; i++) {
+    if (i > 0) {
+      next_order(deletes);
+      next_order(inserts);
+    }
+    SNAPSHOT_CHUNK **prev_chunks = prev != NULL ? prev->chunks[i] : NULL;
+    uint32 prev_chunks_count = prev != NULL ? prev->chunks_count[i] : 0;
+    build_order(prev_chunks, prev_chunks_count, deletes, inserts, snapshot->chunks[i], snapshot->chunks_count[i]);
+  }
+  snapshot->count = (prev != NULL ? prev->count : 0) - deletes.size() + inserts.size();
+}
+
+static void build_version(TERNARY_TABLE_SNAPSHOT *snapshot, TERNARY_TABLE_SNAPSHOT *prev, std::vector<tuple3> &deletes, std::vector<tuple3> &inserts) {
+  for (uint32 i=0 ; i < 3 ; i++) {
+    if (i > 0) {
+      next_order(deletes);
+      next_order(inserts);
+    }
+    SNAPSHOT_CHUNK **prev_chunks = prev != NULL ? prev->chunks[i] : NULL;
+    uint32 prev_chunks_count = prev != NULL ? prev->chunks_count[i] : 0;
+    build_order(prev_chunks, prev_chunks_count, deletes, inserts, snapshot->chunks[i], snapshot->chunks_count[i]);
+  }
+  snapshot->count = (prev != NULL ? prev->count : 0) - deletes.size() + inserts.size();
+}
+
+// Updates that had no effect are marked by *_updates_apply()
+static bool is_ineffective(uint32 value) {
+  return value == 0xFFFFFFFFU;
+}
+
+static bool is_ineffective(uint64 tuple) {
+  return tuple == 0xFFFFFFFFFFFFFFFFULL;
+}
+
+static bool is_ineffective(const tuple3 &tuple) {
+  return tuple.fields01 == 0xFFFFFFFFFFFFFFFFULL;
+}
+
+// Sorts the effective updates, without duplicates
+template <typename T> void effective_updates(const T *updates, uint32 count, std::vector<T> &tuples) {
+  for (uint32 i=0 ; i < count ; i++)
+    if (!is_ineffective(updates[i]))
+      tuples.push_back(updates[i]);
+  std::sort(tuples.begin(), tuples.end());
+  tuples.erase(std::unique(tuples.begin(), tuples.end()), tuples.end());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// The tables are copied through their iterators, which produce the tuples
+// in order, so sorting them afterwards is normally just a linear check
+
+static void copy_unary_table(UNARY_TABLE_SNAPSHOT *snapshot, UNARY_TABLE *table) {
+  uint32 count = table->count;
+  std::vector<uint32> values(count);
+  UNARY_TABLE_ITER iter;
+  unary_table_get_iter(table, &iter);
+  uint32 read = unary_table_iter_fill(&iter, values.data(), count);
+  assert(read == count);
+  std::vector<uint32> no_deletes;
+  build_version(snapshot, NULL, no_deletes, values);
+}
+
+static void copy_binary_table(BINARY_TABLE_SNAPSHOT *snapshot, BINARY_TABLE *table) {
+  std::vector<uint64> tuples;
+  BINARY_TABLE_ITER iter;
+  for (binary_table_get_iter(table, &iter) ; !binary_table_iter_is_out_of_range(&iter) ; binary_table_iter_next(&iter))
+    tuples.push_back(pack(binary_table_iter_get_left_field(&iter), binary_table_iter_get_right_field(&iter)));
+  adaptive_sort(tuples.data(), tuples.data() + tuples.size(), std::less<uint64>());
+  std::vector<uint64> no_deletes;
+  build_version(snapshot, NULL, no_deletes, tuples);
+}
+
+static void copy_ternary_table(TERNARY_TABLE_SNAPSHOT *snapshot, TERNARY_TABLE *table) {
+  std::vector<tuple3> tuples;
+  TERNARY_TABLE_ITER iter;
+  for (ternary_table_get_iter(table, &iter) ; !ternary_table_iter_is_out_of_range(&iter) ; ternary_table_iter_next(&iter)) {
+    tuple3 tuple;
+    build(tuple, ternary_table_iter_get_left_field(&iter), ternary_table_iter_get_middle_field(&iter), ternary_table_iter_get_right_field(&iter));
+    tuples.push_back(tuple);
+  }
+  adaptive_sort(tuples.data(), tuples.data() + tuples.size(), std::less<tuple3>());
+  std::vector<tuple3> no_deletes;
+  build_version(snapshot, NULL, no_deletes, tuples);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+SNAPSHOT *snapshot_new(uint32 value_stores_count, uint32 unary_tables_count, uint32 binary_tables_count, uint32 ternary_tables_count) {
+  SNAPSHOT *snapshot = new SNAPSHOT;
+  snapshot->ref_count.store(1);
+  snapshot->next_retired = NULL;
+
+  snapshot->value_stores_count = value_stores_count;
+  snapshot->unary_tables_count = unary_tables_count;
+  snapshot->binary_tables_count = binary_tables_count;
+  snapshot->ternary_tables_count = ternary_tables_count;
+
+  snapshot->value_stores = new VALUE_STORE_SNAPSHOT[value_stores_count]();
+  snapshot->unary_tables = new UNARY_TABLE_SNAPSHOT[unary_tables_count]();
+  snapshot->binary_tables = new BINARY_TABLE_SNAPSHOT[binary_tables_count]();
+  snapshot->ternary_tables = new TERNARY_TABLE_SNAPSHOT[ternary_tables_count]();
+
+  return snapshot;
+}
+
+void snapshot_set_value_store(SNAPSHOT *snapshot, uint32 idx, VALUE_STORE *store) {
+  assert(idx < snapshot->value_stores_count && snapshot->value_stores[idx].chunks == NULL);
+  copy_value_store(snapshot->value_stores + idx, store, NULL);
+}
+
+void snapshot_set_unary_table(SNAPSHOT *snapshot, uint32 idx, UNARY_TABLE *table) {
+  assert(idx < snapshot->unary_tables_count && snapshot->unary_tables[idx].chunks == NULL);
+  copy_unary_table(snapshot->unary_tables + idx, table);
+}
+
+void snapshot_set_binary_table(SNAPSHOT *snapshot, uint32 idx, BINARY_TABLE *table) {
+  assert(idx < snapshot->binary_tables_count && snapshot->binary_tables[idx].chunks[0] == NULL);
+  copy_binary_table(snapshot->binary_tables + idx, table);
+}
+
+void snapshot_set_ternary_table(SNAPSHOT *snapshot, uint32 idx, TERNARY_TABLE *table) {
+  assert(idx < snapshot->ternary_tables_count && snapshot->ternary_tables[idx].chunks[0] == NULL);
+  copy_ternary_table(snapshot->ternary_tables + idx, table);
+}
+
+void snapshot_derive_value_store(SNAPSHOT *snapshot, uint32 idx, SNAPSHOT *prev, VALUE_STORE *store) {
+  assert(idx < snapshot->value_stores_count && snapshot->value_stores[idx].chunks == NULL);
+  assert(idx < prev->value_stores_count);
+  copy_value_store(snapshot->value_stores + idx, store, prev->value_stores + idx);
+}
+
+void snapshot_derive_unary_table(SNAPSHOT *snapshot, uint32 idx, SNAPSHOT *prev, UNARY_TABLE_UPDATES *updates) {
+  assert(idx < snapshot->unary_tables_count && snapshot->unary_tables[idx].chunks == NULL);
+  assert(idx < prev->unary_tables_count);
+  std::vector<uint32> deletes, inserts;
+  uint32 inserts_count = updates->inserts_count;
+  effective_updates(updates->buffer, updates->deletes_count, deletes);
+  effective_updates(updates->buffer + updates->capacity - inserts_count, inserts_count, inserts);
+  build_version(snapshot->unary_tables + idx, prev->unary_tables + idx, deletes, inserts);
+}
+
+void snapshot_derive_binary_table(SNAPSHOT *snapshot, uint32 idx, SNAPSHOT *prev, BINARY_TABLE_UPDATES *updates) {
+  assert(idx < snapshot->binary_tables_count && snapshot->binary_tables[idx].chunks[0] == NULL);
+  assert(idx < prev->binary_tables_count);
+  std::vector<uint64> deletes, inserts;
+  effective_updates(updates->deletes.data(), updates->deletes.size(), deletes);
+  effective_updates(updates->inserts.data(), updates->inserts.size(), inserts);
+  build_version(snapshot->binary_tables + idx, prev->binary_tables + idx, deletes, inserts);
+}
+
+void snapshot_derive_ternary_table(SNAPSHOT *snapshot, uint32 idx, SNAPSHOT *prev, TERNARY_TABLE_UPDATES *updates) {
+  assert(idx < snapshot->ternary_tables_count && snapshot->ternary_tables[idx].chunks[0] == NULL);
+  assert(idx < prev->ternary_tables_count);
+  std::vector<tuple3> deletes, inserts;
+  effective_updates(updates->deletes.data(), updates->deletes.size(), deletes);
+  effective_updates(updates->inserts.data(), updates->inserts.size(), inserts);
+  build_version(snapshot->ternary_tables + idx, prev->ternary_tables + idx, deletes, inserts);
+}
+
+static void snapshot_free(SNAPSHOT *snapshot) {
+  assert(snapshot->ref_count.load() == 0);
+
+  for (uint32 i=0 ; i < snapshot->value_stores_count ; i++)
+    free_value_store(snapshot->value_stores + i);
+  for (uint32 i=0 ; i < snapshot->unary_tables_count ; i++)
+    free_order<uint32>(snapshot->unary_tables[i].chunks, snapshot->unary_tables[i].chunks_count);
+  for (uint32 i=0 ; i < snapshot->binary_tables_count ; i++)
+    for (uint32 j=0 ; j < 2 ; j++)
+      free_order<uint64>(snapshot->binary_tables[i].chunks[j], snapshot->binary_tables[i].chunks_count[j]);
+  for (uint32 i=0 ; i < snapshot->ternary_tables_count ; i++)
+    for (uint32 j=0 ; j < 3 ; j++)
+      free_order<tuple3>(snapshot->ternary_tables[i].chunks[j], snapshot->ternary_tables[i].chunks_count[j]);
+
+  delete [] snapshot->value_stores;
+  delete [] snapshot->unary_tables;
+  delete [] snapshot->binary_tables;
+  delete [] snapshot->ternary_tables;
+  delete snapshot;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void snapshot_publisher_init(SNAPSHOT_PUBLISHER *publisher) {
+  publisher->current.store(NULL);
+  publisher->acquiring.store(0);
+  publisher->retired = NULL;
+}
+
+// Must be called when no reader holds a snapshot anymore
+void snapshot_publisher_cleanup(SNAPSHOT_PUBLISHER *publisher) {
+  snapshot_publish(publisher, NULL);
+  uint32 pending = snapshot_reclaim(publisher);
+  assert(pending == 0);
+}
+
+void snapshot_publish(SNAPSHOT_PUBLISHER *publisher, SNAPSHOT *snapshot) {
+  SNAPSHOT *old_snapshot = publisher->current.exchange(snapshot);
+  if (old_snapshot != NULL) {
+    old_snapshot->next_retired = publisher->retired;
+    publisher->retired = old_snapshot;
+    old_snapshot->ref_count.fetch_sub(1);
+  }
+  snapshot_reclaim(publisher);
+}
+
+SNAPSHOT *snapshot_current(SNAPSHOT_PUBLISHER *publisher) {
+  return publisher->current.load();
+}
+
+uint32 snapshot_reclaim(SNAPSHOT_PUBLISHER *publisher) {
+  uint32 pending = 0;
+  if (publisher->acquiring.load() == 0) {
+    SNAPSHOT **link = &publisher->retired;
+    while (*link != NULL) {
+      SNAPSHOT *snapshot = *link;
+      if (snapshot->ref_count.load() == 0) {
+        *link = snapshot->next_retired;
+        snapshot_free(snapshot);
+      }
+      else {
+        link = &snapshot->next_retired;
+        pending++;
+      }
+    }
+  }
+  else
+    for (SNAPSHOT *snapshot = publisher->retired ; snapshot != NULL ; snapshot = snapshot->next_retired)
+      pending++;
+  return pending;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+SNAPSHOT *snapshot_acquire(SNAPSHOT_PUBLISHER *publisher) {
+  publisher->acquiring.fetch_add(1);
+  SNAPSHOT *snapshot = publisher->current.load();
+  if (snapshot != NULL)
+    snapshot->ref_count.fetch_add(1);
+  publisher->acquiring.fetch_sub(1);
+  return snapshot;
+}
+
+void snapshot_release(SNAPSHOT *snapshot) {
+  uint32 ref_count = snapshot->ref_count.fetch_sub(1);
+  assert(ref_count > 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+OBJ snapshot_lookup_surrogate(SNAPSHOT *snapshot, uint32 store_idx, uint32 surr) {
+  assert(store_idx < snapshot->value_stores_count);
+  VALUE_STORE_SNAPSHOT *store = snapshot->value_stores + store_idx;
+  assert(surr < store->capacity);
+  OBJ value = chunk_data<OBJ>(store->chunks[surr / SNAPSHOT_CHUNK_SIZE])[surr % SNAPSHOT_CHUNK_SIZE];
+  assert(!is_blank_obj(value));
+  return value;
+}
+
+bool snapshot_unary_table_contains(SNAPSHOT *snapshot, uint32 table_idx, uint32 value) {
+  assert(table_idx < snapshot->unary_tables_count);
+  UNARY_TABLE_SNAPSHOT *table = snapshot->unary_tables + table_idx;
+  return order_contains(table->chunks, table->chunks_count, value);
+}
+
+bool snapshot_binary_table_contains(SNAPSHOT *snapshot, uint32 table_idx, uint32 left_val, uint32 right_val) {
+  assert(table_idx < snapshot->binary_tables_count);
+  BINARY_TABLE_SNAPSHOT *table = snapshot->binary_tables + table_idx;
+  return order_contains(table->chunks[0], table->chunks_count[0], pack(left_val, right_val));
+}
+
+bool snapshot_ternary_table_contains(SNAPSHOT *snapshot, uint32 table_idx, uint32 left_val, uint32 middle_val, uint32 right_val) {
+  assert(table_idx < snapshot->ternary_tables_count);
+  tuple3 tuple;
+  build(tuple, left_val, middle_val, right_val);
+  TERNARY_TABLE_SNAPSHOT *table = snapshot->ternary_tables + table_idx;
+  return order_contains(table->chunks[0], table->chunks_count[0], tuple);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static uint64 bound_key(uint64 tuple) {
+  return tuple;
+}
+
+static uint64 bound_key(const tuple3 &tuple) {
+  return tuple.fields01;
+}
+
+template <typename T, typename I> const T &iter_curr(I *iter) {
+  assert(iter->chunk < iter->chunks_end);
+  return chunk_data<T>(*iter->chunk)[iter->idx];
+}
+
+template <typename T, typename I> void iter_check_bound(I *iter) {
+  if (iter->chunk < iter->chunks_end && bound_key(iter_curr<T>(iter)) >= iter->excl_upper_bound)
+    iter->chunk = iter->chunks_end;
+}
+
+template <typename T, typename I>
+void iter_init(I *iter, SNAPSHOT_CHUNK **chunks, uint32 chunks_count, const T &lower_bound, uint64 excl_upper_bound, uint8 shift) {
+  uint32 chunk_idx;
+  order_lower_bound(chunks, chunks_count, lower_bound, chunk_idx, iter->idx);
+  iter->chunk = chunks + chunk_idx;
+  iter->chunks_end = chunks + chunks_count;
+  iter->excl_upper_bound = excl_upper_bound;
+  iter->shift = shift;
+  iter_check_bound<T>(iter);
+}
+
+template <typename I> void iter_advance(I *iter) {
+  assert(iter->chunk < iter->chunks_end);
+  if (++iter->idx == (*iter->chunk)->count) {
+    iter->chunk++;
+    iter->idx = 0;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void snapshot_unary_table_get_iter(SNAPSHOT *snapshot, uint32 table_idx, UNARY_TABLE_SNAPSHOT_ITER *iter) {
+  assert(table_idx < snapshot->unary_tables_count);
+  UNARY_TABLE_SNAPSHOT *table = snapshot->unary_tables + table_idx;
+  iter->chunk = table->chunks;
+  iter->chunks_end = table->chunks + table->chunks_count;
+  iter->idx = 0;
+}
+
+bool snapshot_unary_table_iter_is_out_of_range(UNARY_TABLE_SNAPSHOT_ITER *iter) {
+  return iter->chunk == iter->chunks_end;
+}
+
+uint32 snapshot_unary_table_iter_get_field(UNARY_TABLE_SNAPSHOT_ITER *iter) {
+  return iter_curr<uint32>(iter);
+}
+
+void snapshot_unary_table_iter_next(UNARY_TABLE_SNAPSHOT_ITER *iter) {
+  iter_advance(iter);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void binary_get_iter(SNAPSHOT *snapshot, uint32 table_idx, BINARY_TABLE_SNAPSHOT_ITER *iter, uint32 shift, uint64 lower_bound, uint64 excl_upper_bound) {
+  assert(table_idx < snapshot->binary_tables_count);
+  BINARY_TABLE_SNAPSHOT *table = snapshot->binary_tables + table_idx;
+  iter_init(iter, table->chunks[shift], table->chunks_count[shift], lower_bound, excl_upper_bound, shift);
+}
+
+void snapshot_binary_table_get_iter_by_col_0(SNAPSHOT *snapshot, uint32 table_idx, BINARY_TABLE_SNAPSHOT_ITER *iter, uint32 value) {
+  binary_get_iter(snapshot, table_idx, iter, 0, pack(value, 0), pack(value+1, 0));
+}
+
+void snapshot_binary_table_get_iter_by_col_1(SNAPSHOT *snapshot, uint32 table_idx, BINARY_TABLE_SNAPSHOT_ITER *iter, uint32 value) {
+  binary_get_iter(snapshot, table_idx, iter, 1, pack(value, 0), pack(value+1, 0));
+}
+
+void snapshot_binary_table_get_iter(SNAPSHOT *snapshot, uint32 table_idx, BINARY_TABLE_SNAPSHOT_ITER *iter) {
+  binary_get_iter(snapshot, table_idx, iter, 0, 0, 0xFFFFFFFFFFFFFFFFULL);
+}
+
+bool snapshot_binary_table_iter_is_out_of_range(BINARY_TABLE_SNAPSHOT_ITER *iter) {
+  return iter->chunk == iter->chunks_end;
+}
+
+uint32 snapshot_binary_table_iter_get_left_field(BINARY_TABLE_SNAPSHOT_ITER *iter) {
+  uint64 tuple = iter_curr<uint64>(iter);
+  return iter->shift == 0 ? left(tuple) : right(tuple);
+}
+
+uint32 snapshot_binary_table_iter_get_right_field(BINARY_TABLE_SNAPSHOT_ITER *iter) {
+  uint64 tuple = iter_curr<uint64>(iter);
+  return iter->shift == 0 ? right(tuple) : left(tuple);
+}
+
+void snapshot_binary_table_iter_next(BINARY_TABLE_SNAPSHOT_ITER *iter) {
+  iter_advance(iter);
+  iter_check_bound<uint64>(iter);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void ternary_get_iter(SNAPSHOT *snapshot, uint32 table_idx, TERNARY_TABLE_SNAPSHOT_ITER *iter, uint32 shift, uint32 value0, uint32 value1, uint64 excl_upper_bound) {
+  assert(table_idx < snapshot->ternary_tables_count);
+  TERNARY_TABLE_SNAPSHOT *table = snapshot->ternary_tables + table_idx;
+  tuple3 lower_bound;
+  build(lower_bound, value0, value1, 0);
+  iter_init(iter, table->chunks[shift], table->chunks_count[shift], lower_bound, excl_upper_bound, shift);
+}
+
+void snapshot_ternary_table_get_iter_by_cols_01(SNAPSHOT *snapshot, uint32 table_idx, TERNARY_TABLE_SNAPSHOT_ITER *iter, uint32 value0, uint32 value1) {
+  ternary_get_iter(snapshot, table_idx, iter, 0, value0, value1, pack(value0, value1+1));
+}
+
+void snapshot_ternary_table_get_iter_by_cols_02(SNAPSHOT *snapshot, uint32 table_idx, TERNARY_TABLE_SNAPSHOT_ITER *iter, uint32 value0, uint32 value2) {
+  ternary_get_iter(snapshot, table_idx, iter, 2, value2, value0, pack(value2, value0+1));
+}
+
+void snapshot_ternary_table_get_iter_by_cols_12(SNAPSHOT *snapshot, uint32 table_idx, TERNARY_TABLE_SNAPSHOT_ITER *iter, uint32 value1, uint32 value2) {
+  ternary_get_iter(snapshot, table_idx, iter, 1, value1, value2, pack(value1, value2+1));
+}
+
+void snapshot_ternary_table_get_iter_by_col_0(SNAPSHOT *snapshot, uint32 table_idx, TERNARY_TABLE_SNAPSHOT_ITER *iter, uint32 value) {
+  ternary_get_iter(snapshot, table_idx, iter, 0, value, 0, pack(value+1, 0));
+}
+
+void snapshot_ternary_table_get_iter_by_col_1(SNAPSHOT *snapshot, uint32 table_idx, TERNARY_TABLE_SNAPSHOT_ITER *iter, uint32 value) {
+  ternary_get_iter(snapshot, table_idx, iter, 1, value, 0, pack(value+1, 0));
+}
+
+void snapshot_ternary_table_get_iter_by_col_2(SNAPSHOT *snapshot, uint32 table_idx, TERNARY_TABLE_SNAPSHOT_ITER *iter, uint32 value) {
+  ternary_get_iter(snapshot, table_idx, iter, 2, value, 0, pack(value+1, 0));
+}
+
+void snapshot_ternary_table_get_iter(SNAPSHOT *snapshot, uint32 table_idx, TERNARY_TABLE_SNAPSHOT_ITER *iter) {
+  ternary_get_iter(snapshot, table_idx, iter, 0, 0, 0, 0xFFFFFFFFFFFFFFFFULL);
+}
+
+bool snapshot_ternary_table_iter_is_out_of_range(TERNARY_TABLE_SNAPSHOT_ITER *iter) {
+  return iter->chunk == iter->chunks_end;
+}
+
+// The triples of chunks[shift] start from column shift
+static uint32 ternary_iter_field(TERNARY_TABLE_SNAPSHOT_ITER *iter, uint32 column) {
+  return get_field(iter_curr<tuple3>(iter), (column + 3 - iter->shift) % 3);
+}
+
+uint32 snapshot_ternary_table_iter_get_left_field(TERNARY_TABLE_SNAPSHOT_ITER *iter) {
+  return ternary_iter_field(iter, 0);
+}
+
+uint32 snapshot_ternary_table_iter_get_middle_field(TERNARY_TABLE_SNAPSHOT_ITER *iter) {
+  return ternary_iter_field(iter, 1);
+}
+
+uint32 snapshot_ternary_table_iter_get_right_field(TERNARY_TABLE_SNAPSHOT_ITER *iter) {
+  return ternary_iter_field(iter, 2);
+}
+
+void snapshot_ternary_table_iter_next(TERNARY_TABLE_SNAPSHOT_ITER *iter) {
+  iter_advance(iter);
+  iter_check_bound<tuple3>(iter);
+}
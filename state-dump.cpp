@@ -0,0 +1,598 @@
+#include "lib.h"
+#include "table-utils.h"
+
+
+// A state file starts with a header, followed by one section for each of the
+// value stores and tables that were dumped, which have to be loaded back in the
+// same order. Each section has a header with its kind, the length of its payload
+// and a checksum of it, and the payload is padded with zeros to a multiple of
+// eight bytes, so that all sections are aligned. Integers are stored in the
+// native (little endian) byte order.
+//
+// Table payloads are the sorted arrays of their tuples, preceded by their count:
+// uint32 values for unary tables, packed uint64 pairs for binary ones and
+// triples of uint32 for ternary ones. They are loaded with a single read, and
+// the tables are rebuilt with their bulk loading functions.
+//
+// Value store payloads contain the number of slots, a table with the names of
+// all the symbols used by the stored values (symbol indexes are not stable
+// across different programs, or even different runs of the same one), and
+// then each slot, as an encoded value followed by its reference count, or as
+// a single TYPE_BLANK_OBJ byte if it's free. Values are encoded as their
+// logical type followed by their contents, with integers and lengths stored
+// as variable-length integers, seven bits per byte. The reference counts are
+// restored as they were, so tables are loaded without adding references.
+
+const char STATE_FILE_MAGIC[8] = {'A', 'M', 'B', 'R', 'S', 'T', 'A', 'T'};
+const uint32 STATE_FILE_VERSION = 1;
+
+enum SECTION_KIND {
+  SECTION_VALUE_STORE   = 1,
+  SECTION_UNARY_TABLE   = 2,
+  SECTION_BINARY_TABLE  = 3,
+  SECTION_TERNARY_TABLE = 4
+};
+
+struct FILE_HEADER {
+  char magic[8];
+  uint32 version;
+  uint32 unused_field;
+};
+
+struct SECTION_HEADER {
+  uint32 kind;
+  uint32 unused_field;
+  uint64 length;    // Not including the padding
+  uint64 checksum;  // Including the padding
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+static uint64 padded_length(uint64 length) {
+  return (length + 7) / 8 * 8;
+}
+
+// Multiplicative hash of the payload, read as a sequence of 64-bit words
+static uint64 checksum(const uint64 *words, uint64 count) {
+  uint64 hash = 0x9E3779B97F4A7C15ULL ^ count;
+  for (uint64 i=0 ; i < count ; i++) {
+    hash = (hash ^ words[i]) * 0xFF51AFD7ED558CCDULL;
+    hash ^= hash >> 32;
+  }
+  hash *= 0xC4CEB9FE1A85EC53ULL;
+  return hash ^ (hash >> 33);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void write_bytes(STATE_FILE *file, const void *data, uint64 size) {
+  if (!file->failed && size > 0 && fwrite(data, 1, size, file->file) != size)
+    file->failed = true;
+}
+
+// Pads the payload with zeros, computes the checksum and writes the whole section
+static void write_section(STATE_FILE *file, SECTION_KIND kind, std::vector<uint8> &payload) {
+  uint64 length = payload.size();
+  payload.resize(padded_length(length), 0);
+
+  // The buffer of a vector is allocated with operator new, which aligns it for any type
+  SECTION_HEADER header;
+  header.kind = kind;
+  header.unused_field = 0;
+  header.length = length;
+  header.checksum = checksum((const uint64 *) payload.data(), payload.size() / 8);
+
+  write_bytes(file, &header, sizeof(SECTION_HEADER));
+  write_bytes(file, payload.data(), payload.size());
+}
+
+static void put_bytes(std::vector<uint8> &bytes, const void *data, uint64 size) {
+  const uint8 *ptr = (const uint8 *) data;
+  bytes.insert(bytes.end(), ptr, ptr + size);
+}
+
+static void put_varint(std::vector<uint8> &bytes, uint64 value) {
+  while (value >= 0x80) {
+    bytes.push_back((uint8) (value | 0x80));
+    value >>= 7;
+  }
+  bytes.push_back((uint8) value);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct VALUE_ENCODER {
+  std::vector<uint8> bytes;
+  std::vector<uint32> symb_ids; // Position in symbols of each symbol index, or INVALID_INDEX
+  std::vector<uint16> symbols;  // Symbol indexes, in order of first use
+};
+
+static void put_symbol(VALUE_ENCODER &encoder, uint16 symb_idx) {
+  if (encoder.symb_ids.empty())
+    encoder.symb_ids.resize(0x10000, INVALID_INDEX);
+  uint32 id = encoder.symb_ids[symb_idx];
+  if (id == INVALID_INDEX) {
+    id = encoder.symbols.size();
+    encoder.symb_ids[symb_idx] = id;
+    encoder.symbols.push_back(symb_idx);
+  }
+  put_varint(encoder.bytes, id);
+}
+
+static void encode_value(VALUE_ENCODER &encoder, OBJ obj) {
+  std::vector<uint8> &bytes = encoder.bytes;
+
+  if (is_blank_obj(obj)) {
+    bytes.push_back(TYPE_BLANK_OBJ);
+    return;
+  }
+
+  OBJ_TYPE type = get_logical_type(obj);
+  bytes.push_back(type);
+
+  switch (type) {
+    case TYPE_NULL_OBJ:
+      break;
+
+    case TYPE_SYMBOL:
+      put_symbol(encoder, get_symb_idx(obj));
+      break;
+
+    case TYPE_INTEGER: {
+      // Zigzag encoding, so that small negative numbers are short too
+      int64 value = get_int(obj);
+      put_varint(bytes, ((uint64) value << 1) ^ (uint64) (value >> 63));
+      break;
+    }
+
+    case TYPE_FLOAT: {
+      double value = get_float(obj);
+      put_bytes(bytes, &value, sizeof(double));
+      break;
+    }
+
+    case TYPE_SEQUENCE: {
+      SEQ_ITER it;
+      get_seq_iter(it, obj);
+      put_varint(bytes, it.len);
+      for ( ; !is_out_of_range(it) ; move_forward(it))
+        encode_value(encoder, get_curr_obj(it));
+      break;
+    }
+
+    case TYPE_SET: {
+      SET_ITER it;
+      get_set_iter(it, obj);
+      put_varint(bytes, it.size);
+      for ( ; !is_out_of_range(it) ; move_forward(it))
+        encode_value(encoder, get_curr_obj(it));
+      break;
+    }
+
+    case TYPE_BIN_REL: {
+      uint32 size = 0;
+      BIN_REL_ITER it;
+      for (get_bin_rel_iter(it, obj) ; !is_out_of_range(it) ; move_forward(it))
+        size++;
+      put_varint(bytes, size);
+      for (get_bin_rel_iter(it, obj) ; !is_out_of_range(it) ; move_forward(it)) {
+        encode_value(encoder, get_curr_left_arg(it));
+        encode_value(encoder, get_curr_right_arg(it));
+      }
+      break;
+    }
+
+    case TYPE_TERN_REL: {
+      uint32 size = 0;
+      TERN_REL_ITER it;
+      for (get_tern_rel_iter(it, obj) ; !is_out_of_range(it) ; move_forward(it))
+        size++;
+      put_varint(bytes, size);
+      for (get_tern_rel_iter(it, obj) ; !is_out_of_range(it) ; move_forward(it)) {
+        encode_value(encoder, tern_rel_it_get_left_arg(it));
+        encode_value(encoder, tern_rel_it_get_mid_arg(it));
+        encode_value(encoder, tern_rel_it_get_right_arg(it));
+      }
+      break;
+    }
+
+    case TYPE_TAG_OBJ:
+      put_symbol(encoder, get_tag_idx(obj));
+      encode_value(encoder, get_inner_obj(obj));
+      break;
+
+    default:
+      internal_fail();
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+bool state_dump_open(STATE_FILE *file, const char *path) {
+  file->file = fopen(path, "wb");
+  file->failed = file->file == NULL;
+  if (file->failed)
+    return false;
+
+  FILE_HEADER header;
+  memcpy(header.magic, STATE_FILE_MAGIC, sizeof(header.magic));
+  header.version = STATE_FILE_VERSION;
+  header.unused_field = 0;
+  write_bytes(file, &header, sizeof(FILE_HEADER));
+  return !file->failed;
+}
+
+bool state_dump_close(STATE_FILE *file) {
+  if (file->file != NULL && fclose(file->file) != 0)
+    file->failed = true;
+  file->file = NULL;
+  return !file->failed;
+}
+
+void state_dump_value_store(STATE_FILE *file, VALUE_STORE *store) {
+  uint32 capacity = store->capacity;
+  OBJ *slots = value_store_slot_array(store);
+  uint32 *ref_counts = value_store_ref_count_array(store);
+
+  uint32 count = capacity;
+  while (count > 0 && is_blank_obj(slots[count - 1]))
+    count--;
+
+  VALUE_ENCODER encoder;
+  for (uint32 i=0 ; i < count ; i++) {
+    encode_value(encoder, slots[i]);
+    if (!is_blank_obj(slots[i]))
+      put_varint(encoder.bytes, ref_counts[i]);
+  }
+
+  std::vector<uint8> payload;
+  put_varint(payload, count);
+  put_varint(payload, encoder.symbols.size());
+  for (uint32 i=0 ; i < encoder.symbols.size() ; i++) {
+    const char *name = symb_to_raw_str(make_symb(encoder.symbols[i]));
+    uint32 length = strlen(name);
+    put_varint(payload, length);
+    put_bytes(payload, name, length);
+  }
+  put_bytes(payload, encoder.bytes.data(), encoder.bytes.size());
+
+  write_section(file, SECTION_VALUE_STORE, payload);
+}
+
+void state_dump_unary_table(STATE_FILE *file, UNARY_TABLE *table) {
+  uint64 count = table->count;
+  std::vector<uint8> payload(sizeof(uint64) + count * sizeof(uint32));
+  memcpy(payload.data(), &count, sizeof(uint64));
+
+  UNARY_TABLE_ITER iter;
+  unary_table_get_iter(table, &iter);
+  uint32 read = unary_table_iter_fill(&iter, (uint32 *) (payload.data() + sizeof(uint64)), count);
+  assert(read == count);
+
+  write_section(file, SECTION_UNARY_TABLE, payload);
+}
+
+void state_dump_binary_table(STATE_FILE *file, BINARY_TABLE *table) {
+  std::vector<uint64> tuples;
+  tuples.push_back(0);
+  BINARY_TABLE_ITER iter;
+  for (binary_table_get_iter(table, &iter) ; !binary_table_iter_is_out_of_range(&iter) ; binary_table_iter_next(&iter))
+    tuples.push_back(pack(binary_table_iter_get_left_field(&iter), binary_table_iter_get_right_field(&iter)));
+  tuples[0] = tuples.size() - 1;
+
+  std::vector<uint8> payload;
+  put_bytes(payload, tuples.data(), tuples.size() * sizeof(uint64));
+  write_section(file, SECTION_BINARY_TABLE, payload);
+}
+
+void state_dump_ternary_table(STATE_FILE *file, TERNARY_TABLE *table) {
+  std::vector<uint32> fields(2);
+  TERNARY_TABLE_ITER iter;
+  for (ternary_table_get_iter(table, &iter) ; !ternary_table_iter_is_out_of_range(&iter) ; ternary_table_iter_next(&iter)) {
+    fields.push_back(ternary_table_iter_get_left_field(&iter));
+    fields.push_back(ternary_table_iter_get_middle_field(&iter));
+    fields.push_back(ternary_table_iter_get_right_field(&iter));
+  }
+  uint64 count = (fields.size() - 2) / 3;
+  memcpy(fields.data(), &count, sizeof(uint64));
+
+  std::vector<uint8> payload;
+  put_bytes(payload, fields.data(), fields.size() * sizeof(uint32));
+  write_section(file, SECTION_TERNARY_TABLE, payload);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Reads the next section, which must be of the given kind, and checks it.
+// The payload is stored as 64-bit words, so that it's suitably aligned
+static bool read_section(STATE_FILE *file, SECTION_KIND kind, std::vector<uint64> &payload, uint64 &length) {
+  if (file->failed)
+    return false;
+
+  SECTION_HEADER header;
+  bool ok = fread(&header, sizeof(SECTION_HEADER), 1, file->file) == 1 && header.kind == kind;
+  if (ok) {
+    length = header.length;
+    payload.resize(padded_length(length) / 8);
+    ok = fread(payload.data(), sizeof(uint64), payload.size(), file->file) == payload.size();
+    ok = ok && checksum(payload.data(), payload.size()) == header.checksum;
+  }
+
+  file->failed = !ok;
+  return ok;
+}
+
+struct VALUE_DECODER {
+  const uint8 *ptr;
+  const uint8 *end;
+  std::vector<uint16> symbols; // Symbol index of each symbol id
+};
+
+static bool get_varint(VALUE_DECODER &decoder, uint64 &value) {
+  value = 0;
+  for (uint32 shift=0 ; shift < 64 && decoder.ptr < decoder.end ; shift += 7) {
+    uint8 byte = *(decoder.ptr++);
+    value |= (uint64) (byte & 0x7F) << shift;
+    if (byte < 0x80)
+      return true;
+  }
+  return false;
+}
+
+// Also checks that the encoded data is long enough to contain the given number
+// of values, so that corrupted lengths cannot trigger huge allocations
+static bool get_length(VALUE_DECODER &decoder, uint32 min_bytes_per_item, uint32 &length) {
+  uint64 value;
+  if (!get_varint(decoder, value) || value > (uint64) (decoder.end - decoder.ptr) / min_bytes_per_item)
+    return false;
+  length = value;
+  return true;
+}
+
+static bool get_symbol(VALUE_DECODER &decoder, uint16 &symb_idx) {
+  uint64 id;
+  if (!get_varint(decoder, id) || id >= decoder.symbols.size())
+    return false;
+  symb_idx = decoder.symbols[id];
+  return true;
+}
+
+static bool decode_value(VALUE_DECODER &decoder, OBJ &obj);
+
+// Decodes count values into objs[0], objs[stride], objs[2 * stride]...
+// On failure the values that were decoded are released
+static bool decode_values(VALUE_DECODER &decoder, OBJ *objs, uint32 count, uint32 stride) {
+  for (uint32 i=0 ; i < count ; i++)
+    if (!decode_value(decoder, objs[i * stride])) {
+      for (uint32 j=0 ; j < i ; j++)
+        release(objs[j * stride]);
+      return false;
+    }
+  return true;
+}
+
+static bool decode_value(VALUE_DECODER &decoder, OBJ &obj) {
+  if (decoder.ptr >= decoder.end)
+    return false;
+
+  uint8 type = *(decoder.ptr++);
+  switch (type) {
+    case TYPE_BLANK_OBJ:
+      obj = make_blank_obj();
+      return true;
+
+    case TYPE_NULL_OBJ:
+      obj = make_null_obj();
+      return true;
+
+    case TYPE_SYMBOL: {
+      uint16 symb_idx;
+      if (!get_symbol(decoder, symb_idx))
+        return false;
+      obj = make_symb(symb_idx);
+      return true;
+    }
+
+    case TYPE_INTEGER: {
+      uint64 value;
+      if (!get_varint(decoder, value))
+        return false;
+      obj = make_int((value >> 1) ^ -(value & 1));
+      return true;
+    }
+
+    case TYPE_FLOAT: {
+      double value;
+      if (decoder.end - decoder.ptr < (int64) sizeof(double))
+        return false;
+      memcpy(&value, decoder.ptr, sizeof(double));
+      decoder.ptr += sizeof(double);
+      obj = make_float(value);
+      return true;
+    }
+
+    case TYPE_SEQUENCE:
+    case TYPE_SET: {
+      uint32 length;
+      if (!get_length(decoder, 1, length))
+        return false;
+      if (length == 0) {
+        obj = type == TYPE_SEQUENCE ? make_empty_seq() : make_empty_rel();
+        return true;
+      }
+      OBJ *elems = new_obj_array(length);
+      bool ok = decode_values(decoder, elems, length, 1);
+      if (ok)
+        obj = type == TYPE_SEQUENCE ? build_seq(elems, length) : build_set(elems, length);
+      delete_obj_array(elems, length);
+      return ok;
+    }
+
+    case TYPE_BIN_REL:
+    case TYPE_TERN_REL: {
+      uint32 arity = type == TYPE_BIN_REL ? 2 : 3;
+      uint32 size;
+      if (!get_length(decoder, arity, size))
+        return false;
+      if (size == 0) {
+        obj = make_empty_rel();
+        return true;
+      }
+      // The columns are laid out one after the other, and filled tuple by tuple
+      OBJ *cols = new_obj_array(arity * size);
+      bool ok = true;
+      for (uint32 i=0 ; i < size && ok ; i++)
+        if (!decode_values(decoder, cols + i, arity, size)) {
+          for (uint32 j=0 ; j < i ; j++)
+            for (uint32 k=0 ; k < arity ; k++)
+              release(cols[k * size + j]);
+          ok = false;
+        }
+      if (ok)
+        obj = arity == 2 ? build_bin_rel(cols, cols + size, size) : build_tern_rel(cols, cols + size, cols + 2 * size, size);
+      delete_obj_array(cols, arity * size);
+      return ok;
+    }
+
+    case TYPE_TAG_OBJ: {
+      uint16 tag_idx;
+      OBJ inner_obj;
+      if (!get_symbol(decoder, tag_idx) || !decode_value(decoder, inner_obj))
+        return false;
+      obj = make_tag_obj(tag_idx, inner_obj);
+      return true;
+    }
+
+    default:
+      return false;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+bool state_load_open(STATE_FILE *file, const char *path) {
+  file->file = fopen(path, "rb");
+  file->failed = file->file == NULL;
+  if (file->failed)
+    return false;
+
+  FILE_HEADER header;
+  bool ok = fread(&header, sizeof(FILE_HEADER), 1, file->file) == 1;
+  ok = ok && memcmp(header.magic, STATE_FILE_MAGIC, sizeof(header.magic)) == 0;
+  ok = ok && header.version == STATE_FILE_VERSION;
+  file->failed = !ok;
+  return ok;
+}
+
+void state_load_close(STATE_FILE *file) {
+  if (file->file != NULL)
+    fclose(file->file);
+  file->file = NULL;
+}
+
+bool state_load_value_store(STATE_FILE *file, VALUE_STORE *store) {
+  std::vector<uint64> payload;
+  uint64 length;
+  if (!read_section(file, SECTION_VALUE_STORE, payload, length))
+    return false;
+
+  VALUE_DECODER decoder;
+  decoder.ptr = (const uint8 *) payload.data();
+  decoder.end = decoder.ptr + length;
+
+  uint32 count, symbols_count;
+  bool ok = get_length(decoder, 1, count) && get_length(decoder, 1, symbols_count);
+  for (uint32 i=0 ; i < symbols_count && ok ; i++) {
+    uint32 name_length;
+    ok = get_length(decoder, 1, name_length);
+    if (ok) {
+      decoder.symbols.push_back(lookup_symb_idx((const char *) decoder.ptr, name_length));
+      decoder.ptr += name_length;
+    }
+  }
+
+  std::vector<OBJ> values(count);
+  std::vector<uint32> ref_counts(count);
+  uint32 decoded = 0;
+  for ( ; decoded < count && ok ; decoded++) {
+    uint64 ref_count = 0;
+    ok = decode_value(decoder, values[decoded]);
+    if (ok && !is_blank_obj(values[decoded])) {
+      ok = get_varint(decoder, ref_count) && ref_count <= 0xFFFFFFFFU;
+      if (!ok)
+        release(values[decoded]);
+    }
+    ref_counts[decoded] = ref_count;
+  }
+
+  if (!ok) {
+    for (uint32 i=0 ; i + 1 < decoded ; i++)
+      if (!is_blank_obj(values[i]))
+        release(values[i]);
+    file->failed = true;
+    return false;
+  }
+
+  value_store_load(store, values.data(), ref_counts.data(), count);
+  return true;
+}
+
+// Reads a table section and checks that its length matches the number of tuples
+static bool read_table_section(STATE_FILE *file, SECTION_KIND kind, uint32 tuple_size, std::vector<uint64> &payload, uint64 &count) {
+  uint64 length;
+  if (!read_section(file, kind, payload, length))
+    return false;
+  bool ok = length >= sizeof(uint64) && (length - sizeof(uint64)) / tuple_size == payload[0] && (length - sizeof(uint64)) % tuple_size == 0;
+  file->failed = !ok;
+  count = ok ? payload[0] : 0;
+  return ok;
+}
+
+bool state_load_unary_table(STATE_FILE *file, UNARY_TABLE *table) {
+  assert(table->count == 0);
+
+  std::vector<uint64> payload;
+  uint64 count;
+  if (!read_table_section(file, SECTION_UNARY_TABLE, sizeof(uint32), payload, count))
+    return false;
+
+  const uint32 *values = (const uint32 *) (payload.data() + 1);
+  UNARY_TABLE_UPDATES updates;
+  unary_table_updates_init(&updates);
+  for (uint32 i=0 ; i < count ; i++)
+    unary_table_insert(&updates, values[i]);
+  unary_table_updates_apply_tuples(table, &updates);
+  unary_table_updates_cleanup(&updates);
+  return true;
+}
+
+bool state_load_binary_table(STATE_FILE *file, BINARY_TABLE *table) {
+  std::vector<uint64> payload;
+  uint64 count;
+  if (!read_table_section(file, SECTION_BINARY_TABLE, sizeof(uint64), payload, count))
+    return false;
+
+  BINARY_TABLE_UPDATES updates;
+  binary_table_updates_init(&updates);
+  updates.inserts.assign(payload.begin() + 1, payload.end());
+  binary_table_bulk_load(table, &updates, NULL, NULL);
+  binary_table_updates_cleanup(&updates);
+  return true;
+}
+
+bool state_load_ternary_table(STATE_FILE *file, TERNARY_TABLE *table) {
+  std::vector<uint64> payload;
+  uint64 count;
+  if (!read_table_section(file, SECTION_TERNARY_TABLE, 3 * sizeof(uint32), payload, count))
+    return false;
+
+  const uint32 *fields = (const uint32 *) (payload.data() + 1);
+  TERNARY_TABLE_UPDATES updates;
+  ternary_table_updates_init(&updates);
+  updates.inserts.resize(count);
+  for (uint32 i=0 ; i < count ; i++)
+    build(updates.inserts[i], fields[3 * i], fields[3 * i + 1], fields[3 * i + 2]);
+  ternary_table_bulk_load(table, &updates, NULL, NULL, NULL);
+  ternary_table_updates_cleanup(&updates);
+  return true;
+}
@@ -1,3 +1,7 @@
+// Number of values that the set_*_table() functions
+// look up in (or insert into) a value store at once
+const uint32 LOAD_CHUNK_SIZE = 256;
+
 inline uint64 pack(uint64 left, uint64 right) {
   return (left << 32) | right;
 }
@@ -55,6 +59,10 @@ inline void build(tuple3 &tuple, uint32 val0, uint32 val1, uint32 val2) {
   tuple.field2 = val2;
 }
 
+inline uint32 get_field(const tuple3 &tuple, uint32 idx) {
+  return idx == 0 ? left(tuple.fields01) : (idx == 1 ? right(tuple.fields01) : tuple.field2);
+}
+
 inline void shift(tuple3 &tuple) {
   uint32 new_field2 = left(tuple.fields01);
   tuple.fields01 = pack(tuple.fields01, tuple.field2);
@@ -148,25 +156,122 @@ template <typename T> bool sorted_vector_has_duplicates(std::vector<T> &xs) {
   return false;
 }
 
-template <typename K, typename T>
-bool update_has_conflicts(std::vector<typename K::key_type> &inserted_keys, std::vector<typename K::key_type> &deleted_keys, std::set<T> &target) {
-  int count = inserted_keys.size();
-  for (int i=0 ; i < count ; i++) {
-    typename K::key_type key = inserted_keys[i];
-    if (!binary_search(deleted_keys.begin(), deleted_keys.end(), key)) {
-      T lb = K::lower_bound(key);
-      typename std::set<T>::iterator it = target.lower_bound(lb);
-      if (it != target.end() && K::key_shifted(*it) == key)
-        return true;
-    }
+// Binary tables are always searched by the left field of the
+// stored pairs, which are swapped in the right-to-left order
+template <typename K> bool has_key(SORTED_PAIRS &target, uint32 key) {
+  return sorted_pairs_has_left(&target, key);
+}
+
+template <typename K, typename T> bool btree_has_key(BTREE &target, typename K::key_type key, const T &lower_bound) {
+  T *curr, *end;
+  void *leaf;
+  btree_seek(&target, lower_bound, curr, end, leaf);
+  return curr != end && K::key_shifted(*curr) == key;
+}
+
+template <typename K> bool has_key(BTREE &target, typename K::key_type key) {
+  return btree_has_key<K>(target, key, K::lower_bound(key));
+}
+
+// Dense columns are indexed by left value, so they can only be searched by column 0
+template <typename K> bool has_key(DENSE_COLUMN &target, uint32 key) {
+  return key < target.capacity && target.values[key] != 0xFFFFFFFF;
+}
+
+template <typename K> bool has_key(TERNARY_TABLE_ORDER &target, typename K::key_type key) {
+  tuple3 first;
+  return ternary_table_order_lower_bound(&target, K::lower_bound(key), &first) && K::key_shifted(first) == key;
+}
+
+// Probing the target costs about log2(N) comparisons for each of the K keys, while
+// merging the sorted keys with the target visits each of its N entries at most once.
+// Merging is preferred once K * log2(N) reaches N, that is, for large batches
+inline bool prefer_merge(uint64 keys_count, uint64 target_size) {
+  uint32 log2_size = 0;
+  while ((target_size >> log2_size) > 1)
+    log2_size++;
+  return keys_count * log2_size >= target_size;
+}
+
+// The has_any_key() functions check whether the target contains
+// at least one of the given keys, which are sorted and unique
+
+template <typename K> bool has_any_key(SORTED_PAIRS &target, std::vector<uint32> &keys) {
+  uint32 count = keys.size();
+  if (prefer_merge(count, target.main_count + target.delta_count))
+    return sorted_pairs_has_any_left(&target, keys.data(), count);
+  for (uint32 i=0 ; i < count ; i++)
+    if (has_key<K>(target, keys[i]))
+      return true;
+  return false;
+}
+
+template <typename K, typename T> bool btree_has_any_key(BTREE &target, std::vector<typename K::key_type> &keys, const T &lower_bound) {
+  T *curr, *end;
+  void *leaf;
+  btree_seek(&target, lower_bound, curr, end, leaf);
+  uint32 count = keys.size();
+  uint32 idx = 0;
+  while (idx < count && curr != end) {
+    typename K::key_type key = K::key_shifted(*curr);
+    if (key == keys[idx])
+      return true;
+    if (key < keys[idx])
+      btree_cursor_next(curr, end, leaf);
+    else
+      idx++;
   }
   return false;
 }
 
+template <typename K> bool has_any_key(BTREE &target, std::vector<typename K::key_type> &keys) {
+  uint32 count = keys.size();
+  if (count > 0 && prefer_merge(count, target.count))
+    return btree_has_any_key<K>(target, keys, K::lower_bound(keys[0]));
+  for (uint32 i=0 ; i < count ; i++)
+    if (has_key<K>(target, keys[i]))
+      return true;
+  return false;
+}
+
+// Lookups in a dense column take constant time, so there's nothing to gain from merging
+template <typename K> bool has_any_key(DENSE_COLUMN &target, std::vector<uint32> &keys) {
+  uint32 count = keys.size();
+  for (uint32 i=0 ; i < count ; i++)
+    if (has_key<K>(target, keys[i]))
+      return true;
+  return false;
+}
+
+template <typename K> bool has_any_key(TERNARY_TABLE_ORDER &target, std::vector<typename K::key_type> &keys) {
+  uint32 count = keys.size();
+  if (prefer_merge(count, ternary_table_size(target.table)))
+    return ternary_table_order_has_any_key(&target, keys.data(), count);
+  for (uint32 i=0 ; i < count ; i++)
+    if (has_key<K>(target, keys[i]))
+      return true;
+  return false;
+}
+
+// Keys that are also among the deleted ones cannot cause a conflict. They're
+// removed with a linear merge of the two sorted vectors, and the remaining
+// ones are then looked up in the target, either by probing or by merging
+template <typename K, typename S>
+bool update_has_conflicts(std::vector<typename K::key_type> &inserted_keys, std::vector<typename K::key_type> &deleted_keys, S &target) {
+  std::vector<typename K::key_type> keys;
+  keys.reserve(inserted_keys.size());
+  std::set_difference(
+    inserted_keys.begin(), inserted_keys.end(),
+    deleted_keys.begin(), deleted_keys.end(),
+    std::back_inserter(keys)
+  );
+  return has_any_key<K>(target, keys);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
-template <typename K, typename T>
-bool table_updates_check_key(const std::vector<T> &inserts, const std::vector<T> &deletes, std::set<T> &target) {
+template <typename K, typename T, typename S>
+bool table_updates_check_key(const std::vector<T> &inserts, const std::vector<T> &deletes, S &target) {
   // Gathering and sorting all keys from tuples to delete
   std::vector<typename K::key_type> deleted_keys;
   take_keys<K>(deleted_keys, deletes);
@@ -188,3 +293,23 @@ bool table_updates_check_key(const std::vector<T> &inserts, const std::vector<T>
   // entry among the values to delete, or there's no entry in the current table
   return not update_has_conflicts<K>(inserted_keys, deleted_keys, target);
 }
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Applies the reference count changes collected for each column of a table,
+// with a single batch for all the columns that share the same value store
+inline void apply_column_ref_batches(VALUE_STORE **stores, std::vector<uint32> *surrs, uint32 columns_count, bool release) {
+  for (uint32 i=0 ; i < columns_count ; i++) {
+    for (uint32 j=i+1 ; j < columns_count ; j++)
+      if (stores[j] == stores[i]) {
+        surrs[i].insert(surrs[i].end(), surrs[j].begin(), surrs[j].end());
+        surrs[j].clear();
+      }
+    if (surrs[i].empty())
+      continue;
+    if (release)
+      value_store_release_batch(stores[i], surrs[i]);
+    else
+      value_store_add_ref_batch(stores[i], surrs[i]);
+  }
+}
@@ -1,13 +1,363 @@
 #include "lib.h"
+#include "btree.h"
+#include "hash-index.h"
+#include "degree-counts.h"
 #include "table-utils.h"
 
 
-void ternary_table_init(TERNARY_TABLE *table) {
+// Deleted rows and rows added since the last compaction are compacted once
+// they're more than MIN_BUFFERED_ROWS + BUFFERED_ROWS_FACTOR * sqrt(N), where
+// N is the number of rows in the main array of the primary index. The trade-off
+// is the same as with the delta buffers of binary tables
+const uint32 MIN_BUFFERED_ROWS    = 1024;
+const uint32 BUFFERED_ROWS_FACTOR = 8;
+
+const uint32 MIN_ROWS_CAPACITY = 64;
+
+// Sort order of the rows of a table, starting from column shift
+struct row_order {
+  const uint32 *major;
+  const uint32 *middle;
+  const uint32 *minor;
+
+  row_order(TERNARY_TABLE *table, uint32 shift) {
+    major = table->columns[shift];
+    middle = table->columns[(shift + 1) % 3];
+    minor = table->columns[(shift + 2) % 3];
+  }
+
+  tuple3 key(uint32 row) const {
+    tuple3 key;
+    build(key, major[row], middle[row], minor[row]);
+    return key;
+  }
+
+  bool operator () (uint32 row1, uint32 row2) const {
+    if (major[row1] != major[row2])
+      return major[row1] < major[row2];
+    if (middle[row1] != middle[row2])
+      return middle[row1] < middle[row2];
+    return minor[row1] < minor[row2];
+  }
+
+  bool operator () (uint32 row, const tuple3 &key) const {
+    return this->key(row) < key;
+  }
+};
+
+static bool is_deleted(TERNARY_TABLE *table, uint32 row) {
+  return (table->deleted_rows[row / 64] >> (row % 64)) & 1;
+}
+
+static uint32 *copy_rows(const std::vector<uint32> &rows) {
+  uint32 count = rows.size();
+  if (count == 0)
+    return NULL;
+  uint32 *copy = (uint32 *) malloc(count * sizeof(uint32));
+  memcpy(copy, rows.data(), count * sizeof(uint32));
+  return copy;
+}
+
+static bool uses_trees(TERNARY_TABLE *table) {
+  return table->backend == TABLE_BACKEND_BTREE;
+}
+
+// The fields of the triple, starting from column shift, which is how trees[shift] stores it
+static tuple3 rotate(const tuple3 &entry, uint32 shift) {
+  tuple3 rotated;
+  build(rotated, get_field(entry, shift), get_field(entry, (shift + 1) % 3), get_field(entry, (shift + 2) % 3));
+  return rotated;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void index_cleanup(TERNARY_TABLE_INDEX *index) {
+  free(index->main);
+  free(index->delta);
+  memset(index, 0, sizeof(TERNARY_TABLE_INDEX));
+}
+
+static void index_build(TERNARY_TABLE *table, uint32 shift) {
+  std::vector<uint32> rows;
+  rows.reserve(table->count);
+  for (uint32 i=0 ; i < table->rows_count ; i++)
+    if (!is_deleted(table, i))
+      rows.push_back(i);
+  parallel_sort(rows.data(), rows.data() + rows.size(), row_order(table, shift));
+
+  TERNARY_TABLE_INDEX *index = table->indexes + shift;
+  index_cleanup(index);
+  index->main = copy_rows(rows);
+  index->main_count = rows.size();
+  index->built = true;
+}
+
+static TERNARY_TABLE_INDEX *get_index(TERNARY_TABLE *table, uint32 shift) {
+  TERNARY_TABLE_INDEX *index = table->indexes + shift;
+  if (!index->built)
+    index_build(table, shift);
+  return index;
+}
+
+static void index_add_rows(TERNARY_TABLE *table, uint32 shift, std::vector<uint32> &rows) {
+  row_order order(table, shift);
+  std::sort(rows.begin(), rows.end(), order);
+
+  TERNARY_TABLE_INDEX *index = table->indexes + shift;
+  std::vector<uint32> merged;
+  merged.reserve(index->delta_count + rows.size());
+  std::merge(index->delta, index->delta + index->delta_count, rows.begin(), rows.end(), std::back_inserter(merged), order);
+
+  free(index->delta);
+  index->delta = copy_rows(merged);
+  index->delta_count = merged.size();
+}
+
+// Merges the delta array into the main one, dropping the deleted rows
+// and renumbering the others according to row_map
+static void index_compact(TERNARY_TABLE *table, uint32 shift, const uint32 *row_map) {
+  TERNARY_TABLE_INDEX *index = table->indexes + shift;
+  row_order order(table, shift);
+
+  uint32 *main = index->main;
+  uint32 *main_end = main + index->main_count;
+  uint32 *delta = index->delta;
+  uint32 *delta_end = delta + index->delta_count;
+
+  std::vector<uint32> merged;
+  merged.reserve(table->count);
+  for ( ; ; ) {
+    while (main != main_end && is_deleted(table, *main))
+      main++;
+    while (delta != delta_end && is_deleted(table, *delta))
+      delta++;
+    if (main == main_end && delta == delta_end)
+      break;
+    bool from_main = delta == delta_end || (main != main_end && order(*main, *delta));
+    uint32 row = from_main ? *main++ : *delta++;
+    merged.push_back(row_map[row]);
+  }
+  assert(merged.size() == table->count);
+
+  index_cleanup(index);
+  index->main = copy_rows(merged);
+  index->main_count = merged.size();
+  index->built = true;
+}
+
+static void compact(TERNARY_TABLE *table) {
+  uint32 rows_count = table->rows_count;
 
+  std::vector<uint32> row_map(rows_count);
+  uint32 next_row = 0;
+  for (uint32 i=0 ; i < rows_count ; i++)
+    row_map[i] = is_deleted(table, i) ? INVALID_INDEX : next_row++;
+  assert(next_row == table->count);
+
+  for (uint32 i=0 ; i < 3 ; i++)
+    if (table->indexes[i].built)
+      index_compact(table, i, row_map.data());
+
+  for (uint32 i=0 ; i < 3 ; i++) {
+    uint32 *column = table->columns[i];
+    for (uint32 j=0 ; j < rows_count ; j++)
+      if (row_map[j] != INVALID_INDEX)
+        column[row_map[j]] = column[j];
+  }
+
+  memset(table->deleted_rows, 0, ((rows_count + 63) / 64) * sizeof(uint64));
+  table->rows_count = next_row;
+  table->deleted_count = 0;
+}
+
+static uint32 append_row(TERNARY_TABLE *table, const tuple3 &entry) {
+  uint32 row = table->rows_count;
+  uint32 capacity = table->capacity;
+
+  if (row == capacity) {
+    uint32 new_capacity = capacity > 0 ? 2 * capacity : MIN_ROWS_CAPACITY;
+    for (uint32 i=0 ; i < 3 ; i++)
+      table->columns[i] = (uint32 *) realloc(table->columns[i], new_capacity * sizeof(uint32));
+    table->deleted_rows = (uint64 *) realloc(table->deleted_rows, (new_capacity / 64) * sizeof(uint64));
+    memset(table->deleted_rows + capacity / 64, 0, ((new_capacity - capacity) / 64) * sizeof(uint64));
+    table->capacity = new_capacity;
+  }
+
+  table->columns[0][row] = left(entry.fields01);
+  table->columns[1][row] = right(entry.fields01);
+  table->columns[2][row] = entry.field2;
+  table->rows_count++;
+  return row;
+}
+
+// Returns the row that contains the given triple, or INVALID_INDEX if there's none.
+// The delta array may contain several rows with the same fields, all but the
+// last one of them deleted, if the same triple was deleted and inserted again
+static uint32 find_row(TERNARY_TABLE *table, const tuple3 &entry) {
+  TERNARY_TABLE_INDEX *index = table->indexes;
+  row_order order(table, 0);
+
+  uint32 *main_end = index->main + index->main_count;
+  uint32 *it = std::lower_bound(index->main, main_end, entry, order);
+  if (it != main_end && order.key(*it) == entry && !is_deleted(table, *it))
+    return *it;
+
+  uint32 *delta_end = index->delta + index->delta_count;
+  for (it = std::lower_bound(index->delta, delta_end, entry, order) ; it != delta_end && order.key(*it) == entry ; it++)
+    if (!is_deleted(table, *it))
+      return *it;
+
+  return INVALID_INDEX;
+}
+
+static bool table_contains(TERNARY_TABLE *table, const tuple3 &entry) {
+  if (table->hash_index.slots != NULL)
+    return hash_index_contains(&table->hash_index, entry);
+  if (uses_trees(table))
+    return btree_contains(table->trees, entry);
+  return find_row(table, entry) != INVALID_INDEX;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void copy_tuples(TERNARY_TABLE *table, std::vector<tuple3> &tuples) {
+  tuples.clear();
+  tuples.reserve(table->count);
+  TERNARY_TABLE_ITER iter;
+  for (ternary_table_get_iter(table, &iter) ; !ternary_table_iter_is_out_of_range(&iter) ; ternary_table_iter_next(&iter)) {
+    tuple3 entry;
+    build(entry, ternary_table_iter_get_left_field(&iter), ternary_table_iter_get_middle_field(&iter), ternary_table_iter_get_right_field(&iter));
+    tuples.push_back(entry);
+  }
+}
+
+static void rebuild_hash_index(TERNARY_TABLE *table) {
+  HASH_INDEX *hash_index = &table->hash_index;
+  hash_index_reset<tuple3>(hash_index, table->count);
+  std::vector<tuple3> tuples;
+  copy_tuples(table, tuples);
+  for (uint32 i=0 ; i < tuples.size() ; i++)
+    hash_index_insert(hash_index, tuples[i]);
+}
+
+static void cleanup_storage(TERNARY_TABLE *table) {
+  for (uint32 i=0 ; i < 3 ; i++) {
+    free(table->columns[i]);
+    table->columns[i] = NULL;
+    index_cleanup(table->indexes + i);
+    btree_cleanup<tuple3>(table->trees + i);
+  }
+  free(table->deleted_rows);
+  table->deleted_rows = NULL;
+  table->rows_count = 0;
+  table->capacity = 0;
+  table->deleted_count = 0;
+  table->count = 0;
+  table->indexes[0].built = true;
+}
+
+// Fills an empty table with a sorted array of unique triples. The rows are stored
+// in sorted order, so the primary index is just the identity permutation, and
+// the other two are left to be built when needed. Each tree needs its own order
+static void build_storage(TERNARY_TABLE *table, const std::vector<tuple3> &tuples) {
+  assert(table->count == 0);
+  uint32 count = tuples.size();
+  table->count = count;
+
+  if (uses_trees(table)) {
+    btree_build(table->trees, tuples.data(), count);
+    std::vector<tuple3> rotated(count);
+    for (uint32 i=1 ; i < 3 ; i++) {
+      for (uint32 j=0 ; j < count ; j++)
+        rotated[j] = rotate(tuples[j], i);
+      parallel_sort(rotated.data(), rotated.data() + count, std::less<tuple3>());
+      btree_build(table->trees + i, rotated.data(), count);
+    }
+    return;
+  }
+
+  if (count == 0)
+    return;
+
+  uint32 capacity = count > MIN_ROWS_CAPACITY ? (count + 63) / 64 * 64 : MIN_ROWS_CAPACITY;
+  for (uint32 i=0 ; i < 3 ; i++)
+    table->columns[i] = (uint32 *) malloc(capacity * sizeof(uint32));
+  table->deleted_rows = (uint64 *) malloc((capacity / 64) * sizeof(uint64));
+  memset(table->deleted_rows, 0, (capacity / 64) * sizeof(uint64));
+  table->capacity = capacity;
+
+  TERNARY_TABLE_INDEX *index = table->indexes;
+  index->main = (uint32 *) malloc(count * sizeof(uint32));
+  index->main_count = count;
+
+  for (uint32 i=0 ; i < count ; i++) {
+    tuple3 entry = tuples[i];
+    table->columns[0][i] = left(entry.fields01);
+    table->columns[1][i] = right(entry.fields01);
+    table->columns[2][i] = entry.field2;
+    index->main[i] = i;
+  }
+
+  table->rows_count = count;
+}
+
+void ternary_table_init(TERNARY_TABLE *table) {
+  memset(table, 0, sizeof(TERNARY_TABLE));
+  for (uint32 i=0 ; i < 3 ; i++)
+    btree_init(table->trees + i);
+  table->indexes[0].built = true;
+  table->backend = TABLE_BACKEND_SORTED_ARRAYS;
 }
 
 void ternary_table_cleanup(TERNARY_TABLE *table) {
+  cleanup_storage(table);
+  hash_index_cleanup<tuple3>(&table->hash_index);
+  for (uint32 i=0 ; i < 3 ; i++)
+    degree_counts_cleanup(table->degrees + i);
+}
+
+// See binary_table_set_backend(). The only backends available
+// are TABLE_BACKEND_SORTED_ARRAYS and TABLE_BACKEND_BTREE
+void ternary_table_set_backend(TERNARY_TABLE *table, TABLE_BACKEND backend) {
+  assert(backend == TABLE_BACKEND_SORTED_ARRAYS || backend == TABLE_BACKEND_BTREE);
+  if (table->backend == backend)
+    return;
+
+  std::vector<tuple3> tuples;
+  copy_tuples(table, tuples);
 
+  cleanup_storage(table);
+  table->backend = backend;
+  build_storage(table, tuples);
+}
+
+// See binary_table_set_hash_index()
+void ternary_table_set_hash_index(TERNARY_TABLE *table, bool enabled) {
+  if (enabled && table->hash_index.slots == NULL)
+    rebuild_hash_index(table);
+  else if (!enabled)
+    hash_index_cleanup<tuple3>(&table->hash_index);
+}
+
+static void rebuild_degree_counts(TERNARY_TABLE *table) {
+  std::vector<tuple3> tuples;
+  copy_tuples(table, tuples);
+  for (uint32 i=0 ; i < 3 ; i++) {
+    DEGREE_COUNTS *degrees = table->degrees + i;
+    degree_counts_cleanup(degrees);
+    degrees->enabled = true;
+    for (uint32 j=0 ; j < tuples.size() ; j++)
+      degree_counts_increment(degrees, get_field(tuples[j], i));
+  }
+}
+
+// See binary_table_set_degree_counts()
+void ternary_table_set_degree_counts(TERNARY_TABLE *table, bool enabled) {
+  if (enabled && !table->degrees[0].enabled)
+    rebuild_degree_counts(table);
+  else if (!enabled)
+    for (uint32 i=0 ; i < 3 ; i++)
+      degree_counts_cleanup(table->degrees + i);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -23,40 +373,28 @@ void ternary_table_updates_cleanup(TERNARY_TABLE_UPDATES *updates) {
 
 ////////////////////////////////////////////////////////////////////////////////
 
+uint32 ternary_table_size(TERNARY_TABLE *table) {
+  return table->count;
+}
+
 bool ternary_table_contains(TERNARY_TABLE *table, uint32 left_val, uint32 middle_val, uint32 right_val) {
   tuple3 entry;
   build(entry, left_val, middle_val, right_val);
-
-  std::set<tuple3> &unshifted = table->unshifted;
-  std::set<tuple3>::iterator it = unshifted.find(entry);
-  return it != unshifted.end();
+  return table_contains(table, entry);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
 void ternary_table_delete_range_(TERNARY_TABLE_ITER *iter, TERNARY_TABLE_UPDATES *updates) {
-  int shift = iter->shift;
   std::vector<tuple3> &deletes = updates->deletes;
   while (!ternary_table_iter_is_out_of_range(iter)) {
-    if (shift == 0) {
-      deletes.push_back(*iter->iter);
-    }
-    else {
-      assert(shift == 1 || shift == 2);
-
-      uint64 fields01 = iter->iter->fields01;
-      uint32 field2 = iter->iter->field2;
-
-      tuple3 entry;
-
-      if (shift == 1)
-        build(entry, field2, left(fields01), right(fields01));
-      else
-        build(entry, right(fields01), field2, left(fields01));
-
-      deletes.push_back(entry);
-    }
-
+    tuple3 entry;
+    build(entry,
+      ternary_table_iter_get_left_field(iter),
+      ternary_table_iter_get_middle_field(iter),
+      ternary_table_iter_get_right_field(iter)
+    );
+    deletes.push_back(entry);
     ternary_table_iter_next(iter);
   }
 }
@@ -121,199 +459,432 @@ void ternary_table_insert(TERNARY_TABLE_UPDATES *updates, uint32 left_val, uint3
 
 ////////////////////////////////////////////////////////////////////////////////
 
-void ternary_table_updates_apply(TERNARY_TABLE *table, TERNARY_TABLE_UPDATES *updates, VALUE_STORE *vs0, VALUE_STORE *vs1, VALUE_STORE *vs2) {
-  std::set<tuple3> &unshifted = table->unshifted;
-  std::set<tuple3> &shifted_once = table->shifted_once;
-  std::set<tuple3> &shifted_twice = table->shifted_twice;
+static void tree_apply_tuples(TERNARY_TABLE *table, TERNARY_TABLE_UPDATES *updates) {
+  HASH_INDEX *hash_index = table->hash_index.slots != NULL ? &table->hash_index : NULL;
+
+  uint32 count = updates->deletes.size();
+  for (uint32 i=0 ; i < count ; i++) {
+    tuple3 entry = updates->deletes[i];
+    if (btree_erase(table->trees, entry)) {
+      btree_erase(table->trees + 1, rotate(entry, 1));
+      btree_erase(table->trees + 2, rotate(entry, 2));
+      if (hash_index != NULL)
+        hash_index_erase(hash_index, entry);
+    }
+    else
+      updates->deletes[i].fields01 = 0xFFFFFFFFFFFFFFFFULL;
+  }
+
+  count = updates->inserts.size();
+  for (uint32 i=0 ; i < count ; i++) {
+    tuple3 entry = updates->inserts[i];
+    if (btree_insert(table->trees, entry)) {
+      btree_insert(table->trees + 1, rotate(entry, 1));
+      btree_insert(table->trees + 2, rotate(entry, 2));
+      if (hash_index != NULL)
+        hash_index_insert(hash_index, entry);
+    }
+    else
+      updates->inserts[i].fields01 = 0xFFFFFFFFFFFFFFFFULL;
+  }
+
+  table->count = table->trees[0].count;
+}
+
+// See the binary table version
+static void apply_tuples(TERNARY_TABLE *table, TERNARY_TABLE_UPDATES *updates) {
+  if (uses_trees(table)) {
+    tree_apply_tuples(table, updates);
+    return;
+  }
+
+  HASH_INDEX *hash_index = table->hash_index.slots != NULL ? &table->hash_index : NULL;
 
   uint32 count = updates->deletes.size();
   if (count > 0) {
     tuple3 *deletes = &updates->deletes.front();
     for (uint32 i=0 ; i < count ; i++) {
       tuple3 entry = deletes[i];
-      if (unshifted.erase(entry) > 0) {
-        shift(entry);
-        shifted_once.erase(entry);
-        shift(entry);
-        shifted_twice.erase(entry);
+      uint32 row = hash_index == NULL || hash_index_contains(hash_index, entry) ? find_row(table, entry) : INVALID_INDEX;
+      if (row != INVALID_INDEX) {
+        table->deleted_rows[row / 64] |= 1ULL << (row % 64);
+        table->deleted_count++;
+        table->count--;
+        if (hash_index != NULL)
+          hash_index_erase(hash_index, entry);
       }
       else
         deletes[i].fields01 = 0xFFFFFFFFFFFFFFFFULL;
     }
   }
 
-  count = updates->inserts.size();
-  if (count > 0) {
-    tuple3 *inserts = &updates->inserts.front();
+  // The new rows are only added to the indexes at the end, so
+  // the duplicates have to be removed from the inserts first
+  std::vector<uint32> new_rows;
+  std::vector<tuple3> &inserts = updates->inserts;
+  if (!inserts.empty()) {
+    adaptive_sort(inserts.data(), inserts.data() + inserts.size(), std::less<tuple3>());
+    inserts.erase(std::unique(inserts.begin(), inserts.end()), inserts.end());
+
+    count = inserts.size();
     for (uint32 i=0 ; i < count ; i++) {
       tuple3 entry = inserts[i];
-      if (unshifted.insert(entry).second) {
-        value_store_add_ref(vs0, left(entry.fields01));
-        value_store_add_ref(vs1, right(entry.fields01));
-        value_store_add_ref(vs2, entry.field2);
-        shift(entry);
-        shifted_once.insert(entry);
-        shift(entry);
-        shifted_twice.insert(entry);
+      if (!table_contains(table, entry)) {
+        new_rows.push_back(append_row(table, entry));
+        table->count++;
+        if (hash_index != NULL)
+          hash_index_insert(hash_index, entry);
       }
+      else
+        inserts[i].fields01 = 0xFFFFFFFFFFFFFFFFULL;
     }
   }
+
+  if (!new_rows.empty())
+    for (uint32 i=0 ; i < 3 ; i++)
+      if (table->indexes[i].built)
+        index_add_rows(table, i, new_rows);
+
+  uint32 buffered = table->deleted_count + table->indexes[0].delta_count;
+  if (buffered > MIN_BUFFERED_ROWS + BUFFERED_ROWS_FACTOR * sqrt((double) table->indexes[0].main_count))
+    compact(table);
 }
 
-void ternary_table_updates_finish(TERNARY_TABLE_UPDATES *updates, VALUE_STORE *vs0, VALUE_STORE *vs1, VALUE_STORE *vs2) {
-  uint32 count = updates->deletes.size();
-  if (count > 0) {
-    tuple3 *deletes = &updates->deletes.front();
-    for (uint32 i=0 ; i < count ; i++) {
-      tuple3 entry = deletes[i];
-      if (entry.fields01 != 0xFFFFFFFFFFFFFFFFULL) {
-        value_store_release(vs0, left(entry.fields01));
-        value_store_release(vs1, right(entry.fields01));
-        value_store_release(vs2, entry.field2);
-      }
+static void update_degree_counts(TERNARY_TABLE *table, TERNARY_TABLE_UPDATES *updates) {
+  for (uint32 i=0 ; i < 3 ; i++) {
+    DEGREE_COUNTS *degrees = table->degrees + i;
+    for (uint32 j=0 ; j < updates->deletes.size() ; j++) {
+      tuple3 entry = updates->deletes[j];
+      if (entry.fields01 != 0xFFFFFFFFFFFFFFFFULL)
+        degree_counts_decrement(degrees, get_field(entry, i));
+    }
+    for (uint32 j=0 ; j < updates->inserts.size() ; j++) {
+      tuple3 entry = updates->inserts[j];
+      if (entry.fields01 != 0xFFFFFFFFFFFFFFFFULL)
+        degree_counts_increment(degrees, get_field(entry, i));
     }
   }
 }
 
+void ternary_table_updates_apply_tuples(TERNARY_TABLE *table, TERNARY_TABLE_UPDATES *updates) {
+  apply_tuples(table, updates);
+  if (table->degrees[0].enabled)
+    update_degree_counts(table, updates);
+}
+
+static void collect_column(const std::vector<tuple3> &tuples, uint32 column, std::vector<uint32> &surrs) {
+  assert(column < 3);
+  uint32 count = tuples.size();
+  for (uint32 i=0 ; i < count ; i++) {
+    tuple3 entry = tuples[i];
+    if (entry.fields01 != 0xFFFFFFFFFFFFFFFFULL)
+      surrs.push_back(get_field(entry, column));
+  }
+}
+
+void ternary_table_updates_collect_inserted(TERNARY_TABLE_UPDATES *updates, uint32 column, std::vector<uint32> &surrs) {
+  collect_column(updates->inserts, column, surrs);
+}
+
+void ternary_table_updates_collect_deleted(TERNARY_TABLE_UPDATES *updates, uint32 column, std::vector<uint32> &surrs) {
+  collect_column(updates->deletes, column, surrs);
+}
+
+void ternary_table_updates_apply(TERNARY_TABLE *table, TERNARY_TABLE_UPDATES *updates, VALUE_STORE *vs0, VALUE_STORE *vs1, VALUE_STORE *vs2) {
+  ternary_table_updates_apply_tuples(table, updates);
+  VALUE_STORE *stores[3] = {vs0, vs1, vs2};
+  std::vector<uint32> surrs[3];
+  for (uint32 i=0 ; i < 3 ; i++)
+    ternary_table_updates_collect_inserted(updates, i, surrs[i]);
+  apply_column_ref_batches(stores, surrs, 3, false);
+}
+
+void ternary_table_updates_finish(TERNARY_TABLE_UPDATES *updates, VALUE_STORE *vs0, VALUE_STORE *vs1, VALUE_STORE *vs2) {
+  VALUE_STORE *stores[3] = {vs0, vs1, vs2};
+  std::vector<uint32> surrs[3];
+  for (uint32 i=0 ; i < 3 ; i++)
+    ternary_table_updates_collect_deleted(updates, i, surrs[i]);
+  apply_column_ref_batches(stores, surrs, 3, true);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
-void ternary_table_get_iter_by_cols_01(TERNARY_TABLE *table, TERNARY_TABLE_ITER *iter, uint32 value0, uint32 value1) {
-  std::set<tuple3> &target = table->unshifted;
+void ternary_table_bulk_load(TERNARY_TABLE *table, TERNARY_TABLE_UPDATES *updates, VALUE_STORE *vs0, VALUE_STORE *vs1, VALUE_STORE *vs2) {
+  assert(table->count == 0 && updates->deletes.empty());
+
+  std::vector<tuple3> &tuples = updates->inserts;
+  parallel_sort(tuples.data(), tuples.data() + tuples.size(), std::less<tuple3>());
+  tuples.erase(std::unique(tuples.begin(), tuples.end()), tuples.end());
+  uint32 count = tuples.size();
+
+  cleanup_storage(table);
+  build_storage(table, tuples);
+
+  if (table->hash_index.slots != NULL)
+    rebuild_hash_index(table);
+  if (table->degrees[0].enabled)
+    rebuild_degree_counts(table);
+
+  VALUE_STORE *stores[3] = {vs0, vs1, vs2};
+  for (uint32 i=0 ; i < 3 ; i++)
+    if (stores[i] != NULL) {
+      std::vector<uint32> surrs(count);
+      for (uint32 j=0 ; j < count ; j++)
+        surrs[j] = get_field(tuples[j], i);
+      value_store_add_ref_batch(stores[i], surrs);
+    }
+
+  tuples.clear();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Moves the iterator to the first row that has not been deleted
+static void iter_settle(TERNARY_TABLE_ITER *iter) {
+  TERNARY_TABLE *table = iter->table;
+  while (iter->main != iter->main_end && is_deleted(table, *iter->main))
+    iter->main++;
+  while (iter->delta != iter->delta_end && is_deleted(table, *iter->delta))
+    iter->delta++;
+
+  if (iter->main == iter->main_end)
+    iter->row = iter->delta != iter->delta_end ? *iter->delta : INVALID_INDEX;
+  else if (iter->delta == iter->delta_end)
+    iter->row = *iter->main;
+  else
+    iter->row = row_order(table, iter->shift)(*iter->main, *iter->delta) ? *iter->main : *iter->delta;
+}
+
+static void get_iter(TERNARY_TABLE *table, TERNARY_TABLE_ITER *iter, uint32 shift, uint32 value0, uint32 value1, uint64 excl_upper_bound) {
   tuple3 lb;
   build(lb, value0, value1, 0);
-  iter->iter = target.lower_bound(lb);
-  iter->end = target.end();
-  iter->excl_upper_bound = pack(value0, value1+1);
-  iter->shift = 0;
+
+  iter->table = table;
+
+  if (uses_trees(table)) {
+    btree_seek(table->trees + shift, lb, iter->curr, iter->end, iter->leaf);
+    iter->main = iter->main_end = iter->delta = iter->delta_end = NULL;
+    iter->row = INVALID_INDEX;
+    iter->excl_upper_bound = excl_upper_bound;
+    iter->shift = shift;
+    return;
+  }
+
+  TERNARY_TABLE_INDEX *index = get_index(table, shift);
+  row_order order(table, shift);
+
+  iter->curr = iter->end = NULL;
+  iter->leaf = NULL;
+  iter->main_end = index->main + index->main_count;
+  iter->main = std::lower_bound(index->main, iter->main_end, lb, order);
+  iter->delta_end = index->delta + index->delta_count;
+  iter->delta = std::lower_bound(index->delta, iter->delta_end, lb, order);
+  iter->excl_upper_bound = excl_upper_bound;
+  iter->shift = shift;
+  iter_settle(iter);
+}
+
+void ternary_table_get_iter_by_cols_01(TERNARY_TABLE *table, TERNARY_TABLE_ITER *iter, uint32 value0, uint32 value1) {
+  get_iter(table, iter, 0, value0, value1, pack(value0, value1+1));
 }
 
 void ternary_table_get_iter_by_cols_02(TERNARY_TABLE *table, TERNARY_TABLE_ITER *iter, uint32 value0, uint32 value2) {
-  std::set<tuple3> &target = table->shifted_twice;
-  tuple3 lb;
-  build(lb, value2, value0, 0);
-  iter->iter = target.lower_bound(lb);
-  iter->end = target.end();
-  iter->excl_upper_bound = pack(value2, value0+1);
-  iter->shift = 2;
+  get_iter(table, iter, 2, value2, value0, pack(value2, value0+1));
 }
 
 void ternary_table_get_iter_by_cols_12(TERNARY_TABLE *table, TERNARY_TABLE_ITER *iter, uint32 value1, uint32 value2) {
-  std::set<tuple3> &target = table->shifted_once;
-  tuple3 lb;
-  build(lb, value1, value2, 0);
-  iter->iter = target.lower_bound(lb);
-  iter->end = target.end();
-  iter->excl_upper_bound = pack(value1, value2+1);
-  iter->shift = 1;
+  get_iter(table, iter, 1, value1, value2, pack(value1, value2+1));
 }
 
 void ternary_table_get_iter_by_col_0(TERNARY_TABLE *table, TERNARY_TABLE_ITER *iter, uint32 value) {
-  std::set<tuple3> &target = table->unshifted;
-  tuple3 lb;
-  build(lb, value, 0, 0);
-  iter->iter = target.lower_bound(lb);
-  iter->end = target.end();
-  iter->excl_upper_bound = pack(value+1, 0);
-  iter->shift = 0;
+  get_iter(table, iter, 0, value, 0, pack(value+1, 0));
 }
 
 void ternary_table_get_iter_by_col_1(TERNARY_TABLE *table, TERNARY_TABLE_ITER *iter, uint32 value) {
-  std::set<tuple3> &target = table->shifted_once;
-  tuple3 lb;
-  build(lb, value, 0, 0);
-  iter->iter = target.lower_bound(lb);
-  iter->end = target.end();
-  iter->excl_upper_bound = pack(value+1, 0);
-  iter->shift = 1;
+  get_iter(table, iter, 1, value, 0, pack(value+1, 0));
 }
 
 void ternary_table_get_iter_by_col_2(TERNARY_TABLE *table, TERNARY_TABLE_ITER *iter, uint32 value) {
-  std::set<tuple3> &target = table->shifted_twice;
-  tuple3 lb;
-  build(lb, value, 0, 0);
-  iter->iter = target.lower_bound(lb);
-  iter->end = target.end();
-  iter->excl_upper_bound = pack(value+1, 0);
-  iter->shift = 2;
+  get_iter(table, iter, 2, value, 0, pack(value+1, 0));
 }
 
 void ternary_table_get_iter(TERNARY_TABLE *table, TERNARY_TABLE_ITER *iter) {
-  std::set<tuple3> &target = table->unshifted;
-  iter->iter = target.begin();
-  iter->end = target.end();
-  iter->excl_upper_bound = 0xFFFFFFFFFFFFFFFFULL;
-  iter->shift = 0;
+  get_iter(table, iter, 0, 0, 0, 0xFFFFFFFFFFFFFFFFULL);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
+// The fields of the current triple, starting from column iter->shift
+static tuple3 iter_key(TERNARY_TABLE_ITER *iter) {
+  if (uses_trees(iter->table))
+    return *iter->curr;
+  return row_order(iter->table, iter->shift).key(iter->row);
+}
+
+static uint32 iter_field(TERNARY_TABLE_ITER *iter, uint32 column) {
+  if (uses_trees(iter->table))
+    return get_field(*iter->curr, (column + 3 - iter->shift) % 3);
+  return iter->table->columns[column][iter->row];
+}
+
 bool ternary_table_iter_is_out_of_range(TERNARY_TABLE_ITER *iter) {
-  std::set<tuple3>::iterator it = iter->iter;
-  return it == iter->end || it->fields01 >= iter->excl_upper_bound;
+  if (uses_trees(iter->table))
+    return iter->curr == iter->end || iter->curr->fields01 >= iter->excl_upper_bound;
+  uint32 row = iter->row;
+  if (row == INVALID_INDEX)
+    return true;
+  uint32 shift = iter->shift;
+  uint32 **columns = iter->table->columns;
+  return pack(columns[shift][row], columns[(shift + 1) % 3][row]) >= iter->excl_upper_bound;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
 uint32 ternary_table_iter_get_left_field(TERNARY_TABLE_ITER *iter) {
-  uint8 shift = iter->shift;
-  assert(shift >= 0 && shift <= 2);
-  if (shift == 0)
-    return left(iter->iter->fields01);
-  else if (shift == 1)
-    return iter->iter->field2;
-  else
-    return right(iter->iter->fields01);
+  return iter_field(iter, 0);
 }
 
 uint32 ternary_table_iter_get_middle_field(TERNARY_TABLE_ITER *iter) {
-  uint8 shift = iter->shift;
-  assert(shift >= 0 && shift <= 2);
-  if (shift == 0)
-    return right(iter->iter->fields01);
-  else if (shift == 1)
-    return left(iter->iter->fields01);
-  else
-    return iter->iter->field2;
+  return iter_field(iter, 1);
 }
 
 uint32 ternary_table_iter_get_right_field(TERNARY_TABLE_ITER *iter) {
-  uint8 shift = iter->shift;
-  assert(shift >= 0 && shift <= 2);
-  if (shift == 0)
-    return iter->iter->field2;
-  else if (shift == 1)
-    return right(iter->iter->fields01);
-  else
-    return left(iter->iter->fields01);
+  return iter_field(iter, 2);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
 void ternary_table_iter_next(TERNARY_TABLE_ITER *iter) {
   assert(!ternary_table_iter_is_out_of_range(iter));
-  iter->iter++;
+  if (uses_trees(iter->table)) {
+    btree_cursor_next(iter->curr, iter->end, iter->leaf);
+    return;
+  }
+  if (iter->main != iter->main_end && *iter->main == iter->row)
+    iter->main++;
+  else
+    iter->delta++;
+  iter_settle(iter);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+uint32 ternary_table_degree(TERNARY_TABLE *table, uint32 column, uint32 value) {
+  assert(column < 3);
+  if (table->degrees[column].enabled)
+    return degree_counts_get(table->degrees + column, value);
+
+  uint32 count = 0;
+  TERNARY_TABLE_ITER iter;
+  for (get_iter(table, &iter, column, value, 0, pack(value+1, 0)) ; !ternary_table_iter_is_out_of_range(&iter) ; ternary_table_iter_next(&iter))
+    count++;
+  return count;
+}
+
+// Walks the table in the order of the index that starts with the given column,
+// so that equal values are consecutive. Returns the number of distinct values
+// and sets is_key to whether none of them appears more than once
+static uint32 scan_column(TERNARY_TABLE *table, uint32 column, bool &is_key) {
+  uint32 distinct_count = 0;
+  uint32 last_value = 0;
+  is_key = true;
+  TERNARY_TABLE_ITER iter;
+  for (get_iter(table, &iter, column, 0, 0, 0xFFFFFFFFFFFFFFFFULL) ; !ternary_table_iter_is_out_of_range(&iter) ; ternary_table_iter_next(&iter)) {
+    uint32 value = iter_field(&iter, column);
+    if (distinct_count == 0 || value != last_value)
+      distinct_count++;
+    else
+      is_key = false;
+    last_value = value;
+  }
+  return distinct_count;
+}
+
+uint32 ternary_table_distinct_count(TERNARY_TABLE *table, uint32 column) {
+  assert(column < 3);
+  if (table->degrees[column].enabled)
+    return table->degrees[column].distinct_count;
+  bool is_key;
+  return scan_column(table, column, is_key);
+}
+
+bool ternary_table_col_is_key(TERNARY_TABLE *table, uint32 column) {
+  assert(column < 3);
+  if (table->degrees[column].enabled)
+    return table->degrees[column].repeated_count == 0;
+  bool is_key;
+  scan_column(table, column, is_key);
+  return is_key;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
+bool ternary_table_order_lower_bound(TERNARY_TABLE_ORDER *order, tuple3 lower_bound, tuple3 *first) {
+  TERNARY_TABLE_ITER iter;
+  get_iter(order->table, &iter, order->shift, left(lower_bound.fields01), right(lower_bound.fields01), 0xFFFFFFFFFFFFFFFFULL);
+  // Skipping the rows that share the first two fields of the lower bound but are below it
+  while (!ternary_table_iter_is_out_of_range(&iter) && iter_key(&iter) < lower_bound)
+    ternary_table_iter_next(&iter);
+  if (ternary_table_iter_is_out_of_range(&iter))
+    return false;
+  *first = iter_key(&iter);
+  return true;
+}
+
+// Keys are made of either the first column of the order or the first
+// two, packed together, which is what key_shift is for. Only the range
+// of the index between the first and the last key is visited, once
+template <typename T> static bool order_has_any_key(TERNARY_TABLE_ORDER *order, const T *keys, uint32 count, uint32 key_shift) {
+  if (count == 0)
+    return false;
+
+  uint64 first_key = (uint64) keys[0] << key_shift;
+  TERNARY_TABLE_ITER iter;
+  get_iter(order->table, &iter, order->shift, left(first_key), right(first_key), 0xFFFFFFFFFFFFFFFFULL);
+
+  uint32 idx = 0;
+  while (idx < count && !ternary_table_iter_is_out_of_range(&iter)) {
+    T key = iter_key(&iter).fields01 >> key_shift;
+    if (key == keys[idx])
+      return true;
+    if (key < keys[idx])
+      ternary_table_iter_next(&iter);
+    else
+      idx++;
+  }
+  return false;
+}
+
+bool ternary_table_order_has_any_key(TERNARY_TABLE_ORDER *order, const uint32 *keys, uint32 count) {
+  return order_has_any_key(order, keys, count, 32);
+}
+
+bool ternary_table_order_has_any_key(TERNARY_TABLE_ORDER *order, const uint64 *keys, uint32 count) {
+  return order_has_any_key(order, keys, count, 0);
+}
+
+template <typename K> static bool check_key(TERNARY_TABLE *table, TERNARY_TABLE_UPDATES *updates, uint32 shift) {
+  TERNARY_TABLE_ORDER order;
+  order.table = table;
+  order.shift = shift;
+  return table_updates_check_key<K>(updates->inserts, updates->deletes, order);
+}
+
 bool ternary_table_updates_check_01(TERNARY_TABLE *table, TERNARY_TABLE_UPDATES *updates) {
   sort_unique(updates->inserts);
-  return table_updates_check_key<cols_01>(updates->inserts, updates->deletes, table->unshifted);
+  return check_key<cols_01>(table, updates, 0);
 }
 
 bool ternary_table_updates_check_01_2(TERNARY_TABLE *table, TERNARY_TABLE_UPDATES *updates) {
-  return ternary_table_updates_check_01(table, updates) &&
-    table_updates_check_key<col_2>(updates->inserts, updates->deletes, table->shifted_twice);
+  return ternary_table_updates_check_01(table, updates) && check_key<col_2>(table, updates, 2);
 }
 
 bool ternary_table_updates_check_01_12(TERNARY_TABLE *table, TERNARY_TABLE_UPDATES *updates) {
-  return ternary_table_updates_check_01(table, updates) &&
-    table_updates_check_key<cols_12>(updates->inserts, updates->deletes, table->shifted_once);
+  return ternary_table_updates_check_01(table, updates) && check_key<cols_12>(table, updates, 1);
 }
 
 bool ternary_table_updates_check_01_12_20(TERNARY_TABLE *table, TERNARY_TABLE_UPDATES *updates) {
-  return ternary_table_updates_check_01_12(table, updates) &&
-    table_updates_check_key<cols_20>(updates->inserts, updates->deletes, table->shifted_twice);
+  return ternary_table_updates_check_01_12(table, updates) && check_key<cols_20>(table, updates, 2);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -323,8 +894,7 @@ OBJ copy_ternary_table(TERNARY_TABLE *table, VALUE_STORE *vs1, VALUE_STORE *vs2,
   OBJ *slots2 = value_store_slot_array(vs2);
   OBJ *slots3 = value_store_slot_array(vs3);
 
-  std::set<tuple3> &rows = table->unshifted;
-  uint32 size = rows.size();
+  uint32 size = ternary_table_size(table);
 
   if (size == 0)
     return make_empty_rel();
@@ -334,11 +904,11 @@ OBJ copy_ternary_table(TERNARY_TABLE *table, VALUE_STORE *vs1, VALUE_STORE *vs2,
   OBJ *col3 = col2 + size;
 
   uint32 idx = 0;
-  for (std::set<tuple3>::iterator it=rows.begin() ; it != rows.end() ; it++) {
-    tuple3 row = *it;
-    col1[idx] = slots1[left(row.fields01)];
-    col2[idx] = slots2[right(row.fields01)];
-    col3[idx++] = slots3[row.field2];
+  TERNARY_TABLE_ITER iter;
+  for (ternary_table_get_iter(table, &iter) ; !ternary_table_iter_is_out_of_range(&iter) ; ternary_table_iter_next(&iter)) {
+    col1[idx] = slots1[ternary_table_iter_get_left_field(&iter)];
+    col2[idx] = slots2[ternary_table_iter_get_middle_field(&iter)];
+    col3[idx++] = slots3[ternary_table_iter_get_right_field(&iter)];
   }
   assert(idx == size);
 
@@ -375,28 +945,71 @@ void set_ternary_table(
   OBJ *col2 = get_col_array_ptr(ptr, idx2);
   OBJ *col3 = get_col_array_ptr(ptr, idx3);
 
-  for (uint32 i=0 ; i < size ; i++) {
-    OBJ obj = col1[i];
-    uint32 ref1 = lookup_value_ex(vs1, vsu1, obj);
-    if (ref1 == -1) {
-      add_ref(obj);
-      ref1 = value_store_insert(vs1, vsu1, obj);
-    }
+  uint32 refs1[LOAD_CHUNK_SIZE];
+  uint32 refs2[LOAD_CHUNK_SIZE];
+  uint32 refs3[LOAD_CHUNK_SIZE];
+
+  for (uint32 i=0 ; i < size ; i += LOAD_CHUNK_SIZE) {
+    uint32 count = size - i < LOAD_CHUNK_SIZE ? size - i : LOAD_CHUNK_SIZE;
+    lookup_or_insert_values(vs1, vsu1, col1 + i, count, refs1);
+    lookup_or_insert_values(vs2, vsu2, col2 + i, count, refs2);
+    lookup_or_insert_values(vs3, vsu3, col3 + i, count, refs3);
+    for (uint32 j=0 ; j < count ; j++)
+      ternary_table_insert(updates, refs1[j], refs2[j], refs3[j]);
+  }
+}
 
-    obj = col2[i];
-    uint32 ref2 = lookup_value_ex(vs2, vsu2, obj);
-    if (ref2 == -1) {
-      add_ref(obj);
-      ref2 = value_store_insert(vs2, vsu2, obj);
-    }
+////////////////////////////////////////////////////////////////////////////////
 
-    obj = col3[i];
-    uint32 ref3 = lookup_value_ex(vs3, vsu3, obj);
-    if (ref3 == -1) {
-      add_ref(obj);
-      ref3 = value_store_insert(vs3, vsu3, obj);
+// Rebuilds the tree from scratch, since the separator keys in the inner nodes
+// may belong to triples that have been deleted. See binary-table.cpp
+static void tree_remap(BTREE *tree, uint32 shift, const uint32 **maps) {
+  std::vector<tuple3> tuples;
+  btree_copy_keys(tree, tuples);
+  for (uint32 i=0 ; i < tuples.size() ; i++) {
+    uint32 fields[3];
+    for (uint32 j=0 ; j < 3 ; j++) {
+      const uint32 *map = maps[(shift + j) % 3];
+      fields[j] = get_field(tuples[i], j);
+      if (map != NULL)
+        fields[j] = map[fields[j]];
+      assert(fields[j] != INVALID_INDEX);
     }
+    build(tuples[i], fields[0], fields[1], fields[2]);
+  }
+  assert(std::is_sorted(tuples.begin(), tuples.end()));
+  btree_cleanup<tuple3>(tree);
+  btree_build(tree, tuples.data(), tuples.size());
+}
 
-    ternary_table_insert(updates, ref1, ref2, ref3);
+// Surrogate maps produced by value_store_compact() preserve the relative order
+// of the values, so the indexes stay sorted and only the columns need updating.
+// Deleted rows may refer to values that are no longer mapped, so they're dropped first
+void ternary_table_remap(TERNARY_TABLE *table, const uint32 *surr_map_0, const uint32 *surr_map_1, const uint32 *surr_map_2) {
+  const uint32 *maps[3] = {surr_map_0, surr_map_1, surr_map_2};
+
+  if (uses_trees(table)) {
+    for (uint32 i=0 ; i < 3 ; i++)
+      tree_remap(table->trees + i, i, maps);
+  }
+  else {
+    compact(table);
+    for (uint32 i=0 ; i < 3 ; i++) {
+      const uint32 *map = maps[i];
+      if (map != NULL) {
+        uint32 *column = table->columns[i];
+        for (uint32 j=0 ; j < table->rows_count ; j++) {
+          column[j] = map[column[j]];
+          assert(column[j] != INVALID_INDEX);
+        }
+      }
+    }
   }
+
+  if (table->hash_index.slots != NULL)
+    rebuild_hash_index(table);
+
+  for (uint32 i=0 ; i < 3 ; i++)
+    if (table->degrees[i].enabled && maps[i] != NULL)
+      degree_counts_remap(table->degrees + i, maps[i]);
 }
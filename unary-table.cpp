@@ -1,17 +1,746 @@
 #include "lib.h"
+#include "table-utils.h"
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+  #define UNARY_TABLE_USE_SSE2
+  #include <emmintrin.h>
+#endif
+
+#ifdef _MSC_VER
+  #include <intrin.h>
+#endif
+
+
+// A unary table has two possible representations. The default one is a flat
+// bitmap indexed by surrogate, which grows to accommodate the largest value.
+// When the values are sparse that can waste a lot of memory, so the table is
+// then compressed, roaring-style: the values are partitioned by their upper
+// 16 bits, and each non-empty partition is stored in a container which is
+// either a sorted array of the lower 16 bits (for up to MAX_ARRAY_COUNT
+// values), a bitmap of 65536 bits, or a sorted array of runs of consecutive
+// values, whichever takes the least memory.
+//
+// The representation is chosen again at the end of every call to
+// unary_table_updates_apply(): the flat bitmap is used unless it's large and
+// it takes several times the memory the compressed table would need. There's
+// some hysteresis in the choice, so that a table doesn't keep switching back
+// and forth between the two representations.
+//
+// Containers modified during an update are marked as dirty, and their
+// representation is only optimized at the end of the update. Run containers
+// are expanded into bitmaps before being modified.
+
+const uint32 INIT_SIZE = 1024;
+
+const uint8 CONTAINER_ARRAY   = 0;
+const uint8 CONTAINER_BITMAP  = 1;
+const uint8 CONTAINER_RUNS    = 2;
+
+const uint32 MAX_ARRAY_COUNT  = 4096;
+const uint32 BITMAP_WORDS     = UNARY_CHUNK_WORDS;
+
+// Tables whose flat bitmap is smaller than this are never compressed
+const uint32 MIN_COMPRESSED_FLAT_BYTES = 64 * 1024;
+// A flat table is compressed when its bitmap takes more than COMPRESS_RATIO
+// times the memory of the compressed representation, and a compressed table
+// is expanded when the bitmap would take less than EXPAND_RATIO times as much
+const uint32 COMPRESS_RATIO   = 8;
+const uint32 EXPAND_RATIO     = 2;
+
+
+static inline uint32 count_trailing_zeros_64(uint64 word) {
+  assert(word != 0);
+#ifdef _MSC_VER
+  unsigned long idx;
+  _BitScanForward64(&idx, word);
+  return idx;
+#else
+  return __builtin_ctzll(word);
+#endif
+}
+
+static inline uint32 popcount_64(uint64 word) {
+#ifdef _MSC_VER
+  return (uint32) __popcnt64(word);
+#else
+  return __builtin_popcountll(word);
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void set_bit_range(uint64 *words, uint32 first, uint32 last) {
+  uint32 first_word = first / 64;
+  uint32 last_word = last / 64;
+  uint64 first_mask = ~0ULL << (first % 64);
+  uint64 last_mask = ~0ULL >> (63 - last % 64);
+  if (first_word == last_word) {
+    words[first_word] |= first_mask & last_mask;
+  }
+  else {
+    words[first_word] |= first_mask;
+    for (uint32 i=first_word+1 ; i < last_word ; i++)
+      words[i] = ~0ULL;
+    words[last_word] |= last_mask;
+  }
+}
+
+// Runs are stored as (start, length - 1) pairs
+static inline uint32 run_start(uint16 *runs, uint32 idx) {
+  return runs[2 * idx];
+}
+
+static inline uint32 run_last(uint16 *runs, uint32 idx) {
+  return runs[2 * idx] + runs[2 * idx + 1];
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void container_init(UNARY_CONTAINER *container, uint32 key) {
+  container->data = NULL;
+  container->key = key;
+  container->count = 0;
+  container->length = 0;
+  container->capacity = 0;
+  container->type = CONTAINER_ARRAY;
+  container->dirty = false;
+}
+
+static void container_cleanup(UNARY_CONTAINER *container) {
+  free(container->data);
+}
+
+static uint32 container_footprint(UNARY_CONTAINER *container) {
+  uint32 type = container->type;
+  if (type == CONTAINER_BITMAP)
+    return BITMAP_WORDS * sizeof(uint64);
+  else if (type == CONTAINER_ARRAY)
+    return container->capacity * sizeof(uint16);
+  else
+    return container->capacity * 2 * sizeof(uint16);
+}
+
+// Sets the bits of all the values in the container
+static void container_or_words(UNARY_CONTAINER *container, uint64 *words) {
+  uint32 type = container->type;
+  if (type == CONTAINER_BITMAP) {
+    uint64 *bitmap = (uint64 *) container->data;
+    for (uint32 i=0 ; i < BITMAP_WORDS ; i++)
+      words[i] |= bitmap[i];
+  }
+  else if (type == CONTAINER_ARRAY) {
+    uint16 *array = (uint16 *) container->data;
+    uint32 length = container->length;
+    for (uint32 i=0 ; i < length ; i++)
+      words[array[i] / 64] |= 1ULL << (array[i] % 64);
+  }
+  else {
+    uint16 *runs = (uint16 *) container->data;
+    uint32 length = container->length;
+    for (uint32 i=0 ; i < length ; i++)
+      set_bit_range(words, run_start(runs, i), run_last(runs, i));
+  }
+}
+
+// Writes all the values in the container, in order
+static void container_extract(UNARY_CONTAINER *container, uint16 *dest) {
+  uint32 type = container->type;
+  if (type == CONTAINER_BITMAP) {
+    uint64 *bitmap = (uint64 *) container->data;
+    uint32 idx = 0;
+    for (uint32 i=0 ; i < BITMAP_WORDS ; i++)
+      for (uint64 word = bitmap[i] ; word != 0 ; word &= word - 1)
+        dest[idx++] = 64 * i + count_trailing_zeros_64(word);
+    assert(idx == container->count);
+  }
+  else if (type == CONTAINER_ARRAY) {
+    memcpy(dest, container->data, container->length * sizeof(uint16));
+  }
+  else {
+    uint16 *runs = (uint16 *) container->data;
+    uint32 length = container->length;
+    uint32 idx = 0;
+    for (uint32 i=0 ; i < length ; i++) {
+      uint32 last = run_last(runs, i);
+      for (uint32 value = run_start(runs, i) ; value <= last ; value++)
+        dest[idx++] = value;
+    }
+    assert(idx == container->count);
+  }
+}
+
+static uint32 container_count_runs(UNARY_CONTAINER *container) {
+  uint32 type = container->type;
+  if (type == CONTAINER_BITMAP) {
+    uint64 *bitmap = (uint64 *) container->data;
+    uint32 runs = 0;
+    uint64 carry = 0;
+    for (uint32 i=0 ; i < BITMAP_WORDS ; i++) {
+      uint64 word = bitmap[i];
+      // A run starts at every set bit whose predecessor is not set
+      runs += popcount_64(word & ~((word << 1) | carry));
+      carry = word >> 63;
+    }
+    return runs;
+  }
+  else if (type == CONTAINER_ARRAY) {
+    uint16 *array = (uint16 *) container->data;
+    uint32 length = container->length;
+    uint32 runs = 0;
+    for (uint32 i=0 ; i < length ; i++)
+      if (i == 0 || array[i] != array[i-1] + 1)
+        runs++;
+    return runs;
+  }
+  else
+    return container->length;
+}
+
+static void container_to_bitmap(UNARY_CONTAINER *container) {
+  if (container->type == CONTAINER_BITMAP)
+    return;
+  uint64 *words = (uint64 *) malloc(BITMAP_WORDS * sizeof(uint64));
+  memset(words, 0, BITMAP_WORDS * sizeof(uint64));
+  container_or_words(container, words);
+  free(container->data);
+  container->data = words;
+  container->type = CONTAINER_BITMAP;
+  container->length = 0;
+  container->capacity = 0;
+}
+
+// Switches to the representation that takes the least memory
+static void container_optimize(UNARY_CONTAINER *container) {
+  uint32 count = container->count;
+  assert(count > 0);
+
+  uint32 runs = container_count_runs(container);
+  uint32 runs_bytes = runs * 2 * sizeof(uint16);
+  uint32 array_bytes = count * sizeof(uint16);
+  uint32 bitmap_bytes = BITMAP_WORDS * sizeof(uint64);
+
+  uint8 type;
+  if (runs_bytes < array_bytes && runs_bytes < bitmap_bytes)
+    type = CONTAINER_RUNS;
+  else if (count <= MAX_ARRAY_COUNT)
+    type = CONTAINER_ARRAY;
+  else
+    type = CONTAINER_BITMAP;
+
+  if (type == CONTAINER_BITMAP) {
+    container_to_bitmap(container);
+  }
+  else if (type != container->type || container->capacity != container->length) {
+    uint16 *values = (uint16 *) malloc(count * sizeof(uint16));
+    container_extract(container, values);
+    free(container->data);
+
+    if (type == CONTAINER_ARRAY) {
+      container->data = values;
+      container->length = count;
+      container->capacity = count;
+    }
+    else {
+      uint16 *run_array = (uint16 *) malloc(runs * 2 * sizeof(uint16));
+      uint32 idx = 0;
+      for (uint32 i=0 ; i < count ; i++)
+        if (i == 0 || values[i] != values[i-1] + 1) {
+          run_array[2 * idx] = values[i];
+          run_array[2 * idx + 1] = 0;
+          idx++;
+        }
+        else
+          run_array[2 * idx - 1]++;
+      assert(idx == runs);
+      free(values);
+      container->data = run_array;
+      container->length = runs;
+      container->capacity = runs;
+    }
+    container->type = type;
+  }
+  container->dirty = false;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Returns the index of the run that contains <value> or, if there's
+// none, the index of the first run that starts after it
+static uint32 find_run(uint16 *runs, uint32 length, uint32 value) {
+  uint32 low = 0;
+  uint32 high = length;
+  while (low < high) {
+    uint32 mid = (low + high) / 2;
+    if (run_last(runs, mid) < value)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  return low;
+}
+
+static bool container_contains(UNARY_CONTAINER *container, uint32 value) {
+  uint32 type = container->type;
+  if (type == CONTAINER_BITMAP) {
+    uint64 *bitmap = (uint64 *) container->data;
+    return (bitmap[value / 64] >> (value % 64)) & 1;
+  }
+  else if (type == CONTAINER_ARRAY) {
+    uint16 *array = (uint16 *) container->data;
+    return std::binary_search(array, array + container->length, (uint16) value);
+  }
+  else {
+    uint16 *runs = (uint16 *) container->data;
+    uint32 length = container->length;
+    uint32 idx = find_run(runs, length, value);
+    return idx < length && run_start(runs, idx) <= value;
+  }
+}
+
+// Returns false if the value was already there
+static bool container_insert(UNARY_CONTAINER *container, uint32 value) {
+  if (container->type == CONTAINER_RUNS) {
+    if (container_contains(container, value))
+      return false;
+    container_to_bitmap(container);
+  }
+
+  if (container->type == CONTAINER_ARRAY) {
+    uint16 *array = (uint16 *) container->data;
+    uint32 length = container->length;
+    uint16 *ptr = std::lower_bound(array, array + length, (uint16) value);
+    if (ptr != array + length && *ptr == value)
+      return false;
+
+    if (length == MAX_ARRAY_COUNT) {
+      container_to_bitmap(container);
+    }
+    else {
+      uint32 idx = ptr - array;
+      if (length == container->capacity) {
+        uint32 capacity = length > 0 ? 2 * length : 4;
+        if (capacity > MAX_ARRAY_COUNT)
+          capacity = MAX_ARRAY_COUNT;
+        array = (uint16 *) realloc(array, capacity * sizeof(uint16));
+        container->data = array;
+        container->capacity = capacity;
+      }
+      memmove(array + idx + 1, array + idx, (length - idx) * sizeof(uint16));
+      array[idx] = value;
+      container->length = length + 1;
+      container->count++;
+      container->dirty = true;
+      return true;
+    }
+  }
+
+  uint64 *bitmap = (uint64 *) container->data;
+  uint64 mask = 1ULL << (value % 64);
+  if (bitmap[value / 64] & mask)
+    return false;
+  bitmap[value / 64] |= mask;
+  container->count++;
+  container->dirty = true;
+  return true;
+}
+
+// Returns false if the value was not there
+static bool container_delete(UNARY_CONTAINER *container, uint32 value) {
+  if (container->type == CONTAINER_RUNS) {
+    if (!container_contains(container, value))
+      return false;
+    container_to_bitmap(container);
+  }
+
+  if (container->type == CONTAINER_ARRAY) {
+    uint16 *array = (uint16 *) container->data;
+    uint32 length = container->length;
+    uint16 *ptr = std::lower_bound(array, array + length, (uint16) value);
+    if (ptr == array + length || *ptr != value)
+      return false;
+    uint32 idx = ptr - array;
+    memmove(array + idx, array + idx + 1, (length - idx - 1) * sizeof(uint16));
+    container->length = length - 1;
+  }
+  else {
+    uint64 *bitmap = (uint64 *) container->data;
+    uint64 mask = 1ULL << (value % 64);
+    if (!(bitmap[value / 64] & mask))
+      return false;
+    bitmap[value / 64] &= ~mask;
+  }
+
+  container->count--;
+  container->dirty = true;
+  return true;
+}
+
+// Copies to <dest> up to <size> of the values in <words> that are greater
+// than or equal to <from>, in order, each of them added to <base>. Returns
+// the number of values copied. Members are extracted a whole word at a time,
+// by repeatedly taking the lowest set bit and clearing it
+static uint32 read_words(uint64 *words, uint32 words_count, uint32 from, uint32 base, uint32 *dest, uint32 size) {
+  uint32 idx = from / 64;
+  if (idx >= words_count || size == 0)
+    return 0;
+
+  uint32 count = 0;
+  uint64 word = words[idx] & (~0ULL << (from % 64));
+  for ( ; ; ) {
+    for ( ; word != 0 ; word &= word - 1) {
+      dest[count++] = base + 64 * idx + count_trailing_zeros_64(word);
+      if (count == size)
+        return count;
+    }
+    if (++idx == words_count)
+      return count;
+    word = words[idx];
+  }
+}
+
+// Same as read_words(), but for a container
+static uint32 container_read(UNARY_CONTAINER *container, uint32 from, uint32 *dest, uint32 size) {
+  uint32 base = container->key << 16;
+  uint32 type = container->type;
+  if (type == CONTAINER_BITMAP) {
+    return read_words((uint64 *) container->data, BITMAP_WORDS, from, base, dest, size);
+  }
+  else if (type == CONTAINER_ARRAY) {
+    uint16 *array = (uint16 *) container->data;
+    uint32 length = container->length;
+    uint32 idx = std::lower_bound(array, array + length, from) - array;
+    uint32 count = length - idx < size ? length - idx : size;
+    for (uint32 i=0 ; i < count ; i++)
+      dest[i] = base | array[idx + i];
+    return count;
+  }
+  else {
+    uint16 *runs = (uint16 *) container->data;
+    uint32 length = container->length;
+    uint32 count = 0;
+    for (uint32 i = find_run(runs, length, from) ; i < length && count < size ; i++) {
+      uint32 start = run_start(runs, i);
+      uint32 last = run_last(runs, i);
+      for (uint32 value = start > from ? start : from ; value <= last && count < size ; value++)
+        dest[count++] = base | value;
+    }
+    return count;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// The size of a flat table must fit in 32 bits, so tables with values
+// above that can only be stored in compressed form
+const uint32 MAX_FLAT_SIZE = 1U << 31;
+
+static uint64 flat_size(uint32 max_value) {
+  uint64 size = INIT_SIZE;
+  while (max_value >= size)
+    size *= 2;
+  return size;
+}
+
+// Rough estimate of the memory needed by a compressed table
+static uint64 compressed_footprint_estimate(uint32 count, uint32 max_value) {
+  uint32 containers = max_value / 65536 + 1;
+  if (containers > count)
+    containers = count;
+  return containers * (uint64) sizeof(UNARY_CONTAINER) + count * sizeof(uint16);
+}
+
+static uint64 compressed_footprint(UNARY_TABLE *table) {
+  uint64 footprint = table->containers_capacity * (uint64) sizeof(UNARY_CONTAINER);
+  for (uint32 i=0 ; i < table->containers_count ; i++)
+    footprint += container_footprint(table->containers + i);
+  return footprint;
+}
+
+static bool should_compress(uint64 flat_bytes, uint64 compressed_bytes, bool is_compressed) {
+  if (flat_bytes < MIN_COMPRESSED_FLAT_BYTES)
+    return false;
+  uint32 ratio = is_compressed ? EXPAND_RATIO : COMPRESS_RATIO;
+  return flat_bytes > ratio * compressed_bytes;
+}
+
+static inline bool is_compressed(UNARY_TABLE *table) {
+  return table->bitmap == NULL;
+}
+
+// Returns the index of the container with the given key or,
+// if there's none, the index where it should be inserted
+static uint32 find_container(UNARY_TABLE *table, uint32 key) {
+  UNARY_CONTAINER *containers = table->containers;
+  uint32 low = 0;
+  uint32 high = table->containers_count;
+  while (low < high) {
+    uint32 mid = (low + high) / 2;
+    if (containers[mid].key < key)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  return low;
+}
+
+static UNARY_CONTAINER *append_container(UNARY_TABLE *table, uint32 key) {
+  assert(table->containers_count == 0 || table->containers[table->containers_count-1].key < key);
+
+  uint32 count = table->containers_count;
+  if (count == table->containers_capacity) {
+    uint32 capacity = count > 0 ? 2 * count : 4;
+    table->containers = (UNARY_CONTAINER *) realloc(table->containers, capacity * sizeof(UNARY_CONTAINER));
+    table->containers_capacity = capacity;
+  }
+  UNARY_CONTAINER *container = table->containers + count;
+  container_init(container, key);
+  table->containers_count = count + 1;
+  return container;
+}
+
+static void free_containers(UNARY_TABLE *table) {
+  for (uint32 i=0 ; i < table->containers_count ; i++)
+    container_cleanup(table->containers + i);
+  free(table->containers);
+  table->containers = NULL;
+  table->containers_count = 0;
+  table->containers_capacity = 0;
+}
+
+// Converts a flat table into a compressed one
+static void compress(UNARY_TABLE *table) {
+  assert(!is_compressed(table) && table->containers_count == 0);
+
+  uint64 *bitmap = table->bitmap;
+  uint32 words_count = table->size / 64;
+
+  for (uint32 i=0 ; i < words_count ; i += BITMAP_WORDS) {
+    uint32 chunk_words = words_count - i < BITMAP_WORDS ? words_count - i : BITMAP_WORDS;
+    uint32 count = 0;
+    for (uint32 j=0 ; j < chunk_words ; j++)
+      count += popcount_64(bitmap[i + j]);
+    if (count > 0) {
+      uint64 *words = (uint64 *) malloc(BITMAP_WORDS * sizeof(uint64));
+      memset(words, 0, BITMAP_WORDS * sizeof(uint64));
+      memcpy(words, bitmap + i, chunk_words * sizeof(uint64));
+      UNARY_CONTAINER *container = append_container(table, i / BITMAP_WORDS);
+      container->data = words;
+      container->type = CONTAINER_BITMAP;
+      container->count = count;
+      container_optimize(container);
+    }
+  }
+
+  free(bitmap);
+  table->bitmap = NULL;
+  table->size = 0;
+}
+
+// Converts a compressed table into a flat one
+static void expand(UNARY_TABLE *table, uint32 size) {
+  assert(is_compressed(table));
+
+  uint32 words_count = size / 64;
+  uint64 *bitmap = (uint64 *) malloc(size / 8);
+  memset(bitmap, 0, size / 8);
+
+  uint64 *words = NULL;
+  for (uint32 i=0 ; i < table->containers_count ; i++) {
+    UNARY_CONTAINER *container = table->containers + i;
+    uint32 offset = container->key * BITMAP_WORDS;
+    assert(offset < words_count);
+    if (words_count - offset >= BITMAP_WORDS) {
+      container_or_words(container, bitmap + offset);
+    }
+    else {
+      // Only possible for the first container of a small bitmap
+      if (words == NULL)
+        words = (uint64 *) malloc(BITMAP_WORDS * sizeof(uint64));
+      memset(words, 0, BITMAP_WORDS * sizeof(uint64));
+      container_or_words(container, words);
+      memcpy(bitmap + offset, words, (words_count - offset) * sizeof(uint64));
+    }
+  }
+  free(words);
+
+  free_containers(table);
+  table->bitmap = bitmap;
+  table->size = size;
+}
+
+// Removes empty containers and optimizes the dirty ones,
+// then switches representation if that saves enough memory
+static void update_representation(UNARY_TABLE *table) {
+  if (is_compressed(table)) {
+    UNARY_CONTAINER *containers = table->containers;
+    uint32 count = table->containers_count;
+    uint32 kept = 0;
+    for (uint32 i=0 ; i < count ; i++) {
+      UNARY_CONTAINER *container = containers + i;
+      if (container->count == 0) {
+        container_cleanup(container);
+        continue;
+      }
+      if (container->dirty)
+        container_optimize(container);
+      containers[kept++] = *container;
+    }
+    table->containers_count = kept;
+
+    uint32 max_value = 0;
+    if (kept > 0) {
+      UNARY_CONTAINER *last = containers + kept - 1;
+      uint16 *values = (uint16 *) malloc(last->count * sizeof(uint16));
+      container_extract(last, values);
+      max_value = (last->key << 16) | values[last->count - 1];
+      free(values);
+    }
+
+    uint64 size = flat_size(max_value);
+    if (size <= MAX_FLAT_SIZE && !should_compress(size / 8, compressed_footprint(table), true))
+      expand(table, size);
+  }
+  else {
+    uint32 size = table->size;
+    if (should_compress(size / 8, compressed_footprint_estimate(table->count, size - 1), false))
+      compress(table);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Copies to <dest> up to <size> of the values in the table that are greater
+// than or equal to <from>, in order, and returns their number. <container_idx>
+// must be the index of a container whose key is not greater than that of
+// <from>, and is updated to that of the container of the last value copied
+static uint32 read_values(UNARY_TABLE *table, uint64 from, uint32 &container_idx, uint32 *dest, uint32 size) {
+  if (!is_compressed(table)) {
+    if (from >= table->size)
+      return 0;
+    return read_words(table->bitmap, table->size / 64, from, 0, dest, size);
+  }
+
+  UNARY_CONTAINER *containers = table->containers;
+  uint32 containers_count = table->containers_count;
+  uint64 key = from >> 16;
+  uint32 count = 0;
+  for (uint32 i=container_idx ; i < containers_count && count < size ; i++) {
+    UNARY_CONTAINER *container = containers + i;
+    if (container->key < key)
+      continue;
+    uint32 low_from = container->key == key ? from & 0xFFFF : 0;
+    uint32 read = container_read(container, low_from, dest + count, size - count);
+    if (read > 0) {
+      count += read;
+      container_idx = i;
+    }
+  }
+  return count;
+}
+
+static bool next_value(UNARY_TABLE *table, uint64 from, uint32 &container_idx, uint32 &value) {
+  return read_values(table, from, container_idx, &value, 1) == 1;
+}
+
+// Removes a value from the table, returning false if it wasn't there
+static bool table_remove(UNARY_TABLE *table, uint32 value) {
+  if (!is_compressed(table)) {
+    if (value >= table->size)
+      return false;
+    uint64 *bitmap = table->bitmap;
+    uint32 idx = value >> 6;
+    uint64 mask = 1ULL << (value % 64);
+    uint64 cell = bitmap[idx];
+    if (!(cell & mask))
+      return false;
+    bitmap[idx] = cell & ~mask;
+  }
+  else {
+    uint32 idx = find_container(table, value >> 16);
+    if (idx == table->containers_count || table->containers[idx].key != value >> 16)
+      return false;
+    if (!container_delete(table->containers + idx, value & 0xFFFF))
+      return false;
+  }
+  table->count--;
+  return true;
+}
+
+// <inserts> is sorted in place
+// Inserts that are already in the table are replaced with 0xFFFFFFFF
+static void compressed_insert(UNARY_TABLE *table, uint32 *inserts, uint32 count) {
+  adaptive_sort(inserts, inserts + count, std::less<uint32>());
+
+  // Creating the missing containers first, merging their keys with the existing ones
+  uint32 new_keys = 0;
+  for (uint32 i=0 ; i < count ; i++) {
+    uint32 key = inserts[i] >> 16;
+    if (i > 0 && key == inserts[i-1] >> 16)
+      continue;
+    uint32 idx = find_container(table, key);
+    if (idx == table->containers_count || table->containers[idx].key != key)
+      new_keys++;
+  }
+
+  if (new_keys > 0) {
+    UNARY_CONTAINER *containers = table->containers;
+    uint32 containers_count = table->containers_count;
+    uint32 capacity = containers_count + new_keys;
+    UNARY_CONTAINER *new_containers = (UNARY_CONTAINER *) malloc(capacity * sizeof(UNARY_CONTAINER));
+
+    uint32 src = 0;
+    uint32 dest = 0;
+    for (uint32 i=0 ; i < count ; i++) {
+      uint32 key = inserts[i] >> 16;
+      if (i > 0 && key == inserts[i-1] >> 16)
+        continue;
+      while (src < containers_count && containers[src].key < key)
+        new_containers[dest++] = containers[src++];
+      if (src < containers_count && containers[src].key == key)
+        new_containers[dest++] = containers[src++];
+      else
+        container_init(new_containers + dest++, key);
+    }
+    while (src < containers_count)
+      new_containers[dest++] = containers[src++];
+    assert(dest == capacity);
+
+    free(containers);
+    table->containers = new_containers;
+    table->containers_count = capacity;
+    table->containers_capacity = capacity;
+  }
+
+  UNARY_CONTAINER *containers = table->containers;
+  uint32 idx = 0;
+  for (uint32 i=0 ; i < count ; i++) {
+    uint32 value = inserts[i];
+    while (containers[idx].key < value >> 16)
+      idx++;
+    assert(containers[idx].key == value >> 16);
+    if (container_insert(containers + idx, value & 0xFFFF))
+      table->count++;
+    else
+      inserts[i] = 0xFFFFFFFFU;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
 
 void unary_table_init(UNARY_TABLE *table) {
-  const uint32 INIT_SIZE = 1024;
   uint64 *bitmap = (uint64 *) malloc(INIT_SIZE/8);
   memset(bitmap, 0, INIT_SIZE/8);
   table->bitmap = bitmap;
   table->size = INIT_SIZE;
   table->count = 0;
+  table->containers = NULL;
+  table->containers_count = 0;
+  table->containers_capacity = 0;
 }
 
 void unary_table_cleanup(UNARY_TABLE *table) {
   free(table->bitmap);
+  free_containers(table);
 }
 
 void unary_table_updates_init(UNARY_TABLE_UPDATES *table) {
@@ -19,23 +748,33 @@ void unary_table_updates_init(UNARY_TABLE_UPDATES *table) {
   table->deletes_count = 0;
   table->inserts_count = 0;
   table->buffer = NULL;
+  table->cleared = false;
 }
 
 // Inserts and deletes are stored in the same buffer,
 // deletes at the front and inserts at the back
 void unary_table_updates_cleanup(UNARY_TABLE_UPDATES *table) {
-
+  free(table->buffer);
+  table->buffer = NULL;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
 bool unary_table_contains(UNARY_TABLE *table, uint32 value) {
-  assert(value < table->size);
+  if (!is_compressed(table)) {
+    if (value >= table->size)
+      return false;
+    uint64 *bitmap = table->bitmap;
+    uint32 idx = value >> 6;
+    uint64 mask = 1ULL << (value % 64);
+    return bitmap[idx] & mask;
+  }
 
-  uint64 *bitmap = table->bitmap;
-  uint32 idx = value >> 6;
-  uint64 mask = 1ULL << (value % 64);
-  return bitmap[idx] & mask;
+  uint32 idx = find_container(table, value >> 16);
+  if (idx == table->containers_count)
+    return false;
+  UNARY_CONTAINER *container = table->containers + idx;
+  return container->key == value >> 16 && container_contains(container, value & 0xFFFF);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -94,87 +833,129 @@ void unary_table_delete(UNARY_TABLE *, UNARY_TABLE_UPDATES *updates, uint32 valu
   updates->deletes_count = deletes_count + 1;
 }
 
+// All the values in the table are written to the deletes in one go, replacing
+// those that were there already, which would be redundant. The updates are
+// also marked as clearing the table, so that unary_table_updates_apply() can
+// just zero the whole table instead of removing the values one by one
 void unary_table_clear(UNARY_TABLE *table, UNARY_TABLE_UPDATES *updates) {
-  uint64 *bitmap = table->bitmap;
-  uint32 cell_count = table->size / 64;
-  for (int i=0 ; i < cell_count ; i++) {
-    uint64 cell = bitmap[i];
-    for (int j=0 ; j < 64 ; j++)
-      if ((cell >> j) & 1)
-        unary_table_delete(table, updates, 64 * i + j);
-  }
+  uint32 count = table->count;
+  updates->deletes_count = 0;
+  while (updates->capacity - updates->inserts_count < count)
+    unary_table_updates_resize(updates);
+
+  UNARY_TABLE_ITER iter;
+  unary_table_get_iter(table, &iter);
+  uint32 read = unary_table_iter_fill(&iter, updates->buffer, count);
+  assert(read == count && unary_table_iter_is_out_of_range(&iter));
+
+  updates->deletes_count = count;
+  updates->cleared = true;
 }
 
 bool unary_table_updates_check(UNARY_TABLE *table, UNARY_TABLE_UPDATES *updates) {
   return true;
 }
 
-void unary_table_updates_apply(UNARY_TABLE *table, UNARY_TABLE_UPDATES *updates, VALUE_STORE *vs) {
+void unary_table_updates_apply_tuples(UNARY_TABLE *table, UNARY_TABLE_UPDATES *updates) {
   uint32 inserts_count = updates->inserts_count;
   uint32 deletes_count = updates->deletes_count;
 
-  if (deletes_count > 0) {
+  if (updates->cleared) {
+    // The first table->count deletes are exactly the values in the table,
+    // any later one refers to a value that is already among them
+    assert(deletes_count >= table->count);
     uint32 *deletes = updates->buffer;
-    uint64 *bitmap = table->bitmap;
-    for (uint32 i=0 ; i < deletes_count ; i++) {
-      uint32 value = deletes[i];
-      uint32 idx = value >> 6;
-      uint64 mask = 1ULL << (value % 64);
-      uint64 cell = bitmap[idx];
-      if (cell & mask) {
-        cell &= ~mask;
-        bitmap[idx] = cell;
-        table->count--;
-      }
-      else
+    for (uint32 i=table->count ; i < deletes_count ; i++)
+      deletes[i] = 0xFFFFFFFFU;
+    if (!is_compressed(table))
+      memset(table->bitmap, 0, table->size / 8);
+    else
+      free_containers(table);
+    table->count = 0;
+  }
+  else if (deletes_count > 0) {
+    uint32 *deletes = updates->buffer;
+    for (uint32 i=0 ; i < deletes_count ; i++)
+      if (!table_remove(table, deletes[i]))
         deletes[i] = 0xFFFFFFFFU;
-    }
   }
 
   if (inserts_count > 0) {
     uint32 *inserts = updates->buffer + updates->capacity - inserts_count;
     uint32 max_val = *std::max_element(inserts, inserts + inserts_count);
-    uint32 size = table->size;
-    uint64 *bitmap = table->bitmap;
-    if (max_val >= size) {
-      // Reallocating the table
-      uint32 new_size = 2 * size;
-      while (max_val >= new_size)
-        new_size *= 2;
-      uint64 *bitmap = (uint64 *) realloc(bitmap, new_size / 8);
-      memset(bitmap + (size / 64), 0, (new_size - size) / 8);
-      size = new_size;
-      table->size = size;
-      table->bitmap = bitmap;
+
+    if (!is_compressed(table) && max_val >= table->size) {
+      uint64 new_size = flat_size(max_val);
+      uint64 estimate = compressed_footprint_estimate(table->count + inserts_count, max_val);
+      if (new_size > MAX_FLAT_SIZE || should_compress(new_size / 8, estimate, false)) {
+        compress(table);
+      }
+      else {
+        // Reallocating the table
+        uint32 size = table->size;
+        uint64 *bitmap = (uint64 *) realloc(table->bitmap, new_size / 8);
+        memset(bitmap + (size / 64), 0, (new_size - size) / 8);
+        table->size = new_size;
+        table->bitmap = bitmap;
+      }
     }
 
-    for (uint32 i=0 ; i < inserts_count ; i++) {
-      uint32 value = inserts[i];
-      uint32 idx = value >> 6;
-      uint64 mask = 1ULL << (value % 64);
-      uint64 cell = bitmap[idx];
-      if (!(cell & mask)) {
-        cell |= mask;
-        bitmap[idx] = cell;
-        table->count++;
-        value_store_add_ref(vs, value);
+    if (!is_compressed(table)) {
+      uint64 *bitmap = table->bitmap;
+      for (uint32 i=0 ; i < inserts_count ; i++) {
+        uint32 value = inserts[i];
+        uint32 idx = value >> 6;
+        uint64 mask = 1ULL << (value % 64);
+        uint64 cell = bitmap[idx];
+        if (!(cell & mask)) {
+          cell |= mask;
+          bitmap[idx] = cell;
+          table->count++;
+        }
+        else
+          inserts[i] = 0xFFFFFFFFU;
       }
     }
+    else
+      compressed_insert(table, inserts, inserts_count);
   }
+
+  if (deletes_count > 0 || inserts_count > 0)
+    update_representation(table);
 }
 
-void unary_table_updates_finish(UNARY_TABLE_UPDATES *updates, VALUE_STORE *vs) {
+void unary_table_updates_collect_inserted(UNARY_TABLE_UPDATES *updates, std::vector<uint32> &surrs) {
+  uint32 count = updates->inserts_count;
+  uint32 *inserts = updates->buffer + updates->capacity - count;
+  for (uint32 i=0 ; i < count ; i++) {
+    uint32 value = inserts[i];
+    if (value != 0xFFFFFFFFU)
+      surrs.push_back(value);
+  }
+}
+
+void unary_table_updates_collect_deleted(UNARY_TABLE_UPDATES *updates, std::vector<uint32> &surrs) {
   uint32 count = updates->deletes_count;
-  uint32 *buffer = updates->buffer;
-  if (count > 0) {
-    for (uint32 i=0 ; i < count ; i++) {
-      uint32 value = buffer[i];
-      if (value != 0xFFFFFFFFU)
-        value_store_release(vs, value);
-    }
+  uint32 *deletes = updates->buffer;
+  for (uint32 i=0 ; i < count ; i++) {
+    uint32 value = deletes[i];
+    if (value != 0xFFFFFFFFU)
+      surrs.push_back(value);
   }
-  if (buffer != NULL)
-    free(buffer);
+}
+
+void unary_table_updates_apply(UNARY_TABLE *table, UNARY_TABLE_UPDATES *updates, VALUE_STORE *vs) {
+  unary_table_updates_apply_tuples(table, updates);
+  std::vector<uint32> surrs;
+  unary_table_updates_collect_inserted(updates, surrs);
+  value_store_add_ref_batch(vs, surrs);
+}
+
+void unary_table_updates_finish(UNARY_TABLE_UPDATES *updates, VALUE_STORE *vs) {
+  std::vector<uint32> surrs;
+  unary_table_updates_collect_deleted(updates, surrs);
+  value_store_release_batch(vs, surrs);
+  unary_table_updates_cleanup(updates);
   // // No need to delete anything for now, this memory is allocated in "temporary" memory, it is
   // // cleaned up automatically. An attempt to free it at this stage would actually cause a crash.
   // //## BUT WHY IS IT COUNTED AMONG THE LEAKED BLOCKS OF MEMORY?
@@ -184,29 +965,18 @@ void unary_table_updates_finish(UNARY_TABLE_UPDATES *updates, VALUE_STORE *vs) {
 ////////////////////////////////////////////////////////////////////////////////
 
 void unary_table_get_iter(UNARY_TABLE *table, UNARY_TABLE_ITER *iter) {
-  if (table->count != 0) {
-    uint64 *bitmap = table->bitmap;
-    uint32 size = table->size;
+  iter->table = NULL;
+  iter->container_idx = 0;
+  iter->curr_value = 0;
 
-    iter->bitmap = bitmap;
-    iter->size = size;
-
-    uint32 cell_count = size / 64;
-    for (uint32 i=0 ; i < cell_count ; i++) {
-      uint64 cell = bitmap[i];
-      if (cell != 0)
-        for (int j=0 ; j < 64 ; j++)
-          if (((cell >> j) & 1) != 0) {
-            iter->curr_value = 64 * i + j;
-            return;
-          }
-    }
-    internal_fail();
-  }
-  else {
-    iter->bitmap = NULL;
-    iter->size = 0;
-    iter->curr_value = 0;
+  if (table->count != 0) {
+    uint32 container_idx = 0;
+    uint32 value;
+    if (!next_value(table, 0, container_idx, value))
+      internal_fail();
+    iter->table = table;
+    iter->container_idx = container_idx;
+    iter->curr_value = value;
   }
 }
 
@@ -219,52 +989,49 @@ uint32 unary_table_iter_get_field(UNARY_TABLE_ITER *iter) {
 void unary_table_iter_next(UNARY_TABLE_ITER *iter) {
   assert(!unary_table_iter_is_out_of_range(iter));
 
-  uint64 *bitmap = iter->bitmap;
-  uint32 size = iter->size;
-  uint32 curr_value = iter->curr_value;
+  uint32 container_idx = iter->container_idx;
+  uint32 value;
+  if (next_value(iter->table, iter->curr_value + 1ULL, container_idx, value)) {
+    iter->container_idx = container_idx;
+    iter->curr_value = value;
+  }
+  else {
+    iter->table = NULL;
+    iter->container_idx = 0;
+    iter->curr_value = 0;
+  }
+}
 
-  uint32 cell_count = size / 64;
+uint32 unary_table_iter_fill(UNARY_TABLE_ITER *iter, uint32 *buffer, uint32 size) {
+  if (unary_table_iter_is_out_of_range(iter) || size == 0)
+    return 0;
 
-  uint32 idx = curr_value / 64;
-  uint32 offset = curr_value % 64 + 1;
+  UNARY_TABLE *table = iter->table;
+  uint32 container_idx = iter->container_idx;
+  uint32 count = read_values(table, iter->curr_value, container_idx, buffer, size);
+  assert(count > 0 && buffer[0] == iter->curr_value);
 
-  uint64 cell = bitmap[idx];
-  if (cell >> offset != 0) {
-    for (int i=offset ; i < 64 ; i++)
-      if (((cell >> i) & 1) != 0) {
-        iter->curr_value = 64 * idx + i;
-        return;
-      }
-    internal_fail();
+  uint32 value;
+  if (next_value(table, buffer[count - 1] + 1ULL, container_idx, value)) {
+    iter->container_idx = container_idx;
+    iter->curr_value = value;
   }
-
-  for (uint32 i=idx+1 ; i < cell_count ; i++) {
-    cell = bitmap[i];
-    if (cell != 0)
-      for (int j=0 ; j < 64 ; j++)
-        if (((cell >> j) & 1) != 0) {
-          iter->curr_value = 64 * i + j;
-          return;
-        }
+  else {
+    iter->table = NULL;
+    iter->container_idx = 0;
+    iter->curr_value = 0;
   }
-
-  iter->bitmap = NULL;
-  iter->size = 0;
-  iter->curr_value = 0;
+  return count;
 }
 
 bool unary_table_iter_is_out_of_range(UNARY_TABLE_ITER *iter) {
-  return iter->bitmap == NULL;
+  return iter->table == NULL;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
 OBJ copy_unary_table(UNARY_TABLE *table, VALUE_STORE *vs) {
-  assert(table->size % 64 == 0);
-
   OBJ *slots = value_store_slot_array(vs);
-  uint64 *bitmap = table->bitmap;
-  uint32 size = table->size;
   uint32 count = table->count;
 
   if (count == 0)
@@ -273,16 +1040,16 @@ OBJ copy_unary_table(UNARY_TABLE *table, VALUE_STORE *vs) {
   SET_OBJ *set = new_set(count);
   OBJ *buffer = set->buffer;
 
+  uint32 values[256];
   uint32 idx = 0;
-  for (uint32 i=0 ; i < size/64 ; i++) {
-    uint64 word = bitmap[i];
-    for (int j=0 ; j < 64 ; j++)
-      if ((word >> j) & 1) {
-        OBJ obj = slots[64 * i + j];
-        add_ref(obj);
-        buffer[idx++] = obj;
-      }
-  }
+  UNARY_TABLE_ITER iter;
+  unary_table_get_iter(table, &iter);
+  for (uint32 read ; (read = unary_table_iter_fill(&iter, values, 256)) > 0 ; )
+    for (uint32 i=0 ; i < read ; i++) {
+      OBJ obj = slots[values[i]];
+      add_ref(obj);
+      buffer[idx++] = obj;
+    }
   assert(idx == count);
 
   sort_obj_array(buffer, count);
@@ -301,13 +1068,336 @@ void set_unary_table(UNARY_TABLE *table, UNARY_TABLE_UPDATES *updates, VALUE_STO
   uint32 size = ptr->size;
   OBJ *buffer = ptr->buffer;
 
-  for (uint32 i=0 ; i < size ; i++) {
-    OBJ obj = buffer[i];
-    uint32 ref = lookup_value_ex(vs, vsu, obj);
-    if (ref == -1) {
-      add_ref(obj);
-      ref = value_store_insert(vs, vsu, obj);
+  uint32 refs[LOAD_CHUNK_SIZE];
+
+  for (uint32 i=0 ; i < size ; i += LOAD_CHUNK_SIZE) {
+    uint32 count = size - i < LOAD_CHUNK_SIZE ? size - i : LOAD_CHUNK_SIZE;
+    lookup_or_insert_values(vs, vsu, buffer + i, count, refs);
+    for (uint32 j=0 ; j < count ; j++)
+      unary_table_insert(updates, refs[j]);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void unary_table_remap(UNARY_TABLE *table, const uint32 *surr_map) {
+  uint32 count = table->count;
+  std::vector<uint32> values(count);
+
+  UNARY_TABLE_ITER iter;
+  unary_table_get_iter(table, &iter);
+  uint32 read = unary_table_iter_fill(&iter, values.data(), count);
+  assert(read == count);
+
+  for (uint32 i=0 ; i < count ; i++) {
+    values[i] = surr_map[values[i]];
+    assert(values[i] != INVALID_INDEX);
+  }
+
+  // Surrogate maps produced by value_store_compact() preserve the order of the values
+  adaptive_sort(values.data(), values.data() + count, std::less<uint32>());
+  uint32 max_value = count > 0 ? values[count - 1] : 0;
+
+  unary_table_cleanup(table);
+
+  uint64 new_size = flat_size(max_value);
+  if (new_size > MAX_FLAT_SIZE || should_compress(new_size / 8, compressed_footprint_estimate(count, max_value), false)) {
+    table->bitmap = NULL;
+    table->size = 0;
+    UNARY_CONTAINER *container = NULL;
+    for (uint32 i=0 ; i < count ; i++) {
+      uint32 value = values[i];
+      if (container == NULL || container->key != value >> 16) {
+        if (container != NULL)
+          container_optimize(container);
+        container = append_container(table, value >> 16);
+      }
+      container_insert(container, value & 0xFFFF);
+    }
+    if (container != NULL)
+      container_optimize(container);
+  }
+  else {
+    uint64 *new_bitmap = (uint64 *) malloc(new_size / 8);
+    memset(new_bitmap, 0, new_size / 8);
+    for (uint32 i=0 ; i < count ; i++) {
+      uint32 value = values[i];
+      new_bitmap[value >> 6] |= 1ULL << (value % 64);
+    }
+    table->bitmap = new_bitmap;
+    table->size = new_size;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Set expressions over unary tables that share the same value store are
+// evaluated one chunk of 65536 values (BITMAP_WORDS words) at a time. The
+// chunk of each operand is either read in place (flat tables and bitmap
+// containers) or expanded into a scratch buffer, and the operands are then
+// combined word-wise into the result, so the only intermediate storage is a
+// couple of chunk-sized buffers, whatever the number of tables involved
+
+static void words_copy(uint64 *dest, const uint64 *src) {
+  memcpy(dest, src, BITMAP_WORDS * sizeof(uint64));
+}
+
+#ifdef UNARY_TABLE_USE_SSE2
+
+static void words_and(uint64 *dest, const uint64 *src) {
+  for (uint32 i=0 ; i < BITMAP_WORDS ; i += 2) {
+    __m128i a = _mm_loadu_si128((const __m128i *) (dest + i));
+    __m128i b = _mm_loadu_si128((const __m128i *) (src + i));
+    _mm_storeu_si128((__m128i *) (dest + i), _mm_and_si128(a, b));
+  }
+}
+
+static void words_or(uint64 *dest, const uint64 *src) {
+  for (uint32 i=0 ; i < BITMAP_WORDS ; i += 2) {
+    __m128i a = _mm_loadu_si128((const __m128i *) (dest + i));
+    __m128i b = _mm_loadu_si128((const __m128i *) (src + i));
+    _mm_storeu_si128((__m128i *) (dest + i), _mm_or_si128(a, b));
+  }
+}
+
+static void words_andnot(uint64 *dest, const uint64 *src) {
+  for (uint32 i=0 ; i < BITMAP_WORDS ; i += 2) {
+    __m128i a = _mm_loadu_si128((const __m128i *) (dest + i));
+    __m128i b = _mm_loadu_si128((const __m128i *) (src + i));
+    _mm_storeu_si128((__m128i *) (dest + i), _mm_andnot_si128(b, a));
+  }
+}
+
+#else
+
+static void words_and(uint64 *dest, const uint64 *src) {
+  for (uint32 i=0 ; i < BITMAP_WORDS ; i++)
+    dest[i] &= src[i];
+}
+
+static void words_or(uint64 *dest, const uint64 *src) {
+  for (uint32 i=0 ; i < BITMAP_WORDS ; i++)
+    dest[i] |= src[i];
+}
+
+static void words_andnot(uint64 *dest, const uint64 *src) {
+  for (uint32 i=0 ; i < BITMAP_WORDS ; i++)
+    dest[i] &= ~src[i];
+}
+
+#endif
+
+static uint64 words_popcount(const uint64 *words) {
+  uint64 count = 0;
+  for (uint32 i=0 ; i < BITMAP_WORDS ; i++)
+    count += popcount_64(words[i]);
+  return count;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static uint32 chunks_count(UNARY_TABLE *table) {
+  if (!is_compressed(table))
+    return (table->size / 64 + BITMAP_WORDS - 1) / BITMAP_WORDS;
+  uint32 count = table->containers_count;
+  return count > 0 ? table->containers[count - 1].key + 1 : 0;
+}
+
+// Number of chunks past which the result of the expression is empty
+static uint32 chunks_count(UNARY_TABLE_EXPR *expr) {
+  uint32 count = 0;
+  for (uint32 i=0 ; i < expr->any_count ; i++) {
+    uint32 table_count = chunks_count(expr->any[i]);
+    if (table_count > count)
+      count = table_count;
+  }
+  if (expr->all_count > 0) {
+    if (expr->any_count == 0)
+      count = 0xFFFFFFFF;
+    for (uint32 i=0 ; i < expr->all_count ; i++) {
+      uint32 table_count = chunks_count(expr->all[i]);
+      if (table_count < count)
+        count = table_count;
+    }
+  }
+  return count;
+}
+
+// Returns a pointer to the words of the given chunk of the table, or NULL if
+// the chunk is empty. <scratch> is used if the words are not already stored
+// contiguously somewhere
+static const uint64 *load_chunk(UNARY_TABLE *table, uint32 chunk, uint64 *scratch) {
+  if (!is_compressed(table)) {
+    uint32 words_count = table->size / 64;
+    uint32 offset = chunk * BITMAP_WORDS;
+    if (offset >= words_count)
+      return NULL;
+    if (words_count - offset >= BITMAP_WORDS)
+      return table->bitmap + offset;
+    memset(scratch, 0, BITMAP_WORDS * sizeof(uint64));
+    memcpy(scratch, table->bitmap + offset, (words_count - offset) * sizeof(uint64));
+    return scratch;
+  }
+
+  uint32 idx = find_container(table, chunk);
+  if (idx == table->containers_count || table->containers[idx].key != chunk)
+    return NULL;
+  UNARY_CONTAINER *container = table->containers + idx;
+  if (container->type == CONTAINER_BITMAP)
+    return (uint64 *) container->data;
+  memset(scratch, 0, BITMAP_WORDS * sizeof(uint64));
+  container_or_words(container, scratch);
+  return scratch;
+}
+
+// Writes the given chunk of the result to <dest>. Returns false
+// (and leaves <dest> undefined) if the chunk is known to be empty
+static bool eval_chunk(UNARY_TABLE_EXPR *expr, uint32 chunk, uint64 *dest, uint64 *scratch, uint64 *any_words) {
+  uint32 all_count = expr->all_count;
+  uint32 any_count = expr->any_count;
+
+  for (uint32 i=0 ; i < all_count ; i++) {
+    const uint64 *words = load_chunk(expr->all[i], chunk, scratch);
+    if (words == NULL)
+      return false;
+    if (i == 0)
+      words_copy(dest, words);
+    else
+      words_and(dest, words);
+  }
+
+  if (any_count > 0) {
+    uint64 *target = all_count > 0 ? any_words : dest;
+    bool found = false;
+    for (uint32 i=0 ; i < any_count ; i++) {
+      const uint64 *words = load_chunk(expr->any[i], chunk, scratch);
+      if (words == NULL)
+        continue;
+      if (!found)
+        words_copy(target, words);
+      else
+        words_or(target, words);
+      found = true;
+    }
+    if (!found)
+      return false;
+    if (all_count > 0)
+      words_and(dest, any_words);
+  }
+
+  for (uint32 i=0 ; i < expr->none_count ; i++) {
+    const uint64 *words = load_chunk(expr->none[i], chunk, scratch);
+    if (words != NULL)
+      words_andnot(dest, words);
+  }
+
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+uint64 unary_expr_count(UNARY_TABLE_EXPR *expr) {
+  uint64 *buffers = (uint64 *) malloc(3 * BITMAP_WORDS * sizeof(uint64));
+  uint32 count = chunks_count(expr);
+  uint64 total = 0;
+  for (uint32 i=0 ; i < count ; i++)
+    if (eval_chunk(expr, i, buffers, buffers + BITMAP_WORDS, buffers + 2 * BITMAP_WORDS))
+      total += words_popcount(buffers);
+  free(buffers);
+  return total;
+}
+
+void unary_expr_bitmap(UNARY_TABLE_EXPR *expr, UNARY_BITMAP *bitmap) {
+  uint32 count = chunks_count(expr);
+  uint64 *words = (uint64 *) malloc(count * BITMAP_WORDS * sizeof(uint64));
+  uint64 *buffers = (uint64 *) malloc(2 * BITMAP_WORDS * sizeof(uint64));
+  uint64 total = 0;
+  for (uint32 i=0 ; i < count ; i++) {
+    uint64 *dest = words + i * BITMAP_WORDS;
+    if (eval_chunk(expr, i, dest, buffers, buffers + BITMAP_WORDS))
+      total += words_popcount(dest);
+    else
+      memset(dest, 0, BITMAP_WORDS * sizeof(uint64));
+  }
+  free(buffers);
+  bitmap->words = words;
+  bitmap->size = count * (uint64) BITMAP_WORDS * 64;
+  bitmap->count = total;
+}
+
+void unary_bitmap_cleanup(UNARY_BITMAP *bitmap) {
+  free(bitmap->words);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Loads the first non-empty chunk starting from iter->chunk,
+// and positions the iterator on its first value
+static void expr_iter_seek(UNARY_EXPR_ITER *iter) {
+  for ( ; iter->chunk < iter->chunks_count ; iter->chunk++)
+    if (eval_chunk(iter->expr, iter->chunk, iter->words, iter->scratch, iter->any_words))
+      for (uint32 i=0 ; i < BITMAP_WORDS ; i++)
+        if (iter->words[i] != 0) {
+          iter->word_idx = i;
+          iter->word = iter->words[i];
+          return;
+        }
+  iter->expr = NULL;
+}
+
+void unary_expr_get_iter(UNARY_TABLE_EXPR *expr, UNARY_EXPR_ITER *iter) {
+  iter->expr = expr;
+  iter->chunk = 0;
+  iter->chunks_count = chunks_count(expr);
+  iter->word_idx = 0;
+  iter->word = 0;
+  expr_iter_seek(iter);
+}
+
+bool unary_expr_iter_is_out_of_range(UNARY_EXPR_ITER *iter) {
+  return iter->expr == NULL;
+}
+
+uint32 unary_expr_iter_get_field(UNARY_EXPR_ITER *iter) {
+  assert(!unary_expr_iter_is_out_of_range(iter));
+  return (iter->chunk << 16) + 64 * iter->word_idx + count_trailing_zeros_64(iter->word);
+}
+
+// Moves on to the next non-zero word, in the current chunk or in the following ones
+static void expr_iter_next_word(UNARY_EXPR_ITER *iter) {
+  for (uint32 i=iter->word_idx+1 ; i < BITMAP_WORDS ; i++)
+    if (iter->words[i] != 0) {
+      iter->word_idx = i;
+      iter->word = iter->words[i];
+      return;
+    }
+  iter->chunk++;
+  expr_iter_seek(iter);
+}
+
+void unary_expr_iter_next(UNARY_EXPR_ITER *iter) {
+  assert(!unary_expr_iter_is_out_of_range(iter));
+
+  uint64 word = iter->word & (iter->word - 1);
+  if (word != 0)
+    iter->word = word;
+  else
+    expr_iter_next_word(iter);
+}
+
+uint32 unary_expr_iter_fill(UNARY_EXPR_ITER *iter, uint32 *buffer, uint32 size) {
+  uint32 count = 0;
+  while (count < size && !unary_expr_iter_is_out_of_range(iter)) {
+    uint32 base = (iter->chunk << 16) + 64 * iter->word_idx;
+    uint64 word = iter->word;
+    while (word != 0 && count < size) {
+      buffer[count++] = base + count_trailing_zeros_64(word);
+      word &= word - 1;
     }
-    unary_table_insert(updates, ref);
+    if (word != 0)
+      iter->word = word;
+    else
+      expr_iter_next_word(iter);
   }
+  return count;
 }
@@ -10,6 +10,8 @@
 #include <vector>
 #include <set>
 #include <algorithm>
+#include <atomic>
+#include <thread>
 
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -26,4 +28,85 @@ bool _assert_(int exp, const char *exp_text, const char *file, int line);
 
 ////////////////////////////////////////////////////////////////////////////////
 
+// Drop-in replacement for std::sort() for inputs that are often already
+// ordered. The initial run is detected with a linear scan (and reversed, if
+// strictly descending): if it covers the whole range nothing else is done,
+// otherwise, if it's long enough, only the rest is sorted and then merged in
+template <typename T, typename L> void adaptive_sort(T *begin, T *end, L less) {
+  if (end - begin < 2)
+    return;
+
+  T *run_end = begin + 1;
+  if (less(*run_end, *begin)) {
+    do
+      run_end++;
+    while (run_end < end && less(*run_end, *(run_end-1)));
+    std::reverse(begin, run_end);
+  }
+  else
+    while (run_end < end && !less(*run_end, *(run_end-1)))
+      run_end++;
+
+  if (run_end == end)
+    return;
+
+  if (8 * (run_end - begin) < end - begin) {
+    std::sort(begin, end, less);
+    return;
+  }
+
+  std::sort(run_end, end, less);
+  std::inplace_merge(begin, run_end, end, less);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Ranges shorter than this are not worth the cost of starting the threads
+const size_t PARALLEL_SORT_MIN_SIZE = 1 << 16;
+
+template <typename T, typename L> void parallel_sort_chunk(T *begin, T *end, L less) {
+  std::sort(begin, end, less);
+}
+
+template <typename T, typename L> void parallel_sort_merge(T *begin, T *middle, T *end, L less) {
+  std::inplace_merge(begin, middle, end, less);
+}
+
+// Sorts the range by splitting it into one chunk per hardware thread, sorting
+// the chunks concurrently and then merging them pairwise, each round of merges
+// also running concurrently. Short ranges are just sorted on the calling thread
+template <typename T, typename L> void parallel_sort(T *begin, T *end, L less) {
+  size_t size = end - begin;
+  size_t chunks_count = std::thread::hardware_concurrency();
+  if (chunks_count > size / (PARALLEL_SORT_MIN_SIZE / 4))
+    chunks_count = size / (PARALLEL_SORT_MIN_SIZE / 4);
+
+  if (size < PARALLEL_SORT_MIN_SIZE || chunks_count < 2) {
+    std::sort(begin, end, less);
+    return;
+  }
+
+  std::vector<T *> bounds(chunks_count + 1);
+  for (size_t i=0 ; i <= chunks_count ; i++)
+    bounds[i] = begin + size * i / chunks_count;
+
+  std::vector<std::thread> threads;
+  for (size_t i=0 ; i < chunks_count ; i++)
+    threads.push_back(std::thread(parallel_sort_chunk<T, L>, bounds[i], bounds[i+1], less));
+  for (size_t i=0 ; i < threads.size() ; i++)
+    threads[i].join();
+
+  for (size_t width=1 ; width < chunks_count ; width *= 2) {
+    threads.clear();
+    for (size_t i=0 ; i + width < chunks_count ; i += 2 * width) {
+      T *last = bounds[std::min(i + 2 * width, chunks_count)];
+      threads.push_back(std::thread(parallel_sort_merge<T, L>, bounds[i], bounds[i+width], last, less));
+    }
+    for (size_t i=0 ; i < threads.size() ; i++)
+      threads[i].join();
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 void mantissa_and_dec_exp(double value, long long &mantissa, int &dec_exp); //## IS THIS THE RIGHT PLACE FOR THIS FUNCTION?
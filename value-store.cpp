@@ -1,47 +1,338 @@
 #include "lib.h"
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+  #define VALUE_STORE_USE_SSE2
+  #include <emmintrin.h>
+#endif
 
-struct NODE {
-  uint32 next;
-  uint32 hash_code;
+#ifdef _MSC_VER
+  #include <intrin.h>
+#endif
+
+
+// Both the value store and its updates are indexed by an open addressing
+// hashtable in the style of Swiss tables. Each bucket has a control byte,
+// which is either EMPTY, DELETED or, for a full bucket, the 7 lower bits of
+// the hash code of the value it points to. Buckets are probed in aligned
+// groups of GROUP_SIZE, and all the control bytes of a group are matched
+// against the searched hash code at once, so a lookup usually touches a
+// single cache line of control bytes and one of bucket entries before
+// comparing the value. Groups are probed following a triangular sequence,
+// which visits all of them since their number is a power of two.
+//
+// The number of buckets is twice the capacity of the store, so the load
+// factor never exceeds 1/2, not counting tombstones. The slots themselves
+// are not moved when the index changes, so surrogates are stable.
+//
+// The slots and the index are allocated separately. A store (or updates)
+// block with capacity N contains:
+//
+//   OBJ    slots[N]
+//   uint32 hash_codes[N]
+//   uint32 ref_counts[N] (store) or surrs[N] (updates)
+//
+// while an index with B buckets contains:
+//
+//   uint8  ctrl[B]
+//   uint32 buckets[B]    Index of the slot each full bucket points to
+//
+// When the store grows the slots are copied into the new block, but the old
+// index is kept around, and its entries are moved to the new (initially
+// empty) index a few at a time, during the following calls to apply() and
+// release(), so that the cost of rehashing is spread over many operations.
+// While that happens, every value is in exactly one of the two indexes, and
+// lookups that fail in the new one fall back to the old one.
+//
+// Symbols and small non-negative integers are not in the hashtable at all:
+// they are mapped to their surrogate (or, in the updates, to their slot) by
+// two direct indexes, plain arrays indexed by symbol index and by value,
+// which are authoritative for the values in their range. Looking them up
+// requires neither hashing nor comparisons. The arrays are allocated lazily
+// and grow on demand up to the largest symbol index or integer stored.
+
+const uint32 GROUP_SIZE = 16;
+
+const uint8 CTRL_EMPTY    = 0x80;
+const uint8 CTRL_DELETED  = 0xFE;
+
+// Minimum number of buckets of the old index that
+// are migrated by each call to apply() and release()
+const uint32 MIGRATION_STEP = 256;
+
+////////////////////////////////////////////////////////////////////////////////
+
+static uint32 num_buckets(uint32 capacity) {
+  return 2 * capacity > GROUP_SIZE ? 2 * capacity : GROUP_SIZE;
+}
+
+static uint32 block_size(uint32 capacity) {
+  return capacity * (sizeof(OBJ) + 2 * sizeof(uint32));
+}
+
+static uint32 index_size(uint32 buckets_count) {
+  return buckets_count * (sizeof(uint8) + sizeof(uint32));
+}
+
+OBJ *slot_array(void *ptr) {
+  return (OBJ *) ptr;
+}
+
+uint32 *hash_code_array(void *ptr, uint32 capacity) {
+  return (uint32 *)(slot_array(ptr) + capacity);
+}
+
+uint32 *ref_count_array(void *ptr, uint32 capacity) {
+  return hash_code_array(ptr, capacity) + capacity;
+}
+
+uint32 *surr_array(void *ptr, uint32 capacity) {
+  return hash_code_array(ptr, capacity) + capacity;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static inline uint32 count_trailing_zeros(uint32 mask) {
+  assert(mask != 0);
+#ifdef _MSC_VER
+  unsigned long idx;
+  _BitScanForward(&idx, mask);
+  return idx;
+#else
+  return __builtin_ctz(mask);
+#endif
+}
+
+// The following functions return a mask with bit i set if the i-th
+// control byte of the group satisfies the condition being tested
+
+#ifdef VALUE_STORE_USE_SSE2
+
+static inline uint32 group_match(const uint8 *group, uint8 h2) {
+  __m128i ctrl = _mm_loadu_si128((const __m128i *) group);
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(h2)));
+}
+
+static inline uint32 group_match_empty(const uint8 *group) {
+  return group_match(group, CTRL_EMPTY);
+}
+
+// Either empty or deleted
+static inline uint32 group_match_free(const uint8 *group) {
+  return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *) group));
+}
+
+#else
+
+const uint64 LSB_BYTES = 0x0101010101010101ULL;
+const uint64 MSB_BYTES = 0x8080808080808080ULL;
+
+static inline uint64 load_word(const uint8 *bytes) {
+  uint64 word;
+  memcpy(&word, bytes, sizeof(uint64));
+  return word;
+}
+
+// Packs the high bits of the eight bytes of <word> into the low byte
+static inline uint32 pack_msbs(uint64 word) {
+  return (uint32) ((((word & MSB_BYTES) >> 7) * 0x0102040810204080ULL) >> 56);
+}
+
+// May report false positives, which are filtered out by the comparison of the hash code
+static inline uint32 group_match(const uint8 *group, uint8 h2) {
+  uint64 pattern = LSB_BYTES * h2;
+  uint64 x0 = load_word(group) ^ pattern;
+  uint64 x1 = load_word(group + 8) ^ pattern;
+  uint64 m0 = (x0 - LSB_BYTES) & ~x0;
+  uint64 m1 = (x1 - LSB_BYTES) & ~x1;
+  return pack_msbs(m0) | (pack_msbs(m1) << 8);
+}
+
+// An empty byte (0x80) has the high bit set and bit 1 clear, unlike all other control bytes
+static inline uint32 group_match_empty(const uint8 *group) {
+  uint64 x0 = load_word(group);
+  uint64 x1 = load_word(group + 8);
+  return pack_msbs(x0 & ~(x0 << 6)) | (pack_msbs(x1 & ~(x1 << 6)) << 8);
+}
+
+static inline uint32 group_match_free(const uint8 *group) {
+  return pack_msbs(load_word(group)) | (pack_msbs(load_word(group + 8)) << 8);
+}
+
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct INDEX {
+  uint8  *ctrl;
+  uint32 *buckets;
+  uint32  groups_mask;
 };
 
 
-NODE node(uint32 next_node, uint32 hash_code) {
-  NODE node;
-  node.next = next_node;
-  node.hash_code = hash_code;
-  return node;
+static INDEX index_view(void *index, uint32 buckets_count) {
+  INDEX view;
+  view.ctrl = (uint8 *) index;
+  view.buckets = (uint32 *)(view.ctrl + buckets_count);
+  view.groups_mask = buckets_count / GROUP_SIZE - 1;
+  return view;
+}
+
+static void *new_index(uint32 buckets_count) {
+  void *index = new_obj(index_size(buckets_count));
+  memset(index, CTRL_EMPTY, buckets_count);
+  return index;
+}
+
+static inline uint8 hash_h2(uint32 hash_code) {
+  return hash_code & 0x7F;
+}
+
+static inline uint32 hash_h1(uint32 hash_code) {
+  return hash_code >> 7;
+}
+
+// Returns true if a tombstone was reused
+static bool index_insert(INDEX &index, uint32 hash_code, uint32 value) {
+  uint32 group_idx = hash_h1(hash_code) & index.groups_mask;
+  for (uint32 step=1 ; ; step++) {
+    uint8 *group = index.ctrl + group_idx * GROUP_SIZE;
+    uint32 mask = group_match_free(group);
+    if (mask != 0) {
+      uint32 bucket_idx = group_idx * GROUP_SIZE + count_trailing_zeros(mask);
+      bool was_deleted = index.ctrl[bucket_idx] == CTRL_DELETED;
+      index.ctrl[bucket_idx] = hash_h2(hash_code);
+      index.buckets[bucket_idx] = value;
+      return was_deleted;
+    }
+    group_idx = (group_idx + step) & index.groups_mask;
+  }
+}
+
+// Returns false if the value was not found. On success, <tombstone>
+// is set to true if a tombstone had to be left behind
+static bool index_delete(INDEX &index, uint32 hash_code, uint32 value, bool &tombstone) {
+  uint8 h2 = hash_h2(hash_code);
+  uint32 group_idx = hash_h1(hash_code) & index.groups_mask;
+  for (uint32 step=1 ; ; step++) {
+    uint8 *group = index.ctrl + group_idx * GROUP_SIZE;
+    for (uint32 mask = group_match(group, h2) ; mask != 0 ; mask &= mask - 1) {
+      uint32 bucket_idx = group_idx * GROUP_SIZE + count_trailing_zeros(mask);
+      if (index.buckets[bucket_idx] == value) {
+        // If the group has an empty bucket, every probe sequence that reaches
+        // it stops here, so there's no need to leave a tombstone behind
+        tombstone = group_match_empty(group) == 0;
+        index.ctrl[bucket_idx] = tombstone ? CTRL_DELETED : CTRL_EMPTY;
+        return true;
+      }
+    }
+    if (group_match_empty(group) != 0)
+      return false;
+    group_idx = (group_idx + step) & index.groups_mask;
+  }
+}
+
+static int64 index_lookup(INDEX &index, OBJ *slots, uint32 *hash_codes, OBJ value, uint32 hash_code) {
+  uint8 h2 = hash_h2(hash_code);
+  uint32 group_idx = hash_h1(hash_code) & index.groups_mask;
+  for (uint32 step=1 ; ; step++) {
+    uint8 *group = index.ctrl + group_idx * GROUP_SIZE;
+    for (uint32 mask = group_match(group, h2) ; mask != 0 ; mask &= mask - 1) {
+      uint32 entry = index.buckets[group_idx * GROUP_SIZE + count_trailing_zeros(mask)];
+      if (hash_codes[entry] == hash_code && comp_objs(value, slots[entry]) == 0)
+        return entry;
+    }
+    if (group_match_empty(group) != 0)
+      return -1;
+    group_idx = (group_idx + step) & index.groups_mask;
+  }
 }
 
-NODE empty_node() {
-  return node(0xFFFFFFFFU, 0xFFFFFFFFU);
+// Returns the number of groups that have to be probed to find
+// the bucket pointing to <value>, or 0 if there's no such bucket
+static uint32 index_probe_length(INDEX &index, uint32 hash_code, uint32 value) {
+  uint8 h2 = hash_h2(hash_code);
+  uint32 group_idx = hash_h1(hash_code) & index.groups_mask;
+  for (uint32 step=1 ; ; step++) {
+    uint8 *group = index.ctrl + group_idx * GROUP_SIZE;
+    for (uint32 mask = group_match(group, h2) ; mask != 0 ; mask &= mask - 1)
+      if (index.buckets[group_idx * GROUP_SIZE + count_trailing_zeros(mask)] == value)
+        return step;
+    if (group_match_empty(group) != 0)
+      return 0;
+    group_idx = (group_idx + step) & index.groups_mask;
+  }
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
-const int BYTES_PER_ENTRY         = sizeof(OBJ) + sizeof(NODE) + sizeof(uint32) + sizeof(uint32);
-const int UPDATE_BYTES_PER_ENTRY  = sizeof(OBJ) + sizeof(NODE) + sizeof(uint32) + sizeof(uint32);
+const int64 MAX_DIRECT_INT = 65535;
 
+// Returns true if <value> belongs in a direct index rather than in the hashtable,
+// in which case <key> is set to its position in the index for its type
+static bool is_direct(OBJ value, bool &is_symbol, uint32 &key) {
+  if (is_symb(value)) {
+    is_symbol = true;
+    key = get_symb_idx(value);
+    return true;
+  }
+  if (is_int(value)) {
+    int64 int_value = get_int(value);
+    if (int_value >= 0 & int_value <= MAX_DIRECT_INT) {
+      is_symbol = false;
+      key = int_value;
+      return true;
+    }
+  }
+  return false;
+}
 
-OBJ *slot_array(void *ptr) {
-  return (OBJ *) ptr;
+static bool is_direct(OBJ value) {
+  bool is_symbol;
+  uint32 key;
+  return is_direct(value, is_symbol, key);
 }
 
-NODE *node_array(void *ptr, uint32 capacity) {
-  return (NODE *)(slot_array(ptr) + capacity);
+static void direct_index_init(DIRECT_INDEX &index) {
+  index.surrs = NULL;
+  index.size = 0;
 }
 
-uint32 *hashtable_ptr(void *ptr, uint32 capacity) {
-  return (uint32 *)(node_array(ptr, capacity) + capacity);
+static void direct_index_cleanup(DIRECT_INDEX &index) {
+  if (index.surrs != NULL)
+    free_obj(index.surrs, index.size * sizeof(uint32));
 }
 
-uint32 *ref_count_array(void *ptr, uint32 capacity) {
-  return (uint32 *)(hashtable_ptr(ptr, capacity) + capacity);
+static uint32 direct_index_get(DIRECT_INDEX &index, uint32 key) {
+  return key < index.size ? index.surrs[key] : INVALID_INDEX;
 }
 
-uint32 *surr_array(void *ptr, uint32 capacity) {
-  return (uint32 *)(hashtable_ptr(ptr, capacity) + capacity);
+static void direct_index_set(DIRECT_INDEX &index, uint32 key, uint32 surr) {
+  uint32 size = index.size;
+  if (key >= size) {
+    uint32 new_size = size != 0 ? 2 * size : 64;
+    while (key >= new_size)
+      new_size *= 2;
+    uint32 *new_surrs = (uint32 *) new_obj(new_size * sizeof(uint32));
+    if (size > 0) {
+      memcpy(new_surrs, index.surrs, size * sizeof(uint32));
+      free_obj(index.surrs, size * sizeof(uint32));
+    }
+    memset(new_surrs + size, 0xFF, (new_size - size) * sizeof(uint32));
+    index.surrs = new_surrs;
+    index.size = new_size;
+  }
+  index.surrs[key] = surr;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Clears the index and inserts all the non-blank slots in [0, count)
+// whose values are not in one of the direct indexes
+static void index_rebuild(INDEX &index, uint32 buckets_count, OBJ *slots, uint32 *hash_codes, uint32 count) {
+  memset(index.ctrl, CTRL_EMPTY, buckets_count);
+  for (uint32 i=0 ; i < count ; i++)
+    if (!is_blank_obj(slots[i]) && !is_direct(slots[i]))
+      index_insert(index, hash_codes[i], i);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -55,112 +346,108 @@ void reset_slot(OBJ *slot, uint32 first_free) {
   assert(get_physical_type(*slot) == TYPE_BLANK_OBJ);
 }
 
-static void hashtable_clear(void *ptr, uint32 capacity) {
-  OBJ *slots = slot_array(ptr);
-  for (uint32 i=0 ; i < capacity ; i++)
+static void slots_clear(OBJ *slots, uint32 from, uint32 to) {
+  for (uint32 i=from ; i < to ; i++)
     reset_slot(slots+i, i+1);
-  uint32 *hash_table = hashtable_ptr(ptr, capacity);
-  memset(hash_table, 0xFF, capacity * sizeof(uint32));
-  // Initializing the array of node is not stricly necessary
-  NODE *nodes = node_array(ptr, capacity);
-  for (uint32 i=0 ; i < capacity ; i++)
-    nodes[i] = empty_node();
-}
-
-static void hashtable_insert(void *ptr, uint32 capacity, uint32 hash_code, uint32 value) {
-  uint32 *hashtable = hashtable_ptr(ptr, capacity);
-  NODE *nodes = node_array(ptr, capacity);
-  uint32 index = hash_code % capacity;
-  uint32 entry = hashtable[index];
-  hashtable[index] = value;
-  nodes[value] = node(entry, hash_code);
-}
-
-static void hashtable_delete(void *ptr, uint32 capacity, uint32 value) {
-  uint32 *hashtable = hashtable_ptr(ptr, capacity);
-  NODE *nodes = node_array(ptr, capacity);
-  NODE del_node = nodes[value];
-  nodes[value] = empty_node(); // Not strictly necessary
-  uint32 index = del_node.hash_code % capacity;
-  uint32 entry = hashtable[index];
-  assert(entry >= 0 & entry < capacity);
-  // We first check to see if the deleted node is the first one in the list
-  if (entry == value) {
-    hashtable[index] = del_node.next; // Note that <next> can be EMPTY_SLOT_MARKER
-    return;
-  }
-  // Here <entry> is the index of the current cell
-  // We already know that the current cell is not the one we're looking for.
-  NODE node = nodes[entry];
-  while (node.next != value) {
-    entry = node.next;
-    assert(entry >= 0 & entry < capacity);
-    node = nodes[entry];
-  }
-  // We've finally reached the cell before the one we are deleting
-  // Again <entry> is the index of the current cell, and <node> is its content
-  node.next = del_node.next;
-  nodes[entry] = node;
 }
 
-static int64 hashtable_lookup(void *ptr, uint32 capacity, OBJ value, uint32 hash_code) {
+// Copies slots, hash codes and the ref count/surrogate array into a larger block
+static void block_copy(void *src_ptr, uint32 src_cpty, void *dest_ptr, uint32 dest_cpty) {
+  assert(dest_cpty > src_cpty);
+
+  OBJ *dest_slots = slot_array(dest_ptr);
+  memcpy(dest_slots, slot_array(src_ptr), src_cpty * sizeof(OBJ));
+  slots_clear(dest_slots, src_cpty, dest_cpty);
+
+  memcpy(hash_code_array(dest_ptr, dest_cpty), hash_code_array(src_ptr, src_cpty), src_cpty * sizeof(uint32));
+
+  uint32 *dest_counts = ref_count_array(dest_ptr, dest_cpty);
+  memcpy(dest_counts, ref_count_array(src_ptr, src_cpty), src_cpty * sizeof(uint32));
+  memset(dest_counts + src_cpty, 0, (dest_cpty - src_cpty) * sizeof(uint32));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static INDEX store_index(VALUE_STORE *store) {
+  return index_view(store->index, num_buckets(store->capacity));
+}
+
+static INDEX old_store_index(VALUE_STORE *store) {
+  assert(store->old_index != NULL);
+  return index_view(store->old_index, store->old_buckets);
+}
+
+static int64 store_lookup(VALUE_STORE *store, OBJ value, uint32 hash_code) {
+  void *ptr = store->ptr;
+  uint32 capacity = store->capacity;
   OBJ *slots = slot_array(ptr);
-  NODE *nodes = node_array(ptr, capacity);
-  uint32 *hashtable = hashtable_ptr(ptr, capacity);
-  uint32 index = hash_code % capacity;
-  uint32 entry = hashtable[index];
-  while (entry != EMPTY_SLOT_MARKER) {
-    NODE node = nodes[entry];
-    if (node.hash_code == hash_code && comp_objs(value, slots[entry]) == 0)
-      return entry;
-    entry = node.next;
+  uint32 *hash_codes = hash_code_array(ptr, capacity);
+
+  INDEX index = store_index(store);
+  int64 surr = index_lookup(index, slots, hash_codes, value, hash_code);
+  if (surr == -1 && store->old_index != NULL) {
+    INDEX old_index = old_store_index(store);
+    surr = index_lookup(old_index, slots, hash_codes, value, hash_code);
   }
-  return -1;
+  return surr;
 }
 
-static void hashtable_copy(void *src_ptr, uint32 src_cpty, void *dest_ptr, uint32 dest_cpty) {
-  assert(dest_cpty > src_cpty);
+// Moves up to <count> buckets from the old index to the new one,
+// and releases the old index once all of them have been moved
+static void migrate_buckets(VALUE_STORE *store, uint32 count) {
+  if (store->old_index == NULL)
+    return;
 
-  OBJ *src_slots = slot_array(src_ptr);
-  OBJ *dest_slots = slot_array(dest_ptr);
-  memcpy(dest_slots, src_slots, src_cpty * sizeof(OBJ));
-  for (uint32 i=src_cpty ; i < dest_cpty ; i++)
-    reset_slot(dest_slots+i, i+1);
-
-  uint32 *dest_hashtable = hashtable_ptr(dest_ptr, dest_cpty);
-  memset(dest_hashtable, 0xFF, dest_cpty * sizeof(uint32));
-
-  // Initializing the new array of node is not stricly necessary
-  NODE *dest_nodes = node_array(dest_ptr, dest_cpty);
-  for (uint32 i=0 ; i < dest_cpty ; i++)
-    dest_nodes[i] = empty_node();
-
-  NODE *src_nodes = node_array(src_ptr, src_cpty);
-  for (uint32 i=0 ; i < src_cpty ; i++)
-    if (!is_blank_obj(src_slots[i]))
-      hashtable_insert(dest_ptr, dest_cpty, src_nodes[i].hash_code, i);
-}
-
-// int64 ref_hashtable_lookup(void *ptr, uint32 capacity, OBJ value, uint32 hash_code) {
-//   OBJ *slots = slot_array(ptr);
-//   for (uint32 i=0 ; i < capacity ; i++) {
-//     OBJ slot = slots[i];
-//     if (!is_blank_obj(slot) && comp_objs(value, slot) == 0)
-//       return i;
-//   }
-//   return -1;
-// }
-//
-// int64 hashtable_lookup(void *ptr, uint32 capacity, OBJ value, uint32 hash_code) {
-//   int64 ref_res = ref_hashtable_lookup(ptr, capacity, value, hash_code);
-//   int64 res = hashtable_lookup_(ptr, capacity, value, hash_code);
-//   assert(res == ref_res);
-//   if (res != ref_res)
-//     fail();
-//   return res;
-// }
+  INDEX old_index = old_store_index(store);
+  INDEX index = store_index(store);
+  uint32 *hash_codes = hash_code_array(store->ptr, store->capacity);
+
+  uint32 old_buckets = store->old_buckets;
+  uint32 from = store->migrated;
+  uint32 to = count < old_buckets - from ? from + count : old_buckets;
+
+  uint32 tombstones = store->tombstones;
+  for (uint32 i=from ; i < to ; i++)
+    if (old_index.ctrl[i] < CTRL_EMPTY) {
+      // Leaving a tombstone, so as not to break the probe
+      // sequences of the entries that are yet to be migrated
+      old_index.ctrl[i] = CTRL_DELETED;
+      uint32 surr = old_index.buckets[i];
+      if (index_insert(index, hash_codes[surr], surr))
+        tombstones--;
+    }
+  store->tombstones = tombstones;
+
+  if (to == old_buckets) {
+    free_obj(store->old_index, index_size(old_buckets));
+    store->old_index = NULL;
+    store->old_buckets = 0;
+    store->migrated = 0;
+  }
+  else
+    store->migrated = to;
+}
 
 ////////////////////////////////////////////////////////////////////////////////
+static uint32 dirty_chunks_size(uint32 capacity) {
+  uint32 chunks_count = (capacity + SNAPSHOT_CHUNK_SIZE - 1) / SNAPSHOT_CHUNK_SIZE;
+  return (chunks_count + 63) / 64 * sizeof(uint64);
+}
+
+// All chunks start out dirty, since there's no snapshot they could be shared with
+static void reset_dirty_chunks(VALUE_STORE *store, uint32 old_capacity, uint32 new_capacity) {
+  if (store->dirty_chunks != NULL)
+    free_obj(store->dirty_chunks, dirty_chunks_size(old_capacity));
+  uint32 size = dirty_chunks_size(new_capacity);
+  store->dirty_chunks = (uint64 *) new_obj(size);
+  memset(store->dirty_chunks, 0xFF, size);
+}
+
+static void mark_dirty(VALUE_STORE *store, uint32 surr) {
+  uint32 chunk_idx = surr / SNAPSHOT_CHUNK_SIZE;
+  store->dirty_chunks[chunk_idx / 64] |= 1ULL << (chunk_idx % 64);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 const uint32 INIT_SIZE = 4;
@@ -175,12 +462,21 @@ uint32 calc_capacity(uint32 min_capacity) {
 ////////////////////////////////////////////////////////////////////////////////
 
 void value_store_init(VALUE_STORE *store) {
-  void *ptr = new_obj(INIT_SIZE * BYTES_PER_ENTRY);
+  void *ptr = new_obj(block_size(INIT_SIZE));
   store->ptr = ptr;
   store->capacity = INIT_SIZE;
   store->usage = 0;
   store->first_free = 0;
-  hashtable_clear(ptr, INIT_SIZE);
+  store->index = new_index(num_buckets(INIT_SIZE));
+  store->tombstones = 0;
+  store->old_index = NULL;
+  store->old_buckets = 0;
+  store->migrated = 0;
+  direct_index_init(store->symbols);
+  direct_index_init(store->ints);
+  store->dirty_chunks = NULL;
+  reset_dirty_chunks(store, 0, INIT_SIZE);
+  slots_clear(slot_array(ptr), 0, INIT_SIZE);
   memset(ref_count_array(ptr, INIT_SIZE), 0, INIT_SIZE * sizeof(uint32));
 }
 
@@ -189,7 +485,13 @@ void value_store_cleanup(VALUE_STORE *store) {
   OBJ *slots = slot_array(store->ptr);
   for (uint32 i=0 ; i < capacity ; i++)
     release(slots[i]);
-  free_obj(slots, capacity * BYTES_PER_ENTRY);
+  free_obj(slots, block_size(capacity));
+  free_obj(store->index, index_size(num_buckets(capacity)));
+  if (store->old_index != NULL)
+    free_obj(store->old_index, index_size(store->old_buckets));
+  direct_index_cleanup(store->symbols);
+  direct_index_cleanup(store->ints);
+  free_obj(store->dirty_chunks, dirty_chunks_size(capacity));
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -198,8 +500,11 @@ void value_store_updates_init(VALUE_STORE *store, VALUE_STORE_UPDATES *updates)
   updates->capacity = 0;
   // Not strictly necessary
   updates->ptr = NULL;
+  updates->index = NULL;
   updates->count = 0;
   updates->first_free = 0;
+  direct_index_init(updates->symbols);
+  direct_index_init(updates->ints);
 }
 
 void value_store_updates_cleanup(VALUE_STORE_UPDATES *updates) {
@@ -209,7 +514,10 @@ void value_store_updates_cleanup(VALUE_STORE_UPDATES *updates) {
 ////////////////////////////////////////////////////////////////////////////////
 
 uint32 value_store_insert(VALUE_STORE *store, VALUE_STORE_UPDATES *updates, OBJ value) {
-  uint32 hash_code = compute_hash_code(value);
+  bool is_symbol;
+  uint32 key;
+  bool direct = is_direct(value, is_symbol, key);
+  uint32 hash_code = direct ? 0 : compute_hash_code(value);
 
   void *ptr = updates->ptr;
   uint32 capacity = updates->capacity;
@@ -217,25 +525,35 @@ uint32 value_store_insert(VALUE_STORE *store, VALUE_STORE_UPDATES *updates, OBJ
   assert(count <= capacity);
 
   if (count == capacity) {
+    // Updates are short-lived, so their index is simply rebuilt in one go
     uint32 new_capacity = capacity != 0 ? 2 * capacity : 32;
-    void *new_ptr = new_obj(new_capacity * UPDATE_BYTES_PER_ENTRY);
+    void *new_ptr = new_obj(block_size(new_capacity));
+    uint32 new_buckets = num_buckets(new_capacity);
+    void *new_idx = new_obj(index_size(new_buckets));
     if (capacity > 0) {
-      hashtable_copy(ptr, capacity, new_ptr, new_capacity);
-      uint32 *surrs = surr_array(ptr, capacity);
-      uint32 *new_surrs = surr_array(new_ptr, new_capacity);
-      memcpy(new_surrs, surrs, capacity * sizeof(uint32));
-      memset(new_surrs + capacity, 0, (new_capacity - capacity) * sizeof(uint32));
-      free_obj(ptr, capacity * UPDATE_BYTES_PER_ENTRY);
+      block_copy(ptr, capacity, new_ptr, new_capacity);
+      free_obj(ptr, block_size(capacity));
+      free_obj(updates->index, index_size(num_buckets(capacity)));
     }
     else
-      hashtable_clear(new_ptr, new_capacity);
+      slots_clear(slot_array(new_ptr), 0, new_capacity);
+    INDEX index = index_view(new_idx, new_buckets);
+    index_rebuild(index, new_buckets, slot_array(new_ptr), hash_code_array(new_ptr, new_capacity), count);
     updates->capacity = capacity = new_capacity;
     updates->ptr = ptr = new_ptr;
+    updates->index = new_idx;
   }
 
   OBJ *values = slot_array(ptr);
   values[count] = value;
-  hashtable_insert(ptr, capacity, hash_code, count);
+  hash_code_array(ptr, capacity)[count] = hash_code;
+  if (direct) {
+    direct_index_set(is_symbol ? updates->symbols : updates->ints, key, count);
+  }
+  else {
+    INDEX index = index_view(updates->index, num_buckets(capacity));
+    index_insert(index, hash_code, count);
+  }
   uint32 first_free = count == 0 ? store->first_free : updates->first_free;
   uint32 *surrs = surr_array(ptr, capacity);
   surrs[count] = first_free;
@@ -265,32 +583,61 @@ void value_store_apply(VALUE_STORE *store, VALUE_STORE_UPDATES *updates) {
   uint32 new_usage = usage + count;
 
   if (store_capacity < new_usage) {
+    // Completing any migration still in progress, there can only be one at a time
+    migrate_buckets(store, store->old_buckets);
+
     uint32 new_capacity = calc_capacity(new_usage);
-    void *new_ptr = new_obj(new_capacity * BYTES_PER_ENTRY);
-    hashtable_copy(ptr, store_capacity, new_ptr, new_capacity);
-    uint32 *ref_counts = ref_count_array(ptr, store_capacity);
-    uint32 *new_ref_counts = ref_count_array(new_ptr, new_capacity);
-    memcpy(new_ref_counts, ref_counts, store_capacity * sizeof(uint32));
-    memset(new_ref_counts+store_capacity, 0, (new_capacity-store_capacity) * sizeof(uint32));
-    free_obj(ptr, store_capacity * BYTES_PER_ENTRY);
+    void *new_ptr = new_obj(block_size(new_capacity));
+    block_copy(ptr, store_capacity, new_ptr, new_capacity);
+    free_obj(ptr, block_size(store_capacity));
+
+    store->old_index = store->index;
+    store->old_buckets = num_buckets(store_capacity);
+    store->migrated = 0;
+    store->index = new_index(num_buckets(new_capacity));
+    store->tombstones = 0;
+    reset_dirty_chunks(store, store_capacity, new_capacity);
+
     store->ptr = ptr = new_ptr;
     store->capacity = store_capacity = new_capacity;
   }
+  else if (8 * (new_usage + store->tombstones) > 7 * num_buckets(store_capacity)) {
+    // Too many tombstones, probe sequences would get too long
+    migrate_buckets(store, store->old_buckets);
+    INDEX index = store_index(store);
+    index_rebuild(index, num_buckets(store_capacity), slot_array(ptr), hash_code_array(ptr, store_capacity), store_capacity);
+    store->tombstones = 0;
+  }
 
   OBJ *slots = slot_array(ptr);
+  uint32 *store_hash_codes = hash_code_array(ptr, store_capacity);
+  INDEX index = store_index(store);
 
   uint32 update_cpty = updates->capacity;
   void *update_ptr = updates->ptr;
   OBJ *values = slot_array(update_ptr);
-  NODE *nodes = node_array(update_ptr, update_cpty);
+  uint32 *hash_codes = hash_code_array(update_ptr, update_cpty);
   uint32 *surrs = surr_array(update_ptr, update_cpty);
+  uint32 tombstones = store->tombstones;
   for (uint32 i=0 ; i < count ; i++) {
     uint32 surr = surrs[i];
-    slots[surr] = copy_obj(values[i]);
-    hashtable_insert(ptr, store_capacity, nodes[i].hash_code, surr);
+    uint32 hash_code = hash_codes[i];
+    OBJ value = values[i];
+    bool is_symbol;
+    uint32 key;
+    slots[surr] = copy_obj(value);
+    store_hash_codes[surr] = hash_code;
+    mark_dirty(store, surr);
+    if (is_direct(value, is_symbol, key))
+      direct_index_set(is_symbol ? store->symbols : store->ints, key, surr);
+    else if (index_insert(index, hash_code, surr))
+      tombstones--;
   }
   store->usage = new_usage;
   store->first_free = updates->first_free;
+  store->tombstones = tombstones;
+
+  migrate_buckets(store, MIGRATION_STEP + 4 * count);
 }
 
 void value_store_add_ref(VALUE_STORE *store, uint32 surr) {
@@ -299,6 +646,12 @@ void value_store_add_ref(VALUE_STORE *store, uint32 surr) {
   ref_counts[surr]++;
 }
 
+void value_store_add_refs(VALUE_STORE *store, uint32 surr, uint32 count) {
+  assert(surr < store->capacity);
+  uint32 *ref_counts = ref_count_array(store->ptr, store->capacity);
+  ref_counts[surr] += count;
+}
+
 void value_store_release(VALUE_STORE *store, uint32 surr) {
   void *ptr = store->ptr;
   uint32 capacity = store->capacity;
@@ -308,16 +661,116 @@ void value_store_release(VALUE_STORE *store, uint32 surr) {
   assert(count != 0);
   if (count == 1) {
     OBJ *slot = slot_array(ptr) + surr;
+    bool is_symbol;
+    uint32 key;
+    if (is_direct(*slot, is_symbol, key)) {
+      DIRECT_INDEX &direct_index = is_symbol ? store->symbols : store->ints;
+      assert(direct_index_get(direct_index, key) == surr);
+      direct_index.surrs[key] = INVALID_INDEX;
+    }
+    else {
+      uint32 hash_code = hash_code_array(ptr, capacity)[surr];
+      bool tombstone;
+      bool found = false;
+      if (store->old_index != NULL) {
+        INDEX old_index = old_store_index(store);
+        found = index_delete(old_index, hash_code, surr, tombstone);
+      }
+      if (!found) {
+        INDEX index = store_index(store);
+        found = index_delete(index, hash_code, surr, tombstone);
+        assert(found);
+        if (tombstone)
+          store->tombstones++;
+      }
+    }
     release(*slot);
     reset_slot(slot, store->first_free);
+    mark_dirty(store, surr);
     store->first_free = surr;
     store->usage--;
-    hashtable_delete(ptr, capacity, surr);
+    ref_counts[surr] = 0;
+    migrate_buckets(store, MIGRATION_STEP);
   }
   else
     ref_counts[surr] = count - 1;
 }
 
+// Releases several references to the same value at once
+void value_store_release_refs(VALUE_STORE *store, uint32 surr, uint32 count) {
+  assert(surr < store->capacity && count > 0);
+  uint32 *ref_counts = ref_count_array(store->ptr, store->capacity);
+  assert(ref_counts[surr] >= count);
+  ref_counts[surr] -= count - 1;
+  value_store_release(store, surr);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Below this size std::sort() beats the counting passes of the radix sort
+const uint32 RADIX_SORT_MIN_SIZE = 1024;
+
+// LSD radix sort with 16-bit digits. The second pass is skipped
+// if all the surrogates fit in 16 bits, as is often the case
+static void sort_surrs(std::vector<uint32> &surrs) {
+  uint32 count = surrs.size();
+  if (count < RADIX_SORT_MIN_SIZE) {
+    std::sort(surrs.begin(), surrs.end());
+    return;
+  }
+
+  uint32 max_surr = *std::max_element(surrs.begin(), surrs.end());
+  uint32 passes = max_surr > 0xFFFF ? 2 : 1;
+
+  std::vector<uint32> buffer(count);
+  std::vector<uint32> offsets(0x10000);
+  uint32 *src = surrs.data();
+  uint32 *dest = buffer.data();
+
+  for (uint32 pass=0 ; pass < passes ; pass++) {
+    uint32 shift = 16 * pass;
+    std::fill(offsets.begin(), offsets.end(), 0);
+    for (uint32 i=0 ; i < count ; i++)
+      offsets[(src[i] >> shift) & 0xFFFF]++;
+    uint32 total = 0;
+    for (uint32 i=0 ; i < 0x10000 ; i++) {
+      uint32 digit_count = offsets[i];
+      offsets[i] = total;
+      total += digit_count;
+    }
+    for (uint32 i=0 ; i < count ; i++)
+      dest[offsets[(src[i] >> shift) & 0xFFFF]++] = src[i];
+    std::swap(src, dest);
+  }
+
+  if (src != surrs.data())
+    surrs.swap(buffer);
+}
+
+// Each distinct surrogate is updated only once, with the number of times it occurs.
+// Since the surrogates are sorted, the reference counts are also accessed in order
+static void apply_ref_batch(VALUE_STORE *store, std::vector<uint32> &surrs, bool release) {
+  sort_surrs(surrs);
+  uint32 count = surrs.size();
+  uint32 run_start = 0;
+  for (uint32 i=1 ; i <= count ; i++)
+    if (i == count || surrs[i] != surrs[run_start]) {
+      if (release)
+        value_store_release_refs(store, surrs[run_start], i - run_start);
+      else
+        value_store_add_refs(store, surrs[run_start], i - run_start);
+      run_start = i;
+    }
+}
+
+void value_store_add_ref_batch(VALUE_STORE *store, std::vector<uint32> &surrs) {
+  apply_ref_batch(store, surrs, false);
+}
+
+void value_store_release_batch(VALUE_STORE *store, std::vector<uint32> &surrs) {
+  apply_ref_batch(store, surrs, true);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 OBJ lookup_surrogate(VALUE_STORE *store, int64 surr) {
@@ -327,28 +780,348 @@ OBJ lookup_surrogate(VALUE_STORE *store, int64 surr) {
 }
 
 int64 lookup_value(VALUE_STORE *store, OBJ value) {
-  return hashtable_lookup(store->ptr, store->capacity, value, compute_hash_code(value));
+  bool is_symbol;
+  uint32 key;
+  if (is_direct(value, is_symbol, key)) {
+    uint32 surr = direct_index_get(is_symbol ? store->symbols : store->ints, key);
+    return surr != INVALID_INDEX ? (int64) surr : -1;
+  }
+  return store_lookup(store, value, compute_hash_code(value));
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
-int64 lookup_value_ex(VALUE_STORE *store, VALUE_STORE_UPDATES *updates, OBJ value) {
-  uint32 hash_code = compute_hash_code(value);
-  int64 surr = hashtable_lookup(store->ptr, store->capacity, value, hash_code);
-  if (surr != -1)
-    return surr;
+static int64 updates_lookup(VALUE_STORE_UPDATES *updates, OBJ value, uint32 hash_code) {
   uint32 capacity = updates->capacity;
   if (capacity > 0) {
     void *ptr = updates->ptr;
-    int64 index = hashtable_lookup(ptr, capacity, value, hash_code);
-    if (index >= 0)
-      return surr_array(ptr, capacity)[index];
+    INDEX index = index_view(updates->index, num_buckets(capacity));
+    int64 idx = index_lookup(index, slot_array(ptr), hash_code_array(ptr, capacity), value, hash_code);
+    if (idx >= 0)
+      return surr_array(ptr, capacity)[idx];
   }
   return -1;
 }
 
+int64 lookup_value_ex(VALUE_STORE *store, VALUE_STORE_UPDATES *updates, OBJ value) {
+  bool is_symbol;
+  uint32 key;
+  if (is_direct(value, is_symbol, key)) {
+    uint32 surr = direct_index_get(is_symbol ? store->symbols : store->ints, key);
+    if (surr != INVALID_INDEX)
+      return surr;
+    uint32 idx = direct_index_get(is_symbol ? updates->symbols : updates->ints, key);
+    if (idx != INVALID_INDEX)
+      return surr_array(updates->ptr, updates->capacity)[idx];
+    return -1;
+  }
+
+  uint32 hash_code = compute_hash_code(value);
+  int64 surr = store_lookup(store, value, hash_code);
+  if (surr != -1)
+    return surr;
+  return updates_lookup(updates, value, hash_code);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Values are looked up in batches of LOOKUP_BATCH_SIZE: the hash codes of
+// the whole batch are computed first, and the first group of control bytes
+// and bucket entries each of them is going to probe is prefetched, so that
+// by the time the values are actually resolved those cache lines are (or are
+// being) loaded, and the misses of different values overlap instead of being
+// serialized. Direct values need no probing, and are resolved right away
+
+const uint32 LOOKUP_BATCH_SIZE = 16;
+
+static inline void prefetch(const void *address) {
+#ifdef VALUE_STORE_USE_SSE2
+  _mm_prefetch((const char *) address, _MM_HINT_T0);
+#elif defined(__GNUC__)
+  __builtin_prefetch(address);
+#endif
+}
+
+static inline void prefetch_home_group(INDEX &index, uint32 hash_code) {
+  uint32 group_idx = hash_h1(hash_code) & index.groups_mask;
+  prefetch(index.ctrl + group_idx * GROUP_SIZE);
+  prefetch(index.buckets + group_idx * GROUP_SIZE);
+}
+
+// <updates> can be NULL
+static void lookup_values_batch(VALUE_STORE *store, VALUE_STORE_UPDATES *updates, OBJ *values, uint32 count, int64 *surrs) {
+  assert(count <= LOOKUP_BATCH_SIZE);
+
+  uint32 hash_codes[LOOKUP_BATCH_SIZE];
+  uint32 pending = 0;
+
+  INDEX index = store_index(store);
+  bool has_updates = updates != NULL && updates->capacity > 0;
+  INDEX updates_index;
+  if (has_updates)
+    updates_index = index_view(updates->index, num_buckets(updates->capacity));
+
+  for (uint32 i=0 ; i < count ; i++) {
+    OBJ value = values[i];
+    bool is_symbol;
+    uint32 key;
+    if (is_direct(value, is_symbol, key)) {
+      uint32 surr = direct_index_get(is_symbol ? store->symbols : store->ints, key);
+      if (surr == INVALID_INDEX && updates != NULL) {
+        uint32 idx = direct_index_get(is_symbol ? updates->symbols : updates->ints, key);
+        if (idx != INVALID_INDEX)
+          surr = surr_array(updates->ptr, updates->capacity)[idx];
+      }
+      surrs[i] = surr != INVALID_INDEX ? (int64) surr : -1;
+    }
+    else {
+      uint32 hash_code = compute_hash_code(value);
+      hash_codes[i] = hash_code;
+      pending |= 1U << i;
+      prefetch_home_group(index, hash_code);
+      if (has_updates)
+        prefetch_home_group(updates_index, hash_code);
+    }
+  }
+
+  for ( ; pending != 0 ; pending &= pending - 1) {
+    uint32 i = count_trailing_zeros(pending);
+    OBJ value = values[i];
+    uint32 hash_code = hash_codes[i];
+    int64 surr = store_lookup(store, value, hash_code);
+    if (surr == -1 && updates != NULL)
+      surr = updates_lookup(updates, value, hash_code);
+    surrs[i] = surr;
+  }
+}
+
+void lookup_values(VALUE_STORE *store, OBJ *values, uint32 count, int64 *surrs) {
+  for (uint32 i=0 ; i < count ; i += LOOKUP_BATCH_SIZE) {
+    uint32 size = count - i < LOOKUP_BATCH_SIZE ? count - i : LOOKUP_BATCH_SIZE;
+    lookup_values_batch(store, NULL, values + i, size, surrs + i);
+  }
+}
+
+void lookup_values_ex(VALUE_STORE *store, VALUE_STORE_UPDATES *updates, OBJ *values, uint32 count, int64 *surrs) {
+  for (uint32 i=0 ; i < count ; i += LOOKUP_BATCH_SIZE) {
+    uint32 size = count - i < LOOKUP_BATCH_SIZE ? count - i : LOOKUP_BATCH_SIZE;
+    lookup_values_batch(store, updates, values + i, size, surrs + i);
+  }
+}
+
+void lookup_or_insert_values(VALUE_STORE *store, VALUE_STORE_UPDATES *updates, OBJ *values, uint32 count, uint32 *surrs) {
+  int64 batch_surrs[LOOKUP_BATCH_SIZE];
+
+  for (uint32 i=0 ; i < count ; i += LOOKUP_BATCH_SIZE) {
+    uint32 size = count - i < LOOKUP_BATCH_SIZE ? count - i : LOOKUP_BATCH_SIZE;
+    lookup_values_batch(store, updates, values + i, size, batch_surrs);
+    for (uint32 j=0 ; j < size ; j++) {
+      int64 surr = batch_surrs[j];
+      if (surr == -1) {
+        // The same value may have been inserted a moment ago, for an earlier element of the batch
+        OBJ value = values[i + j];
+        surr = lookup_value_ex(store, updates, value);
+        if (surr == -1) {
+          add_ref(value);
+          surr = value_store_insert(store, updates, value);
+        }
+      }
+      surrs[i + j] = surr;
+    }
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static uint64 store_footprint(VALUE_STORE *store) {
+  uint32 capacity = store->capacity;
+  uint64 footprint = block_size(capacity) + index_size(num_buckets(capacity));
+  if (store->old_index != NULL)
+    footprint += index_size(store->old_buckets);
+  return footprint;
+}
+
+uint64 value_store_compact(VALUE_STORE *store, uint32 *surr_map, bool dry_run) {
+  void *ptr = store->ptr;
+  uint32 capacity = store->capacity;
+  uint32 usage = store->usage;
+  OBJ *slots = slot_array(ptr);
+
+  uint32 next_surr = 0;
+  for (uint32 i=0 ; i < capacity ; i++)
+    surr_map[i] = is_blank_obj(slots[i]) ? INVALID_INDEX : next_surr++;
+  assert(next_surr == usage);
+
+  uint32 new_capacity = calc_capacity(usage);
+  uint64 footprint = store_footprint(store);
+  uint64 new_footprint = block_size(new_capacity) + index_size(num_buckets(new_capacity));
+  assert(new_footprint <= footprint);
+
+  if (dry_run)
+    return footprint - new_footprint;
+
+  void *new_ptr = new_obj(block_size(new_capacity));
+  OBJ *new_slots = slot_array(new_ptr);
+  uint32 *hash_codes = hash_code_array(ptr, capacity);
+  uint32 *new_hash_codes = hash_code_array(new_ptr, new_capacity);
+  uint32 *ref_counts = ref_count_array(ptr, capacity);
+  uint32 *new_ref_counts = ref_count_array(new_ptr, new_capacity);
+
+  for (uint32 i=0 ; i < capacity ; i++) {
+    uint32 surr = surr_map[i];
+    if (surr != INVALID_INDEX) {
+      new_slots[surr] = slots[i];
+      new_hash_codes[surr] = hash_codes[i];
+      new_ref_counts[surr] = ref_counts[i];
+    }
+  }
+  slots_clear(new_slots, usage, new_capacity);
+  memset(new_ref_counts + usage, 0, (new_capacity - usage) * sizeof(uint32));
+
+  uint32 new_buckets = num_buckets(new_capacity);
+  void *new_idx = new_index(new_buckets);
+  INDEX index = index_view(new_idx, new_buckets);
+  for (uint32 i=0 ; i < usage ; i++)
+    if (!is_direct(new_slots[i]))
+      index_insert(index, new_hash_codes[i], i);
+
+  DIRECT_INDEX *direct_indexes[2] = {&store->symbols, &store->ints};
+  for (int i=0 ; i < 2 ; i++) {
+    uint32 *surrs = direct_indexes[i]->surrs;
+    uint32 size = direct_indexes[i]->size;
+    for (uint32 j=0 ; j < size ; j++)
+      if (surrs[j] != INVALID_INDEX)
+        surrs[j] = surr_map[surrs[j]];
+  }
+
+  free_obj(ptr, block_size(capacity));
+  free_obj(store->index, index_size(num_buckets(capacity)));
+  if (store->old_index != NULL)
+    free_obj(store->old_index, index_size(store->old_buckets));
+  reset_dirty_chunks(store, capacity, new_capacity);
+
+  store->ptr = new_ptr;
+  store->capacity = new_capacity;
+  store->first_free = usage;
+  store->index = new_idx;
+  store->tombstones = 0;
+  store->old_index = NULL;
+  store->old_buckets = 0;
+  store->migrated = 0;
+
+  return footprint - new_footprint;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void value_store_load(VALUE_STORE *store, OBJ *values, uint32 *ref_counts, uint32 count) {
+  assert(store->usage == 0 && store->old_index == NULL);
+
+  free_obj(store->ptr, block_size(store->capacity));
+  free_obj(store->index, index_size(num_buckets(store->capacity)));
+
+  uint32 capacity = calc_capacity(count);
+  void *ptr = new_obj(block_size(capacity));
+  OBJ *slots = slot_array(ptr);
+  uint32 *hash_codes = hash_code_array(ptr, capacity);
+  uint32 *counts = ref_count_array(ptr, capacity);
+
+  // Going backwards, so that the free list is sorted
+  uint32 usage = 0;
+  uint32 first_free = capacity;
+  for (uint32 i=capacity ; i-- > 0 ; ) {
+    if (i < count && !is_blank_obj(values[i])) {
+      OBJ value = values[i];
+      bool is_symbol;
+      uint32 key;
+      bool direct = is_direct(value, is_symbol, key);
+      if (direct)
+        direct_index_set(is_symbol ? store->symbols : store->ints, key, i);
+      slots[i] = value;
+      hash_codes[i] = direct ? 0 : compute_hash_code(value);
+      counts[i] = ref_counts[i];
+      usage++;
+    }
+    else {
+      reset_slot(slots + i, first_free);
+      counts[i] = 0;
+      first_free = i;
+    }
+  }
+
+  uint32 buckets_count = num_buckets(capacity);
+  store->index = new_index(buckets_count);
+  INDEX index = index_view(store->index, buckets_count);
+  index_rebuild(index, buckets_count, slots, hash_codes, capacity);
+  reset_dirty_chunks(store, store->capacity, capacity);
+
+  store->ptr = ptr;
+  store->capacity = capacity;
+  store->usage = usage;
+  store->first_free = first_free;
+  store->tombstones = 0;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 OBJ *value_store_slot_array(VALUE_STORE *store) {
   return slot_array(store->ptr);
 }
+
+uint32 *value_store_ref_count_array(VALUE_STORE *store) {
+  return ref_count_array(store->ptr, store->capacity);
+}
+
+bool value_store_chunk_is_dirty(VALUE_STORE *store, uint32 chunk_idx) {
+  assert(chunk_idx * (uint64) SNAPSHOT_CHUNK_SIZE < store->capacity);
+  return (store->dirty_chunks[chunk_idx / 64] >> (chunk_idx % 64)) & 1;
+}
+
+void value_store_clear_dirty_chunks(VALUE_STORE *store) {
+  memset(store->dirty_chunks, 0, dirty_chunks_size(store->capacity));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+uint32 value_store_probe_lengths(VALUE_STORE *store, uint32 *histogram, uint32 size) {
+  assert(size > 0);
+
+  void *ptr = store->ptr;
+  uint32 capacity = store->capacity;
+  OBJ *slots = slot_array(ptr);
+  uint32 *hash_codes = hash_code_array(ptr, capacity);
+  INDEX index = store_index(store);
+
+  memset(histogram, 0, size * sizeof(uint32));
+
+  uint32 max_length = 0;
+  for (uint32 i=0 ; i < capacity ; i++) {
+    if (is_blank_obj(slots[i]) || is_direct(slots[i]))
+      continue;
+
+    uint32 length = index_probe_length(index, hash_codes[i], i);
+    if (length == 0) {
+      // The entry has not been migrated yet
+      INDEX old_index = old_store_index(store);
+      length = index_probe_length(old_index, hash_codes[i], i);
+    }
+    assert(length > 0);
+
+    histogram[length < size ? length : size - 1]++;
+    if (length > max_length)
+      max_length = length;
+  }
+  return max_length;
+}
+
+void value_store_print_probe_lengths(VALUE_STORE *store) {
+  const uint32 SIZE = 16;
+  uint32 histogram[SIZE];
+  uint32 max_length = value_store_probe_lengths(store, histogram, SIZE);
+  printf("Value store: %u values, %u buckets, %u tombstones, longest probe: %u\n",
+    store->usage, num_buckets(store->capacity), store->tombstones, max_length);
+  if (store->old_index != NULL)
+    printf("  Resizing in progress: %u of %u old buckets migrated\n", store->migrated, store->old_buckets);
+  for (uint32 i=1 ; i < SIZE && i <= max_length ; i++)
+    printf("  %s%2u: %u\n", i == SIZE - 1 ? ">=" : "  ", i, histogram[i]);
+}